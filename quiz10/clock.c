@@ -0,0 +1,181 @@
+#include "mu.h"
+
+#include <asm-generic/fcntl.h>
+#include <linux/auxvec.h>
+#include <linux/elf.h>
+#include <linux/time.h>
+#include <string.h>
+
+/* Clock
+ *
+ * The kernel maps a small shared object, the vDSO, in every process; its
+ * clock_gettime reads the time from a page the kernel keeps up to date,
+ * no system call needed. We find it through the auxiliary vector, which
+ * the kernel hands to the process and shows in /proc/self/auxv, then look
+ * the function up in its dynamic symbol table. Without a vDSO we fall back
+ * to the system call.
+ */
+#ifndef DT_GNU_HASH
+#define DT_GNU_HASH 0x6ffffef5
+#endif
+
+typedef int (*clock_gettime_t)(int, struct timespec *);
+
+static clock_gettime_t vdso_clock_gettime;
+static int vdso_resolved;
+
+/* Where the vDSO is mapped, or 0 */
+static uint64_t vdso_base()
+{
+    int fd = SYSCALL2(__NR_open, "/proc/self/auxv", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    uint64_t base = 0;
+    uint64_t aux[32][2];
+    long len;
+    while (!base && (len = SYSCALL3(__NR_read, fd, aux, sizeof(aux))) > 0) {
+        for (long i = 0; i < len / (long) sizeof(aux[0]); ++i) {
+            if (aux[i][0] == AT_SYSINFO_EHDR) {
+                base = aux[i][1];
+                break;
+            }
+        }
+    }
+    SYSCALL1(__NR_close, fd);
+    return base;
+}
+
+static uint32_t gnu_hash(const char *name)
+{
+    uint32_t hash = 5381;
+    for (; *name; ++name)
+        hash = hash * 33 + (uint8_t) *name;
+    return hash;
+}
+
+static uint32_t sysv_hash(const char *name)
+{
+    uint32_t hash = 0;
+    for (; *name; ++name) {
+        hash = (hash << 4) + (uint8_t) *name;
+        uint32_t high = hash & 0xf0000000;
+        if (high)
+            hash ^= high >> 24;
+        hash &= ~high;
+    }
+    return hash;
+}
+
+/* Look a function up in the shared object mapped at base */
+static void *elf_lookup(uint64_t base, const char *name)
+{
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *) base;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+        return 0;
+
+    /* The addresses in the object are relative to its first segment */
+    Elf64_Phdr *phdr = (Elf64_Phdr *) (base + ehdr->e_phoff);
+    Elf64_Dyn *dyn = 0;
+    uint64_t bias = 0;
+    int loaded = 0;
+    for (int i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdr[i].p_type == PT_LOAD && !loaded) {
+            bias = base + phdr[i].p_offset - phdr[i].p_vaddr;
+            loaded = 1;
+        } else if (phdr[i].p_type == PT_DYNAMIC) {
+            dyn = (Elf64_Dyn *) (base + phdr[i].p_offset);
+        }
+    }
+    if (!dyn || !loaded)
+        return 0;
+
+    Elf64_Sym *symtab = 0;
+    const char *strtab = 0;
+    uint32_t *hash = 0;
+    uint32_t *gnu = 0;
+    for (; dyn->d_tag != DT_NULL; ++dyn) {
+        if (dyn->d_tag == DT_SYMTAB)
+            symtab = (Elf64_Sym *) (bias + dyn->d_un.d_ptr);
+        else if (dyn->d_tag == DT_STRTAB)
+            strtab = (const char *) (bias + dyn->d_un.d_ptr);
+        else if (dyn->d_tag == DT_HASH)
+            hash = (uint32_t *) (bias + dyn->d_un.d_ptr);
+        else if (dyn->d_tag == DT_GNU_HASH)
+            gnu = (uint32_t *) (bias + dyn->d_un.d_ptr);
+    }
+    if (!symtab || !strtab || (!hash && !gnu))
+        return 0;
+
+    Elf64_Sym *sym = 0;
+    if (gnu) {
+        /* nbuckets, first hashed symbol, bloom words, bloom shift, the
+         * bloom filter, the buckets and a chain of hashes with the low bit
+         * marking the end
+         */
+        uint32_t h = gnu_hash(name);
+        uint32_t nbuckets = gnu[0];
+        uint32_t symoffset = gnu[1];
+        uint32_t *buckets = gnu + 4 + gnu[2] * 2;
+        uint32_t *chain = buckets + nbuckets;
+        uint32_t index = buckets[h % nbuckets];
+        while (index >= symoffset) {
+            uint32_t h2 = chain[index - symoffset];
+            if ((h | 1) == (h2 | 1) &&
+                !strcmp(name, strtab + symtab[index].st_name)) {
+                sym = &symtab[index];
+                break;
+            }
+            if (h2 & 1)
+                break;
+            ++index;
+        }
+    } else {
+        /* nbucket, nchain, the buckets and the chains */
+        uint32_t *buckets = hash + 2;
+        uint32_t *chain = buckets + hash[0];
+        for (uint32_t index = buckets[sysv_hash(name) % hash[0]]; index;
+             index = chain[index]) {
+            if (!strcmp(name, strtab + symtab[index].st_name)) {
+                sym = &symtab[index];
+                break;
+            }
+        }
+    }
+
+    if (!sym || sym->st_shndx == SHN_UNDEF ||
+        ELF64_ST_TYPE(sym->st_info) != STT_FUNC)
+        return 0;
+    return (void *) (bias + sym->st_value);
+}
+
+static clock_gettime_t clock_resolve()
+{
+    if (__atomic_load_n(&vdso_resolved, __ATOMIC_ACQUIRE))
+        return vdso_clock_gettime;
+
+    /* Threads racing here all find the same thing */
+    uint64_t base = vdso_base();
+    clock_gettime_t fn = 0;
+    if (base)
+        fn = (clock_gettime_t) elf_lookup(base, "__vdso_clock_gettime");
+    vdso_clock_gettime = fn;
+    __atomic_store_n(&vdso_resolved, 1, __ATOMIC_RELEASE);
+    return fn;
+}
+
+/* Read the clock, through the vDSO when there is one */
+int muclock_gettime(int clock, struct timespec *ts)
+{
+    clock_gettime_t fn = clock_resolve();
+    if (fn)
+        return fn(clock, ts);
+    return SYSCALL2(__NR_clock_gettime, clock, ts);
+}
+
+/* Whether muclock_gettime avoids the system call */
+int muclock_vdso()
+{
+    return clock_resolve() != 0;
+}
@@ -0,0 +1,387 @@
+#include "mu.h"
+
+#include <asm-generic/mman-common.h>
+#include <asm-generic/param.h>
+#include <linux/futex.h>
+#include <linux/mman.h>
+#include <linux/time.h>
+#include <stdint.h>
+
+/* Coroutines
+ *
+ * A coroutine is a small stack and a saved stack pointer. It runs as a task
+ * of a pool: the task switches to the coroutine and gets back when it
+ * yields, blocks or is done, so any number of coroutines share the workers
+ * (M:N) and move between them by work stealing. Whatever happens to the
+ * coroutine next is done by the task once it is back on the worker stack,
+ * as the coroutine context is only saved at that point: a yielded one is
+ * queued again, a blocked one made visible to its waker, a finished one
+ * recycled.
+ *
+ * The descriptor lives at the top of the stack and both are cached
+ * together, a coroutine costs no system call once the cache is warm.
+ */
+#define CORO_STACK (64 * 1024)
+#define CORO_CACHE 1024
+
+enum { CORO_RUNNING, CORO_YIELDED, CORO_BLOCKED, CORO_DONE };
+
+struct mucoro {
+    void *sp;        /* Saved stack pointer of the coroutine */
+    void *worker_sp; /* And of the task running it */
+    void (*fn)(void *);
+    void *arg;
+    mupool_t *pool;
+    int state;
+    int *park_lock;   /* Released by the task once we are blocked */
+    int *wait_addr;   /* Futex we are blocked on */
+    struct mucoro *next; /* In a wait list or the cache */
+    mutask_t task;       /* Queues us again when we yield or are woken */
+};
+
+void mucontext_switch(void **save_sp, void *new_sp);
+void mucontext_start(void);
+
+static inline void cpu_relax()
+{
+    asm volatile("pause" ::: "memory");
+}
+
+static void spin_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            cpu_relax();
+    }
+}
+
+static void spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/* The coroutine running on this thread, if any. A coroutine may come back
+ * on another worker after a switch, so %fs has to be read again every time.
+ */
+static inline mucoro_t *coro_self()
+{
+    muthread_t self;
+    asm volatile("movq %%fs:0, %0\n\t" : "=r"(self));
+    if (self->magic != MUTHREAD_MAGIC)
+        return 0;
+    return self->coro;
+}
+
+static inline void coro_set(mucoro_t *co)
+{
+    muthread_t self;
+    asm volatile("movq %%fs:0, %0\n\t" : "=r"(self));
+    self->coro = co;
+}
+
+/* Stack cache */
+static int cache_lock;
+static mucoro_t *cached;
+static uint32_t ncached;
+
+static mucoro_t *coro_alloc()
+{
+    spin_lock(&cache_lock);
+    mucoro_t *co = cached;
+    if (co) {
+        cached = co->next;
+        --ncached;
+    }
+    spin_unlock(&cache_lock);
+    if (co)
+        return co;
+
+    /* A guard page at the end catches overflows */
+    char *stack = mummap(0, CORO_STACK, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((long) stack < 0)
+        return 0;
+    if (SYSCALL3(__NR_mprotect, stack, EXEC_PAGESIZE, PROT_NONE) < 0) {
+        mumunmap(stack, CORO_STACK);
+        return 0;
+    }
+    return (mucoro_t *) (stack + CORO_STACK) - 1;
+}
+
+static void coro_free(mucoro_t *co)
+{
+    spin_lock(&cache_lock);
+    if (ncached < CORO_CACHE) {
+        co->next = cached;
+        cached = co;
+        ++ncached;
+        co = 0;
+    }
+    spin_unlock(&cache_lock);
+    if (co)
+        mumunmap((char *) (co + 1) - CORO_STACK, CORO_STACK);
+}
+
+/* Back to the task running us, with state telling it what to do */
+static void coro_suspend(mucoro_t *co, int state)
+{
+    co->state = state;
+    mucontext_switch(&co->sp, co->worker_sp);
+}
+
+static void __attribute__((noreturn)) coro_main(void *arg)
+{
+    mucoro_t *co = arg;
+    co->fn(co->arg);
+    coro_suspend(co, CORO_DONE);
+    __builtin_unreachable();
+}
+
+/* Pool task: run the coroutine until it gives the worker back */
+static void coro_run(void *arg)
+{
+    mucoro_t *co = arg;
+    co->state = CORO_RUNNING;
+    coro_set(co);
+    mucontext_switch(&co->worker_sp, co->sp);
+    coro_set(0);
+
+    /* Once queued or released, the coroutine may already be running
+     * somewhere else: do not touch it anymore.
+     */
+    switch (co->state) {
+    case CORO_YIELDED:
+        mupool_requeue(co->pool, &co->task);
+        break;
+    case CORO_BLOCKED:
+        spin_unlock(co->park_lock);
+        break;
+    case CORO_DONE: {
+        mupool_t *pool = co->pool;
+        coro_free(co);
+        mupool_task_done(pool);
+        break;
+    }
+    }
+}
+
+/* Run fn(arg) in a new coroutine on the workers of the pool */
+int mucoro_spawn(mupool_t *pool, void (*fn)(void *), void *arg)
+{
+    mucoro_t *co = coro_alloc();
+    if (!co)
+        return -ENOMEM;
+    co->fn = fn;
+    co->arg = arg;
+    co->pool = pool;
+    co->task.fn = coro_run;
+    co->task.arg = co;
+    co->task.owned = 1;
+
+    /* A frame as mucontext_switch would have left it, see context.S */
+    uint64_t *sp = (uint64_t *) ((uintptr_t) co & ~15UL) - 8;
+    sp[0] = 0x1f80 | (0x37fUL << 32); /* Default mxcsr and x87 control */
+    sp[1] = sp[2] = sp[5] = sp[6] = 0;
+    sp[3] = (uintptr_t) co;
+    sp[4] = (uintptr_t) coro_main;
+    sp[7] = (uintptr_t) mucontext_start;
+    co->sp = sp;
+
+    mupool_submit_task(pool, &co->task);
+    return 0;
+}
+
+/* The coroutine calling us, 0 if called from a plain thread */
+mucoro_t *mucoro_self()
+{
+    return coro_self();
+}
+
+/* Let the other coroutines run. Outside of a coroutine, let the other
+ * threads run.
+ */
+void mucoro_yield()
+{
+    mucoro_t *co = coro_self();
+    if (co)
+        coro_suspend(co, CORO_YIELDED);
+    else
+        SYSCALL1(__NR_sched_yield, 0);
+}
+
+/* User space futexes
+ *
+ * A coroutine must not sleep in the kernel: that would take the worker,
+ * and all the coroutines queued on it, along. It parks in a wait list of a
+ * hash table keyed by address instead, and the waker requeues it on its
+ * pool. Threads keep using the kernel futex; a wake goes to the parked
+ * coroutines first and to the kernel for the rest, and so does a requeue,
+ * which moves the coroutines between wait lists. The parked count lets the
+ * wakers skip the table while no coroutine is blocked.
+ */
+#define FUTEX_BUCKETS 64
+
+typedef struct {
+    int lock;
+    mucoro_t *head;
+    mucoro_t *tail;
+    uint8_t pad[64 - sizeof(int) - 2 * sizeof(mucoro_t *)];
+} bucket_t;
+
+static bucket_t buckets[FUTEX_BUCKETS];
+static int parked;
+
+static inline bucket_t *bucket_of(int *addr)
+{
+    uint64_t hash = (uintptr_t) addr * 0x9e3779b97f4a7c15ULL;
+    return &buckets[hash >> 58];
+}
+
+/* Unlink up to count waiters of addr from the locked bucket, in order */
+static int bucket_take(bucket_t *bucket, int *addr, int count, mucoro_t **list)
+{
+    int taken = 0;
+    mucoro_t **cursor = &bucket->head;
+    mucoro_t *prev = 0;
+    while (*cursor && taken < count) {
+        mucoro_t *co = *cursor;
+        if (co->wait_addr != addr) {
+            prev = co;
+            cursor = &co->next;
+            continue;
+        }
+        *cursor = co->next;
+        if (bucket->tail == co)
+            bucket->tail = prev;
+        co->next = 0;
+        *list = co;
+        list = &co->next;
+        ++taken;
+    }
+    return taken;
+}
+
+static void bucket_append(bucket_t *bucket, mucoro_t *co)
+{
+    co->next = 0;
+    if (bucket->tail)
+        bucket->tail->next = co;
+    else
+        bucket->head = co;
+    bucket->tail = co;
+}
+
+static void wake_list(mucoro_t *list, int count)
+{
+    if (count)
+        __atomic_fetch_sub(&parked, count, __ATOMIC_RELAXED);
+    while (list) {
+        mucoro_t *co = list;
+        list = co->next;
+        mupool_requeue(co->pool, &co->task);
+    }
+}
+
+/* Block while *addr == val, until woken */
+void mufutex_wait(int *addr, int val)
+{
+    mucoro_t *co = coro_self();
+    if (!co) {
+        SYSCALL3(__NR_futex, addr, FUTEX_WAIT_PRIVATE, val);
+        return;
+    }
+
+    /* Count ourselves before looking at the value, so that a waker that
+     * changed it either sees us parked or we see its change.
+     */
+    bucket_t *bucket = bucket_of(addr);
+    spin_lock(&bucket->lock);
+    __atomic_fetch_add(&parked, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != val) {
+        __atomic_fetch_sub(&parked, 1, __ATOMIC_RELAXED);
+        spin_unlock(&bucket->lock);
+        return;
+    }
+
+    co->wait_addr = addr;
+    bucket_append(bucket, co);
+
+    /* The bucket stays locked until our context is saved */
+    co->park_lock = &bucket->lock;
+    coro_suspend(co, CORO_BLOCKED);
+}
+
+/* Wake up to count waiters of addr */
+void mufutex_wake(int *addr, int count)
+{
+    int woken = 0;
+    if (__atomic_load_n(&parked, __ATOMIC_SEQ_CST)) {
+        mucoro_t *wake = 0;
+        bucket_t *bucket = bucket_of(addr);
+        spin_lock(&bucket->lock);
+        woken = bucket_take(bucket, addr, count, &wake);
+        spin_unlock(&bucket->lock);
+        wake_list(wake, woken);
+    }
+
+    if (woken < count)
+        SYSCALL3(__NR_futex, addr, FUTEX_WAKE_PRIVATE, count - woken);
+}
+
+/* Wake up to count waiters of addr and move the others to target, where
+ * they wait to be woken as if they had waited on it from the start
+ */
+void mufutex_requeue(int *addr, int count, int *target)
+{
+    int woken = 0;
+    if (__atomic_load_n(&parked, __ATOMIC_SEQ_CST)) {
+        mucoro_t *wake = 0;
+        mucoro_t *move = 0;
+        bucket_t *from = bucket_of(addr);
+        bucket_t *to = bucket_of(target);
+
+        /* Both buckets, in address order */
+        spin_lock(from < to ? &from->lock : &to->lock);
+        if (from != to)
+            spin_lock(from < to ? &to->lock : &from->lock);
+
+        woken = bucket_take(from, addr, count, &wake);
+        bucket_take(from, addr, INT32_MAX, &move);
+        while (move) {
+            mucoro_t *co = move;
+            move = co->next;
+            co->wait_addr = target;
+            bucket_append(to, co);
+        }
+
+        spin_unlock(&from->lock);
+        if (from != to)
+            spin_unlock(&to->lock);
+        wake_list(wake, woken);
+    }
+
+    SYSCALL5(__NR_futex, addr, FUTEX_REQUEUE_PRIVATE, count - woken, INT32_MAX,
+             target);
+}
+
+/* Like mufutex_wait, until the CLOCK_REALTIME time abstime at the latest.
+ * Coroutines have no timers: they yield and read the clock, waking up as
+ * soon as they run again.
+ */
+int mufutex_timedwait(int *addr, int val, const struct timespec *abstime)
+{
+    if (!coro_self()) {
+        int ret = SYSCALL6(__NR_futex, addr,
+                           FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                           val, abstime, 0, FUTEX_BITSET_MATCH_ANY);
+        return ret == -ETIMEDOUT ? ret : 0;
+    }
+
+    struct timespec now;
+    muclock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec > abstime->tv_sec ||
+        (now.tv_sec == abstime->tv_sec && now.tv_nsec >= abstime->tv_nsec))
+        return -ETIMEDOUT;
+    mucoro_yield();
+    return 0;
+}
@@ -20,13 +20,30 @@ typedef struct {
     uint32_t stack_size;
 } muthread_attr_t;
 
+/* Per-thread free objects of an allocation size class */
+#define MUCACHE_CLASSES 32
+typedef struct {
+    void *head;
+    uint32_t count;
+} mucache_t;
+
+/* "muthread", not a canonical address so no libc thread block has it */
+#define MUTHREAD_MAGIC 0x6d75746872656164ULL
+
 /* Thread descriptor */
 typedef struct muthread {
     struct muthread *self;
+    uint64_t magic;
     void *stack;
     uint32_t stack_size;
     void *(*fn)(void *);
     void *arg;
+    void *retval;
+    int tid;   /* Cleared by the kernel when the thread is gone */
+    int state; /* Joinable, detached or exited */
+    struct muthread *next; /* In the stack cache */
+    struct mucoro *coro;   /* Coroutine running on the thread */
+    mucache_t cache[MUCACHE_CLASSES];
 } * muthread_t;
 
 /* Mutex attributes */
@@ -38,13 +55,40 @@ typedef struct {
 typedef struct {
     int futex;
     uint8_t type;
-    muthread_t owner;
+    void *owner; /* Thread, or coroutine, holding it */
     uint64_t counter;
+    int spins; /* Adaptive spinning estimate */
 } muthread_mutex_t;
 
 #define TBTHREAD_MUTEX_INITIALIZER \
     {                              \
-        0, 0, 0, 0                 \
+        0, 0, 0, 0, 0              \
+    }
+
+/* Reader-writer lock */
+typedef struct {
+    int state;      /* Readers holding the lock, or the writer bit */
+    int readers;    /* Futex the waiting readers sleep on */
+    int writers;    /* Futex the waiting writers sleep on */
+    int rd_waiting; /* Readers waiting */
+    int wr_waiting; /* Writers waiting */
+} muthread_rwlock_t;
+
+#define TBTHREAD_RWLOCK_INITIALIZER \
+    {                               \
+        0, 0, 0, 0, 0               \
+    }
+
+/* Condition variable */
+typedef struct {
+    int seq;     /* Futex, bumped by every signal */
+    int waiters; /* Signals only make a system call when there are some */
+    muthread_mutex_t *mutex; /* Broadcasts requeue the waiters on it */
+} muthread_cond_t;
+
+#define TBTHREAD_COND_INITIALIZER \
+    {                             \
+        0, 0, 0                   \
     }
 
 /* General threading */
@@ -53,6 +97,9 @@ int muthread_create(muthread_t *thread,
                     const muthread_attr_t *attrs,
                     void *(*f)(void *),
                     void *arg);
+void muthread_exit(void *retval) __attribute__((noreturn));
+int muthread_join(muthread_t thread, void **retval);
+int muthread_detach(muthread_t thread);
 
 /* Get the pointer of the currently running thread */
 static inline muthread_t muthread_self()
@@ -62,6 +109,9 @@ static inline muthread_t muthread_self()
     return self;
 }
 
+/* Same as the one of <time.h> or <linux/time.h>, whichever is in use */
+struct timespec;
+
 /* Mutexes */
 int muthread_mutexattr_init(muthread_mutexattr_t *attr);
 int muthread_mutexattr_settype(muthread_mutexattr_t *attr, int type);
@@ -71,10 +121,62 @@ int muthread_mutex_init(muthread_mutex_t *mutex,
 int muthread_mutex_lock(muthread_mutex_t *mutex);
 int muthread_mutex_trylock(muthread_mutex_t *mutex);
 int muthread_mutex_unlock(muthread_mutex_t *mutex);
+int muthread_mutex_timedlock(muthread_mutex_t *mutex,
+                             const struct timespec *abstime);
+
+/* Reader-writer locks */
+int muthread_rwlock_init(muthread_rwlock_t *rwlock);
+int muthread_rwlock_rdlock(muthread_rwlock_t *rwlock);
+int muthread_rwlock_tryrdlock(muthread_rwlock_t *rwlock);
+int muthread_rwlock_wrlock(muthread_rwlock_t *rwlock);
+int muthread_rwlock_trywrlock(muthread_rwlock_t *rwlock);
+int muthread_rwlock_unlock(muthread_rwlock_t *rwlock);
+
+/* Condition variables */
+int muthread_cond_init(muthread_cond_t *cond);
+int muthread_cond_wait(muthread_cond_t *cond, muthread_mutex_t *mutex);
+int muthread_cond_signal(muthread_cond_t *cond);
+int muthread_cond_broadcast(muthread_cond_t *cond);
+
+/* Work-stealing thread pool */
+typedef struct mupool mupool_t;
+
+/* A pool task */
+typedef struct mutask {
+    void (*fn)(void *);
+    void *arg;
+    struct mutask *next; /* In the injection list */
+    int owned;           /* Belongs to the caller, not freed once run */
+} mutask_t;
+
+mupool_t *mupool_create(int nthreads);
+int mupool_submit(mupool_t *pool, void (*fn)(void *), void *arg);
+void mupool_wait(mupool_t *pool);
+void mupool_submit_task(mupool_t *pool, mutask_t *task);
+void mupool_requeue(mupool_t *pool, mutask_t *task);
+void mupool_task_done(mupool_t *pool);
+void mupool_destroy(mupool_t *pool);
+
+/* Coroutines on the workers of a pool */
+typedef struct mucoro mucoro_t;
+int mucoro_spawn(mupool_t *pool, void (*fn)(void *), void *arg);
+void mucoro_yield(void);
+mucoro_t *mucoro_self(void);
+
+/* Futexes that block the calling coroutine rather than its worker */
+void mufutex_wait(int *addr, int val);
+void mufutex_wake(int *addr, int count);
+void mufutex_requeue(int *addr, int count, int *target);
+int mufutex_timedwait(int *addr, int val, const struct timespec *abstime);
 
 /* Utility functions */
 void muprint(const char *format, ...);
+int muprint_async(int enable);
+void muprint_flush(void);
 void musleep(int secs);
+void musleep_ns(uint64_t ns);
+int muclock_gettime(int clock, struct timespec *ts);
+int muclock_vdso(void);
 void *mummap(void *addr,
              unsigned long length,
              int prot,
@@ -82,6 +184,7 @@ void *mummap(void *addr,
              int fd,
              unsigned long offset);
 int mumunmap(void *addr, unsigned long length);
+void mucache_release(muthread_t thread);
 
 int muclone(int (*fn)(void *), void *arg, int flags, void *child_stack, ...
             /* pid_t *ptid, pid_t *ctid */);
@@ -1,54 +1,106 @@
 #include "mu.h"
 
 #include <linux/futex.h>
+#include <linux/time.h>
 
-/* Normal mutex */
-static int lock_normal(muthread_mutex_t *mutex)
+/* Normal mutex
+ *
+ * The futex word is 0 when unlocked, 1 when locked and 2 when locked with
+ * possible waiters, so that unlock only makes a system call when somebody
+ * may be sleeping. Before sleeping, lock spins for a while on the word: the
+ * spin count adapts to how long it took to get the lock by spinning
+ * recently, as in glibc's adaptive mutexes. The waits go through mufutex
+ * so that a coroutine blocks by itself, not with its worker.
+ */
+#define MUTEX_SPIN_MAX 100
+
+static inline void cpu_relax()
+{
+    asm volatile("pause" ::: "memory");
+}
+
+/* Lock, giving up at the CLOCK_REALTIME time abstime unless it is 0 */
+static int lock_normal(muthread_mutex_t *mutex, const struct timespec *abstime)
 {
-    while (1) {
-        if (!atomic_bool_cmpxchg())
+    if (atomic_bool_cmpxchg(&mutex->futex, 0, 1))
+        return 0;
+
+    int max = mutex->spins * 2 + 10;
+    if (max > MUTEX_SPIN_MAX)
+        max = MUTEX_SPIN_MAX;
+
+    for (int i = 0; i < max; ++i) {
+        cpu_relax();
+        if (__atomic_load_n(&mutex->futex, __ATOMIC_RELAXED) == 0 &&
+            atomic_bool_cmpxchg(&mutex->futex, 0, 1)) {
+            mutex->spins += (i - mutex->spins) / 8;
             return 0;
-        SYSCALL3(__NR_futex, &mutex->futex, FUTEX_WAIT, 1);
+        }
+    }
+    mutex->spins += (max - mutex->spins) / 8;
+
+    if (abstime && (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000))
+        return -EINVAL;
+
+    /* Mark the mutex as contended, whoever unlocks it has to wake us up */
+    while (__atomic_exchange_n(&mutex->futex, 2, __ATOMIC_ACQUIRE) != 0) {
+        if (!abstime)
+            mufutex_wait(&mutex->futex, 2);
+        else if (mufutex_timedwait(&mutex->futex, 2, abstime) == -ETIMEDOUT)
+            return -ETIMEDOUT;
     }
+    return 0;
 }
 
 static int trylock_normal(muthread_mutex_t *mutex)
 {
-    if (BBBB)
+    if (atomic_bool_cmpxchg(&mutex->futex, 0, 1))
         return 0;
     return -EBUSY;
 }
 
 static int unlock_normal(muthread_mutex_t *mutex)
 {
-    if (CCCC)
-        SYSCALL3(__NR_futex, &mutex->futex, FUTEX_WAKE, 1);
+    if (__atomic_exchange_n(&mutex->futex, 0, __ATOMIC_RELEASE) == 2)
+        mufutex_wake(&mutex->futex, 1);
     return 0;
 }
 
+/* Who locks: the coroutine running on the thread if any, which may hold a
+ * mutex across a yield, share its worker with others and move to another
+ * worker meanwhile; the thread otherwise.
+ */
+static inline void *lock_owner()
+{
+    mucoro_t *co = mucoro_self();
+    return co ? (void *) co : (void *) muthread_self();
+}
+
 /* Errorcheck mutex */
-static int lock_errorcheck(muthread_mutex_t *mutex)
+static int lock_errorcheck(muthread_mutex_t *mutex,
+                           const struct timespec *abstime)
 {
-    muthread_t self = muthread_self();
+    void *self = lock_owner();
     if (mutex->owner == self)
         return -EDEADLK;
 
-    lock_normal(mutex);
-    mutex->owner = self;
-    return 0;
+    int ret = lock_normal(mutex, abstime);
+    if (ret == 0)
+        mutex->owner = self;
+    return ret;
 }
 
 static int trylock_errorcheck(muthread_mutex_t *mutex)
 {
     int ret = trylock_normal(mutex);
     if (ret == 0)
-        mutex->owner = muthread_self();
+        mutex->owner = lock_owner();
     return ret;
 }
 
 static int unlock_errorcheck(muthread_mutex_t *mutex)
 {
-    if (mutex->owner != muthread_self() || mutex->futex == 0)
+    if (mutex->owner != lock_owner() || mutex->futex == 0)
         return -EPERM;
     mutex->owner = 0;
     unlock_normal(mutex);
@@ -56,11 +108,14 @@ static int unlock_errorcheck(muthread_mutex_t *mutex)
 }
 
 /* Recursive mutex */
-static int lock_recursive(muthread_mutex_t *mutex)
+static int lock_recursive(muthread_mutex_t *mutex,
+                          const struct timespec *abstime)
 {
-    muthread_t self = muthread_self();
+    void *self = lock_owner();
     if (mutex->owner != self) {
-        lock_normal(mutex);
+        int ret = lock_normal(mutex, abstime);
+        if (ret)
+            return ret;
         mutex->owner = self;
     }
     if (mutex->counter == (uint64_t) -1)
@@ -72,13 +127,13 @@ static int lock_recursive(muthread_mutex_t *mutex)
 
 static int trylock_recursive(muthread_mutex_t *mutex)
 {
-    muthread_t self = muthread_self();
+    void *self = lock_owner();
     if (mutex->owner != self && trylock_normal(mutex))
         return -EBUSY;
 
     if (mutex->owner != self) {
         mutex->owner = self;
-        mutex->counter = DDDD;
+        mutex->counter = 1;
         return 0;
     }
 
@@ -91,7 +146,7 @@ static int trylock_recursive(muthread_mutex_t *mutex)
 
 static int unlock_recursive(muthread_mutex_t *mutex)
 {
-    if (mutex->owner != muthread_self())
+    if (mutex->owner != lock_owner())
         return -EPERM;
 
     --mutex->counter;
@@ -103,7 +158,7 @@ static int unlock_recursive(muthread_mutex_t *mutex)
 }
 
 /* Mutex function tables */
-static int (*lockers[])(muthread_mutex_t *) = {
+static int (*lockers[])(muthread_mutex_t *, const struct timespec *) = {
     lock_normal,
     lock_errorcheck,
     lock_recursive,
@@ -147,13 +202,21 @@ int muthread_mutex_init(muthread_mutex_t *mutex,
     mutex->type = type;
     mutex->owner = 0;
     mutex->counter = 0;
+    mutex->spins = 0;
     return 0;
 }
 
 /* Lock the mutex */
 int muthread_mutex_lock(muthread_mutex_t *mutex)
 {
-    return (*lockers[mutex->type])(mutex);
+    return (*lockers[mutex->type])(mutex, 0);
+}
+
+/* Lock the mutex, unless it takes until the CLOCK_REALTIME time abstime */
+int muthread_mutex_timedlock(muthread_mutex_t *mutex,
+                             const struct timespec *abstime)
+{
+    return (*lockers[mutex->type])(mutex, abstime);
 }
 
 /* Try locking the mutex */
@@ -167,3 +230,69 @@ int muthread_mutex_unlock(muthread_mutex_t *mutex)
 {
     return (*unlockers[mutex->type])(mutex);
 }
+
+/* Condition variables
+ *
+ * The waiters sleep on a sequence number that every signal bumps, so that
+ * a signal between unlocking the mutex and going to sleep is not lost. A
+ * broadcast wakes a single waiter and requeues the others on the mutex
+ * futex: the unlocks then wake them one at a time, instead of all of them
+ * waking up at once to fight for the mutex. Nobody knows who was requeued,
+ * so the waiters take the mutex back marked as contended.
+ */
+int muthread_cond_init(muthread_cond_t *cond)
+{
+    cond->seq = 0;
+    cond->waiters = 0;
+    cond->mutex = 0;
+    return 0;
+}
+
+/* Unlock the mutex, wait for a signal and lock the mutex again */
+int muthread_cond_wait(muthread_cond_t *cond, muthread_mutex_t *mutex)
+{
+    if (mutex->type != TBTHREAD_MUTEX_NORMAL &&
+        mutex->owner != lock_owner())
+        return -EPERM;
+
+    __atomic_fetch_add(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+    int seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cond->mutex, mutex, __ATOMIC_RELAXED);
+
+    /* A recursive mutex is released whatever its count */
+    void *owner = mutex->owner;
+    uint64_t counter = mutex->counter;
+    mutex->owner = 0;
+    mutex->counter = 0;
+    unlock_normal(mutex);
+
+    mufutex_wait(&cond->seq, seq);
+    __atomic_fetch_sub(&cond->waiters, 1, __ATOMIC_RELAXED);
+
+    while (__atomic_exchange_n(&mutex->futex, 2, __ATOMIC_ACQUIRE) != 0)
+        mufutex_wait(&mutex->futex, 2);
+    mutex->owner = owner;
+    mutex->counter = counter;
+    return 0;
+}
+
+/* Wake up one waiter */
+int muthread_cond_signal(muthread_cond_t *cond)
+{
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST))
+        mufutex_wake(&cond->seq, 1);
+    return 0;
+}
+
+/* Wake up all the waiters */
+int muthread_cond_broadcast(muthread_cond_t *cond)
+{
+    __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST)) {
+        muthread_mutex_t *mutex = __atomic_load_n(&cond->mutex,
+                                                  __ATOMIC_RELAXED);
+        mufutex_requeue(&cond->seq, 1, &mutex->futex);
+    }
+    return 0;
+}
@@ -0,0 +1,406 @@
+#include "mu.h"
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Work-stealing thread pool
+ *
+ * Every worker owns a Chase-Lev deque: it pushes and takes tasks at the
+ * bottom without locking, other workers steal from the top with a CAS.
+ * Tasks submitted by a worker go to its own deque, the others go to a
+ * shared injection list. An idle worker looks at its deque, the injection
+ * list, then steals from random victims before parking on a futex event
+ * count, which submitters bump only when somebody is parked.
+ */
+
+typedef mutask_t task_t;
+
+/* Circular array of the deque, replaced by a twice bigger one when full */
+typedef struct array {
+    int64_t size;
+    struct array *prev; /* Older arrays, stealers may still read them */
+    task_t *buf[];
+} array_t;
+
+typedef struct {
+    int64_t top;
+    int64_t bottom;
+    array_t *array;
+    uint8_t pad[64 - 2 * sizeof(int64_t) - sizeof(array_t *)];
+} deque_t;
+
+typedef struct {
+    deque_t deque;
+    muthread_t thread;
+    struct mupool *pool;
+    uint64_t seed;
+} worker_t;
+
+struct mupool {
+    int nworkers;
+    int nthreads; /* Workers started */
+    int stop;
+    worker_t *workers;
+
+    muthread_mutex_t inject_lock;
+    task_t *inject_head;
+    task_t *inject_tail;
+
+    int event;    /* Futex bumped when there is new work */
+    int sleepers; /* Parked workers */
+    int pending;  /* Tasks not finished yet, futex for mupool_wait */
+};
+
+#define DEQUE_INITIAL 64
+
+static array_t *array_new(int64_t size)
+{
+    array_t *array = malloc(sizeof(array_t) + size * sizeof(task_t *));
+    if (array) {
+        array->size = size;
+        array->prev = 0;
+    }
+    return array;
+}
+
+static inline task_t *array_get(array_t *array, int64_t i)
+{
+    return __atomic_load_n(&array->buf[i & (array->size - 1)],
+                           __ATOMIC_RELAXED);
+}
+
+static inline void array_put(array_t *array, int64_t i, task_t *task)
+{
+    __atomic_store_n(&array->buf[i & (array->size - 1)], task,
+                     __ATOMIC_RELAXED);
+}
+
+/* Owner only */
+static int deque_push(deque_t *deque, task_t *task)
+{
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if (b - t > array->size - 1) {
+        array_t *bigger = array_new(array->size * 2);
+        if (!bigger)
+            return -ENOMEM;
+        for (int64_t i = t; i < b; ++i)
+            array_put(bigger, i, array_get(array, i));
+        bigger->prev = array;
+        __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+        array = bigger;
+    }
+
+    array_put(array, b, task);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Owner only */
+static task_t *deque_take(deque_t *deque)
+{
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    task_t *task = array_get(array, b);
+    if (t == b) {
+        /* Last one, race the stealers for it */
+        if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = 0;
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/* Any thread */
+static task_t *deque_steal(deque_t *deque)
+{
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+
+    array_t *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    task_t *task = array_get(array, t);
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return 0;
+    return task;
+}
+
+static inline int deque_empty(deque_t *deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void inject(mupool_t *pool, task_t *task)
+{
+    task->next = 0;
+    muthread_mutex_lock(&pool->inject_lock);
+    if (pool->inject_tail)
+        pool->inject_tail->next = task;
+    else
+        pool->inject_head = task;
+    pool->inject_tail = task;
+    muthread_mutex_unlock(&pool->inject_lock);
+}
+
+static task_t *inject_pop(mupool_t *pool)
+{
+    if (!__atomic_load_n(&pool->inject_head, __ATOMIC_RELAXED))
+        return 0;
+
+    muthread_mutex_lock(&pool->inject_lock);
+    task_t *task = pool->inject_head;
+    if (task) {
+        pool->inject_head = task->next;
+        if (!pool->inject_head)
+            pool->inject_tail = 0;
+    }
+    muthread_mutex_unlock(&pool->inject_lock);
+    return task;
+}
+
+/* The worker the calling thread is, if it is one of the pool */
+static worker_t *worker_self(mupool_t *pool)
+{
+    muthread_t self = muthread_self();
+    for (int i = 0; i < pool->nworkers; ++i) {
+        if (pool->workers[i].thread == self)
+            return &pool->workers[i];
+    }
+    return 0;
+}
+
+static task_t *find_task(worker_t *worker)
+{
+    mupool_t *pool = worker->pool;
+    task_t *task = deque_take(&worker->deque);
+    if (task)
+        return task;
+    task = inject_pop(pool);
+    if (task)
+        return task;
+
+    /* Steal, starting from a random victim */
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 7;
+    worker->seed ^= worker->seed << 17;
+    int start = worker->seed % pool->nworkers;
+    for (int i = 0; i < pool->nworkers; ++i) {
+        worker_t *victim = &pool->workers[(start + i) % pool->nworkers];
+        if (victim != worker && (task = deque_steal(&victim->deque)))
+            return task;
+    }
+    return 0;
+}
+
+/* Anything left to do anywhere? */
+static int has_work(mupool_t *pool)
+{
+    if (__atomic_load_n(&pool->inject_head, __ATOMIC_SEQ_CST))
+        return 1;
+    for (int i = 0; i < pool->nworkers; ++i) {
+        if (!deque_empty(&pool->workers[i].deque))
+            return 1;
+    }
+    return 0;
+}
+
+static void wake_workers(mupool_t *pool, int count)
+{
+    /* The task must be visible before we look for sleepers */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&pool->event, 1, __ATOMIC_RELEASE);
+        SYSCALL3(__NR_futex, &pool->event, FUTEX_WAKE_PRIVATE, count);
+    }
+}
+
+static void task_done(mupool_t *pool)
+{
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        SYSCALL3(__NR_futex, &pool->pending, FUTEX_WAKE_PRIVATE, INT32_MAX);
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    mupool_t *pool = worker->pool;
+
+    while (1) {
+        task_t *task = find_task(worker);
+        if (task) {
+            /* An owned task may be queued again as soon as it runs */
+            int owned = task->owned;
+            task->fn(task->arg);
+            if (!owned) {
+                free(task);
+                task_done(pool);
+            }
+            continue;
+        }
+
+        /* Park. Register first and look again, so that a submitter either
+         * sees us as sleeper or we see its task.
+         */
+        int seen = __atomic_load_n(&pool->event, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!has_work(pool) && !__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+            SYSCALL3(__NR_futex, &pool->event, FUTEX_WAIT_PRIVATE, seen);
+        __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_RELAXED);
+
+        if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE) && !has_work(pool))
+            return 0;
+    }
+}
+
+/* Create a pool of nthreads workers */
+mupool_t *mupool_create(int nthreads)
+{
+    if (nthreads < 1)
+        return 0;
+
+    mupool_t *pool = calloc(1, sizeof(mupool_t));
+    if (!pool)
+        return 0;
+    pool->workers = calloc(nthreads, sizeof(worker_t));
+    if (!pool->workers) {
+        free(pool);
+        return 0;
+    }
+    muthread_mutex_init(&pool->inject_lock, 0);
+
+    /* The workers look at each other's deques, set them all up first */
+    pool->nworkers = nthreads;
+    for (int i = 0; i < nthreads; ++i) {
+        worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        worker->deque.array = array_new(DEQUE_INITIAL);
+        if (!worker->deque.array) {
+            mupool_destroy(pool);
+            return 0;
+        }
+    }
+
+    muthread_attr_t attr;
+    muthread_attr_init(&attr);
+    for (; pool->nthreads < nthreads; ++pool->nthreads) {
+        worker_t *worker = &pool->workers[pool->nthreads];
+        if (muthread_create(&worker->thread, &attr, worker_main, worker)) {
+            mupool_destroy(pool);
+            return 0;
+        }
+    }
+    return pool;
+}
+
+static task_t *task_new(mupool_t *pool, void (*fn)(void *), void *arg)
+{
+    task_t *task = malloc(sizeof(task_t));
+    if (task) {
+        task->fn = fn;
+        task->arg = arg;
+        task->owned = 0;
+        __atomic_fetch_add(&pool->pending, 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/* Run fn(arg) on the pool */
+int mupool_submit(mupool_t *pool, void (*fn)(void *), void *arg)
+{
+    task_t *task = task_new(pool, fn, arg);
+    if (!task)
+        return -ENOMEM;
+
+    worker_t *worker = worker_self(pool);
+    if (!worker || deque_push(&worker->deque, task))
+        inject(pool, task);
+    wake_workers(pool, 1);
+    return 0;
+}
+
+/* Owned tasks
+ *
+ * A coroutine brings its own task, owned set, so that queueing it again
+ * allocates nothing and cannot fail. It is pending from mupool_submit_task
+ * until mupool_task_done, however many times it runs and is requeued in
+ * between: mupool_wait waits for the coroutines that are blocked too.
+ */
+void mupool_submit_task(mupool_t *pool, mutask_t *task)
+{
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_RELAXED);
+
+    worker_t *worker = worker_self(pool);
+    if (!worker || deque_push(&worker->deque, task))
+        inject(pool, task);
+    wake_workers(pool, 1);
+}
+
+/* Like mupool_submit_task, but through the injection list, which the
+ * workers only look at once their own deque is empty: the task runs after
+ * the ones the calling worker already has, as a yielded coroutine should.
+ */
+void mupool_requeue(mupool_t *pool, mutask_t *task)
+{
+    inject(pool, task);
+    wake_workers(pool, 1);
+}
+
+/* An owned task is finished for good */
+void mupool_task_done(mupool_t *pool)
+{
+    task_done(pool);
+}
+
+/* Wait until every task submitted so far, and the ones they submitted, is
+ * done, blocked coroutines included. Not from a task: the worker would wait
+ * for itself.
+ */
+void mupool_wait(mupool_t *pool)
+{
+    int pending;
+    while ((pending = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)))
+        SYSCALL3(__NR_futex, &pool->pending, FUTEX_WAIT_PRIVATE, pending);
+}
+
+/* Finish the tasks, stop the workers and free the pool */
+void mupool_destroy(mupool_t *pool)
+{
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    wake_workers(pool, INT32_MAX);
+    __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < pool->nthreads; ++i)
+        muthread_join(pool->workers[i].thread, 0);
+
+    for (int i = 0; i < pool->nworkers; ++i) {
+        array_t *array = pool->workers[i].deque.array;
+        while (array) {
+            array_t *prev = array->prev;
+            free(array);
+            array = prev;
+        }
+    }
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,126 @@
+#include "mu.h"
+
+/* Reader-writer lock
+ *
+ * state counts the readers holding the lock, or is RWLOCK_WRITER while a
+ * writer does. Readers and writers sleep on futexes of their own, bumped
+ * by whoever wakes them. Writers are preferred: a reader does not come in
+ * while a writer waits, so a steady flow of readers cannot starve them.
+ * A writer leaving wakes all the waiting readers though, and they come in
+ * as a batch even if more writers wait: under contention the readers and
+ * the writers take turns.
+ */
+#define RWLOCK_WRITER 0x40000000
+
+int muthread_rwlock_init(muthread_rwlock_t *rwlock)
+{
+    rwlock->state = 0;
+    rwlock->readers = 0;
+    rwlock->writers = 0;
+    rwlock->rd_waiting = 0;
+    rwlock->wr_waiting = 0;
+    return 0;
+}
+
+/* Come in as a reader, batched readers do not let writers go first */
+static int try_read(muthread_rwlock_t *rwlock, int batched)
+{
+    int state = __atomic_load_n(&rwlock->state, __ATOMIC_RELAXED);
+    while (!(state & RWLOCK_WRITER) && state + 1 < RWLOCK_WRITER) {
+        if (!batched && __atomic_load_n(&rwlock->wr_waiting, __ATOMIC_SEQ_CST))
+            return 0;
+        if (__atomic_compare_exchange_n(&rwlock->state, &state, state + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+static int try_write(muthread_rwlock_t *rwlock)
+{
+    int state = 0;
+    return __atomic_compare_exchange_n(&rwlock->state, &state, RWLOCK_WRITER,
+                                       0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Lock for reading */
+int muthread_rwlock_rdlock(muthread_rwlock_t *rwlock)
+{
+    int batched = 0;
+    while (!try_read(rwlock, batched)) {
+        /* Register and look again, so that whoever lets us in either sees
+         * us waiting or we see the way free
+         */
+        int seq = __atomic_load_n(&rwlock->readers, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&rwlock->rd_waiting, 1, __ATOMIC_SEQ_CST);
+        if (try_read(rwlock, batched)) {
+            __atomic_fetch_sub(&rwlock->rd_waiting, 1, __ATOMIC_SEQ_CST);
+            return 0;
+        }
+        mufutex_wait(&rwlock->readers, seq);
+        __atomic_fetch_sub(&rwlock->rd_waiting, 1, __ATOMIC_SEQ_CST);
+
+        /* Woken by a writer leaving */
+        batched = __atomic_load_n(&rwlock->readers, __ATOMIC_ACQUIRE) != seq;
+    }
+    return 0;
+}
+
+/* Try locking for reading */
+int muthread_rwlock_tryrdlock(muthread_rwlock_t *rwlock)
+{
+    return try_read(rwlock, 0) ? 0 : -EBUSY;
+}
+
+/* Lock for writing */
+int muthread_rwlock_wrlock(muthread_rwlock_t *rwlock)
+{
+    if (try_write(rwlock))
+        return 0;
+
+    __atomic_fetch_add(&rwlock->wr_waiting, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        int seq = __atomic_load_n(&rwlock->writers, __ATOMIC_SEQ_CST);
+        if (try_write(rwlock))
+            break;
+        mufutex_wait(&rwlock->writers, seq);
+    }
+    __atomic_fetch_sub(&rwlock->wr_waiting, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* Try locking for writing */
+int muthread_rwlock_trywrlock(muthread_rwlock_t *rwlock)
+{
+    return try_write(rwlock) ? 0 : -EBUSY;
+}
+
+/* Unlock, whichever way it was locked */
+int muthread_rwlock_unlock(muthread_rwlock_t *rwlock)
+{
+    int state = __atomic_load_n(&rwlock->state, __ATOMIC_RELAXED);
+    if (state == 0)
+        return -EPERM;
+
+    if (state != RWLOCK_WRITER) {
+        /* The last reader out lets a writer in */
+        state = __atomic_sub_fetch(&rwlock->state, 1, __ATOMIC_SEQ_CST);
+        if (state == 0 &&
+            __atomic_load_n(&rwlock->wr_waiting, __ATOMIC_SEQ_CST)) {
+            __atomic_fetch_add(&rwlock->writers, 1, __ATOMIC_SEQ_CST);
+            mufutex_wake(&rwlock->writers, 1);
+        }
+        return 0;
+    }
+
+    /* A writer lets all the waiting readers in, or the next writer */
+    __atomic_store_n(&rwlock->state, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rwlock->rd_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&rwlock->readers, 1, __ATOMIC_SEQ_CST);
+        mufutex_wake(&rwlock->readers, INT32_MAX);
+    } else if (__atomic_load_n(&rwlock->wr_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&rwlock->writers, 1, __ATOMIC_SEQ_CST);
+        mufutex_wake(&rwlock->writers, 1);
+    }
+    return 0;
+}
@@ -1,5 +1,7 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "mu.h"
 
@@ -85,8 +87,455 @@ void *thread_func_recursive(void *arg)
     return 0;
 }
 
+/* Test join, exit and detach */
+void *thread_func_return(void *arg)
+{
+    if ((uintptr_t) arg % 2)
+        muthread_exit((char *) arg + 1);
+    return (char *) arg + 1;
+}
+
+static int detached_done;
+void *thread_func_detached(void *arg)
+{
+    __atomic_fetch_add(&detached_done, 1, __ATOMIC_RELEASE);
+    return arg;
+}
+
+/* Test the pool: flat tasks from main and a tree of tasks submitting their
+ * children from the workers
+ */
+static mupool_t *pool;
+static uint64_t pool_count;
+
+void task_count(void *arg)
+{
+    __atomic_fetch_add(&pool_count, (uintptr_t) arg, __ATOMIC_RELAXED);
+}
+
+void task_tree(void *arg)
+{
+    uintptr_t depth = (uintptr_t) arg;
+    if (!depth) {
+        task_count((void *) 1);
+        return;
+    }
+    mupool_submit(pool, task_tree, (void *) (depth - 1));
+    mupool_submit(pool, task_tree, (void *) (depth - 1));
+}
+
+/* Test the coroutines: many more than workers, yielding while they hold
+ * a mutex, so that the others have to block on it
+ */
+static muthread_mutex_t coro_mutex = TBTHREAD_MUTEX_INITIALIZER;
+static uint64_t coro_count;
+
+void coro_func(void *arg)
+{
+    for (int i = 0; i < 100; ++i) {
+        muthread_mutex_lock(&coro_mutex);
+        uint64_t count = coro_count;
+        mucoro_yield();
+        coro_count = count + 1;
+        muthread_mutex_unlock(&coro_mutex);
+        mucoro_yield();
+    }
+}
+
+/* Coroutines holding a recursive or errorcheck mutex across yields: they
+ * share workers and move between them, the mutex must still have a single
+ * owner, the coroutine
+ */
+static muthread_mutex_t coro_recursive;
+static muthread_mutex_t coro_errorcheck;
+static int coro_inside[2]; /* Holders of each */
+static int coro_errors;
+
+void coro_func_owner(void *arg)
+{
+    muthread_mutex_t *mutex = arg;
+    int recursive = mutex == &coro_recursive;
+    for (int i = 0; i < 100; ++i) {
+        int err = muthread_mutex_lock(mutex);
+        if (recursive)
+            err |= muthread_mutex_lock(mutex);
+        if (__atomic_add_fetch(&coro_inside[recursive], 1,
+                               __ATOMIC_RELAXED) != 1)
+            __atomic_fetch_add(&coro_errors, 1, __ATOMIC_RELAXED);
+        mucoro_yield();
+        if (!recursive && muthread_mutex_lock(mutex) != -EDEADLK)
+            ++err;
+        __atomic_sub_fetch(&coro_inside[recursive], 1, __ATOMIC_RELAXED);
+        if (recursive)
+            err |= muthread_mutex_unlock(mutex);
+        err |= muthread_mutex_unlock(mutex);
+        if (err)
+            __atomic_fetch_add(&coro_errors, 1, __ATOMIC_RELAXED);
+        mucoro_yield();
+    }
+}
+
+/* Coroutines blocked on a futex that a thread sets later: mupool_wait must
+ * wait for them
+ */
+static int coro_gate;
+static uint64_t coro_passed;
+
+void coro_func_gate(void *arg)
+{
+    while (!__atomic_load_n(&coro_gate, __ATOMIC_ACQUIRE))
+        mufutex_wait(&coro_gate, 0);
+    __atomic_fetch_add(&coro_passed, 1, __ATOMIC_RELAXED);
+}
+
+void *thread_func_gate(void *arg)
+{
+    musleep_ns(50000000);
+    __atomic_store_n(&coro_gate, 1, __ATOMIC_RELEASE);
+    mufutex_wake(&coro_gate, INT32_MAX);
+    return 0;
+}
+
+/* Test the reader-writer lock: the writers keep the pair equal, the
+ * readers must never see it otherwise
+ */
+static muthread_rwlock_t rwlock = TBTHREAD_RWLOCK_INITIALIZER;
+static uint64_t pair[2];
+static int torn;
+
+void *thread_func_reader(void *arg)
+{
+    for (int i = 0; i < 100000; ++i) {
+        muthread_rwlock_rdlock(&rwlock);
+        if (pair[0] != pair[1])
+            torn = 1;
+        muthread_rwlock_unlock(&rwlock);
+    }
+    return 0;
+}
+
+void *thread_func_writer(void *arg)
+{
+    for (int i = 0; i < 10000; ++i) {
+        muthread_rwlock_wrlock(&rwlock);
+        ++pair[0];
+        ++pair[1];
+        muthread_rwlock_unlock(&rwlock);
+    }
+    return 0;
+}
+
+/* Print through the asynchronous flusher */
+void *thread_func_print(void *arg)
+{
+    for (int i = 0; i < 10; ++i)
+        muprint("[thread %lu] Line %d, printed asynchronously\n",
+                (uintptr_t) arg, i);
+    return 0;
+}
+
+/* Benchmark the mutexes against the ones of glibc. Both run in pthreads, so
+ * that the only difference is the lock.
+ */
+typedef struct {
+    int (*lock)(void *);
+    int (*unlock)(void *);
+    void *mutex;
+    uint64_t iterations;
+    uint64_t counter;
+    int (*rdlock)(void *); /* Readers, for the reader-writer locks */
+    uint64_t write_every;  /* One write in write_every iterations */
+    uint64_t table[64];    /* What the readers read */
+} bench_t;
+
+static int mu_lock(void *mutex)
+{
+    return muthread_mutex_lock(mutex);
+}
+
+static int mu_unlock(void *mutex)
+{
+    return muthread_mutex_unlock(mutex);
+}
+
+static int pthread_lock(void *mutex)
+{
+    return pthread_mutex_lock(mutex);
+}
+
+static int pthread_unlock(void *mutex)
+{
+    return pthread_mutex_unlock(mutex);
+}
+
+static int mu_rdlock(void *rwlock)
+{
+    return muthread_rwlock_rdlock(rwlock);
+}
+
+static int mu_wrlock(void *rwlock)
+{
+    return muthread_rwlock_wrlock(rwlock);
+}
+
+static int mu_rwunlock(void *rwlock)
+{
+    return muthread_rwlock_unlock(rwlock);
+}
+
+static int pthread_rdlock(void *rwlock)
+{
+    return pthread_rwlock_rdlock(rwlock);
+}
+
+static int pthread_wrlock(void *rwlock)
+{
+    return pthread_rwlock_wrlock(rwlock);
+}
+
+static int pthread_rwunlock(void *rwlock)
+{
+    return pthread_rwlock_unlock(rwlock);
+}
+
+void *bench_func(void *arg)
+{
+    bench_t *bench = (bench_t *) arg;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < bench->iterations; ++i) {
+        if (bench->rdlock && i % bench->write_every) {
+            bench->rdlock(bench->mutex);
+            for (int j = 0; j < 64; ++j)
+                sum += __atomic_load_n(&bench->table[j], __ATOMIC_RELAXED);
+            bench->unlock(bench->mutex);
+            continue;
+        }
+        bench->lock(bench->mutex);
+        ++bench->table[bench->counter++ % 64];
+        bench->unlock(bench->mutex);
+    }
+    return (void *) sum;
+}
+
+/* Nanoseconds from start to end */
+static uint64_t elapsed(const struct timespec *start,
+                        const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec -
+           start->tv_nsec;
+}
+
+/* Run func on threads pthreads, in nanoseconds */
+uint64_t bench_time(void *(*func)(void *), void *arg, int threads)
+{
+    pthread_t thread[16];
+    struct timespec start, end;
+
+    muclock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; ++i)
+        pthread_create(&thread[i], 0, func, arg);
+    for (int i = 0; i < threads; ++i)
+        pthread_join(thread[i], 0);
+    muclock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(&start, &end);
+}
+
+int bench_run(const char *name, bench_t *bench, int threads)
+{
+    uint64_t ns = bench_time(bench_func, bench, threads);
+    uint64_t ops = bench->iterations * threads;
+    uint64_t writes = ops;
+    if (bench->rdlock) {
+        writes = (bench->iterations + bench->write_every - 1) /
+                 bench->write_every * threads;
+    }
+    muprint("%s: %lu ops, %lu ns/op\n", name, ops, ns / ops);
+    return bench->counter == writes ? 0 : 1;
+}
+
+/* Pass a turn around the threads, each waiting on the condition variable
+ * for its own and broadcasting when it is done. With every thread woken
+ * for every turn, this is where requeueing the waiters matters.
+ */
+typedef struct {
+    int (*lock)(void *);
+    int (*unlock)(void *);
+    int (*wait)(void *, void *);
+    int (*broadcast)(void *);
+    void *mutex;
+    void *cond;
+    uint64_t iterations;
+    int threads;
+    int next_id;
+    int turn;
+    uint64_t passes;
+} relay_t;
+
+static int mu_wait(void *cond, void *mutex)
+{
+    return muthread_cond_wait(cond, mutex);
+}
+
+static int mu_broadcast(void *cond)
+{
+    return muthread_cond_broadcast(cond);
+}
+
+static int pthread_wait(void *cond, void *mutex)
+{
+    return pthread_cond_wait(cond, mutex);
+}
+
+static int pthread_broadcast(void *cond)
+{
+    return pthread_cond_broadcast(cond);
+}
+
+void *relay_func(void *arg)
+{
+    relay_t *relay = (relay_t *) arg;
+    int id = __atomic_fetch_add(&relay->next_id, 1, __ATOMIC_RELAXED);
+
+    relay->lock(relay->mutex);
+    for (uint64_t i = 0; i < relay->iterations; ++i) {
+        while (relay->turn != id)
+            relay->wait(relay->cond, relay->mutex);
+        relay->turn = (id + 1) % relay->threads;
+        ++relay->passes;
+        relay->broadcast(relay->cond);
+    }
+    relay->unlock(relay->mutex);
+    return 0;
+}
+
+int relay_run(const char *name, relay_t *relay)
+{
+    uint64_t ns = bench_time(relay_func, relay, relay->threads);
+    uint64_t ops = relay->iterations * relay->threads;
+    muprint("%s: %lu turns, %lu ns/turn\n", name, ops, ns / ops);
+    return relay->passes == ops ? 0 : 1;
+}
+
+/* A count from the command line, 0 unless it is a number from 1 to max */
+static uint64_t parse_count(const char *arg, uint64_t max)
+{
+    char *end;
+
+    /* strtoul would negate a negative number */
+    if (arg[0] < '0' || arg[0] > '9')
+        return 0;
+    unsigned long count = strtoul(arg, &end, 10);
+    if (*end || count > max)
+        return 0;
+    return count;
+}
+
+/* test bench [threads [iterations]] */
+int bench_main(int argc, char **argv)
+{
+    int threads = argc > 2 ? parse_count(argv[2], 16) : 4;
+    uint64_t iterations =
+        argc > 3 ? parse_count(argv[3], UINT32_MAX) : 1000000;
+    if (!threads || !iterations) {
+        muprint("usage: %s bench [threads [iterations]], between 1 and 16 "
+                "threads\n",
+                argv[0]);
+        return 1;
+    }
+
+    int types[] = {TBTHREAD_MUTEX_NORMAL, TBTHREAD_MUTEX_ERRORCHECK,
+                   TBTHREAD_MUTEX_RECURSIVE};
+    int pthread_types[] = {PTHREAD_MUTEX_NORMAL, PTHREAD_MUTEX_ERRORCHECK,
+                           PTHREAD_MUTEX_RECURSIVE};
+    const char *names[][2] = {{"normal muthread", "normal pthread"},
+                              {"errorcheck muthread", "errorcheck pthread"},
+                              {"recursive muthread", "recursive pthread"}};
+
+    muprint("%d threads, %lu iterations each\n", threads, iterations);
+    for (int t = 0; t < 3; ++t) {
+        muthread_mutexattr_t mattr;
+        muthread_mutex_t mutex;
+        muthread_mutexattr_init(&mattr);
+        muthread_mutexattr_settype(&mattr, types[t]);
+        muthread_mutex_init(&mutex, &mattr);
+        bench_t mu = {mu_lock, mu_unlock, &mutex, iterations, 0};
+        if (bench_run(names[t][0], &mu, threads))
+            return 1;
+
+        pthread_mutexattr_t pattr;
+        pthread_mutex_t pmutex;
+        pthread_mutexattr_init(&pattr);
+        pthread_mutexattr_settype(&pattr, pthread_types[t]);
+        pthread_mutex_init(&pmutex, &pattr);
+        bench_t p = {pthread_lock, pthread_unlock, &pmutex, iterations, 0};
+        if (bench_run(names[t][1], &p, threads))
+            return 1;
+        pthread_mutex_destroy(&pmutex);
+    }
+
+    /* A read-mostly table, one write in ten */
+    muthread_rwlock_t rwlock;
+    muthread_rwlock_init(&rwlock);
+    bench_t mu = {mu_wrlock, mu_rwunlock, &rwlock, iterations, 0, mu_rdlock,
+                  10};
+    if (bench_run("rwlock muthread", &mu, threads))
+        return 1;
+
+    pthread_rwlock_t prwlock;
+    pthread_rwlock_init(&prwlock, 0);
+    bench_t p = {pthread_wrlock, pthread_rwunlock, &prwlock, iterations, 0,
+                 pthread_rdlock, 10};
+    if (bench_run("rwlock pthread", &p, threads))
+        return 1;
+    pthread_rwlock_destroy(&prwlock);
+
+    /* Every turn wakes up a thread, much slower: a hundredth of the turns,
+     * at least one
+     */
+    uint64_t turns = iterations < 100 ? 1 : iterations / 100;
+    muthread_mutex_t mutex;
+    muthread_cond_t cond;
+    muthread_mutex_init(&mutex, 0);
+    muthread_cond_init(&cond);
+    relay_t mu_relay = {mu_lock, mu_unlock, mu_wait, mu_broadcast,
+                        &mutex,  &cond,     turns,   threads};
+    if (relay_run("cond muthread", &mu_relay))
+        return 1;
+
+    pthread_mutex_t pmutex;
+    pthread_cond_t pcond;
+    pthread_mutex_init(&pmutex, 0);
+    pthread_cond_init(&pcond, 0);
+    relay_t p_relay = {pthread_lock, pthread_unlock, pthread_wait,
+                       pthread_broadcast, &pmutex, &pcond, turns, threads};
+    if (relay_run("cond pthread", &p_relay))
+        return 1;
+    pthread_cond_destroy(&pcond);
+    pthread_mutex_destroy(&pmutex);
+
+    /* Reading the clock */
+    struct timespec start, end, ts;
+    muclock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i = 0; i < iterations; ++i)
+        muclock_gettime(CLOCK_MONOTONIC, &ts);
+    muclock_gettime(CLOCK_MONOTONIC, &end);
+    muprint("muclock_gettime (%s): %lu ns/call\n",
+            muclock_vdso() ? "vDSO" : "system call",
+            elapsed(&start, &end) / iterations);
+    muclock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i = 0; i < iterations; ++i)
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    muclock_gettime(CLOCK_MONOTONIC, &end);
+    muprint("glibc clock_gettime: %lu ns/call\n",
+            elapsed(&start, &end) / iterations);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench_main(argc, argv);
+
     muthread_t thread[5];
     muthread_attr_t attr;
     int st;
@@ -117,8 +566,9 @@ int main(int argc, char **argv)
     }
 
     muprint("[thread main] Threads spawned successfully\n");
-    muprint("[thread main] Sleeping 7 seconds\n");
-    musleep(7);
+    muprint("[thread main] Joining the threads\n");
+    for (int i = 0; i < 5; ++i)
+        muthread_join(thread[i], 0);
 
     /* Spawn threads to thest the errorcheck mutex */
     void *(*err_check_func[2])(void *) = {thread_func_errorcheck1,
@@ -135,8 +585,9 @@ int main(int argc, char **argv)
     }
 
     muprint("[thread main] Threads spawned successfully\n");
-    muprint("[thread main] Sleeping 5 seconds\n");
-    musleep(5);
+    muprint("[thread main] Joining the threads\n");
+    for (int i = 0; i < 2; ++i)
+        muthread_join(thread[i], 0);
 
     /* Spawn the threads to test the recursive mutex */
     muprint("---\n");
@@ -152,8 +603,256 @@ int main(int argc, char **argv)
     }
 
     muprint("[thread main] Threads spawned successfully\n");
-    muprint("[thread main] Sleeping 7 seconds\n");
-    musleep(7);
+    muprint("[thread main] Joining the threads\n");
+    for (int i = 0; i < 5; ++i)
+        muthread_join(thread[i], 0);
+
+    /* Threads one after the other reuse the same stack and descriptor */
+    muprint("---\n");
+    muprint("[thread main] Testing join and stack reuse\n");
+    muthread_t first = 0;
+    int reused = 0;
+    for (uintptr_t i = 0; i < 100; ++i) {
+        void *ret;
+        muthread_t th;
+        st = muthread_create(&th, &attr, thread_func_return, (void *) i);
+        if (st != 0 || muthread_join(th, &ret) != 0 ||
+            ret != (void *) (i + 1)) {
+            muprint("Failed to run and join thread %lu\n", i);
+            return 1;
+        }
+        if (!first)
+            first = th;
+        reused += th == first;
+    }
+    muprint("[thread main] 100 threads joined, %d on the same stack\n", reused);
+
+    muprint("---\n");
+    muprint("[thread main] Testing detached threads\n");
+    for (int i = 0; i < 20; ++i) {
+        muthread_t th;
+        st = muthread_create(&th, &attr, thread_func_detached, 0);
+        if (st != 0 || muthread_detach(th) != 0) {
+            muprint("Failed to spawn and detach thread %d\n", i);
+            return 1;
+        }
+    }
+    while (__atomic_load_n(&detached_done, __ATOMIC_ACQUIRE) < 20)
+        musleep_ns(1000000);
+    muprint("[thread main] 20 detached threads done\n");
+
+    muprint("---\n");
+    muprint("[thread main] Testing the thread pool\n");
+    pool = mupool_create(4);
+    if (!pool) {
+        muprint("Failed to create the pool\n");
+        return 1;
+    }
+    for (int i = 0; i < 10000; ++i)
+        mupool_submit(pool, task_count, (void *) 1);
+    mupool_submit(pool, task_tree, (void *) 14);
+    mupool_wait(pool);
+    mupool_destroy(pool);
+    muprint("[thread main] %lu tasks counted, expected %lu\n", pool_count,
+            10000UL + (1UL << 14));
+    if (pool_count != 10000UL + (1UL << 14))
+        return 1;
+
+    muprint("---\n");
+    muprint("[thread main] Testing coroutines\n");
+    pool = mupool_create(4);
+    if (!pool) {
+        muprint("Failed to create the pool\n");
+        return 1;
+    }
+    for (int i = 0; i < 1000; ++i) {
+        if (mucoro_spawn(pool, coro_func, 0)) {
+            muprint("Failed to spawn coroutine %d\n", i);
+            return 1;
+        }
+    }
+    mupool_wait(pool);
+    mupool_destroy(pool);
+    muprint("[thread main] 1000 coroutines counted %lu, expected 100000\n",
+            coro_count);
+    if (coro_count != 100000)
+        return 1;
+
+    muthread_mutexattr_settype(&mattr, TBTHREAD_MUTEX_RECURSIVE);
+    muthread_mutex_init(&coro_recursive, &mattr);
+    muthread_mutexattr_settype(&mattr, TBTHREAD_MUTEX_ERRORCHECK);
+    muthread_mutex_init(&coro_errorcheck, &mattr);
+    for (int workers = 1; workers <= 4; workers += 3) {
+        pool = mupool_create(workers);
+        if (!pool) {
+            muprint("Failed to create the pool\n");
+            return 1;
+        }
+        for (int i = 0; i < 8; ++i) {
+            muthread_mutex_t *mutex =
+                i & 1 ? &coro_errorcheck : &coro_recursive;
+            if (mucoro_spawn(pool, coro_func_owner, mutex)) {
+                muprint("Failed to spawn coroutine %d\n", i);
+                return 1;
+            }
+        }
+        mupool_wait(pool);
+        mupool_destroy(pool);
+    }
+    muprint("[thread main] Recursive and errorcheck mutexes held by "
+            "coroutines: %d errors\n",
+            coro_errors);
+    if (coro_errors)
+        return 1;
+
+    pool = mupool_create(2);
+    if (!pool) {
+        muprint("Failed to create the pool\n");
+        return 1;
+    }
+    for (int i = 0; i < 100; ++i) {
+        if (mucoro_spawn(pool, coro_func_gate, 0)) {
+            muprint("Failed to spawn coroutine %d\n", i);
+            return 1;
+        }
+    }
+    st = muthread_create(&thread[0], &attr, thread_func_gate, 0);
+    if (st != 0) {
+        muprint("Failed to spawn thread 0: %s\n", strerror(-st));
+        return 1;
+    }
+    mupool_wait(pool);
+    muprint("[thread main] %lu of 100 blocked coroutines done once waited "
+            "for\n",
+            coro_passed);
+    muthread_join(thread[0], 0);
+    mupool_destroy(pool);
+    if (coro_passed != 100)
+        return 1;
+
+    muprint("---\n");
+    muprint("[thread main] Testing the reader-writer lock\n");
+    void *(*rw_func[2])(void *) = {thread_func_reader, thread_func_writer};
+    for (int i = 0; i < 5; ++i) {
+        st = muthread_create(&thread[i], &attr, rw_func[i >= 3], 0);
+        if (st != 0) {
+            muprint("Failed to spawn thread %d: %s\n", i, strerror(-st));
+            return 1;
+        }
+    }
+    for (int i = 0; i < 5; ++i)
+        muthread_join(thread[i], 0);
+    muprint("[thread main] 3 readers, 2 writers: %lu writes, %s\n", pair[0],
+            torn ? "torn reads" : "no torn reads");
+    if (torn || pair[0] != 20000)
+        return 1;
+
+    muprint("---\n");
+    muprint("[thread main] Testing the condition variable\n");
+    muthread_mutex_t relay_mutex;
+    muthread_cond_t relay_cond;
+    muthread_mutex_init(&relay_mutex, 0);
+    muthread_cond_init(&relay_cond);
+    relay_t relay = {mu_lock, mu_unlock, mu_wait, mu_broadcast, &relay_mutex,
+                     &relay_cond, 1000, 5};
+    for (int i = 0; i < 5; ++i) {
+        st = muthread_create(&thread[i], &attr, relay_func, &relay);
+        if (st != 0) {
+            muprint("Failed to spawn thread %d: %s\n", i, strerror(-st));
+            return 1;
+        }
+    }
+    for (int i = 0; i < 5; ++i)
+        muthread_join(thread[i], 0);
+    muprint("[thread main] 5 threads passed the turn %lu times\n",
+            relay.passes);
+    if (relay.passes != 5000)
+        return 1;
+
+    muprint("---\n");
+    muprint("[thread main] Testing the clock\n");
+    struct timespec start, end, libc;
+    muclock_gettime(CLOCK_REALTIME, &start);
+    clock_gettime(CLOCK_REALTIME, &libc);
+    muprint("[thread main] Clock read through the %s, %lu ns behind glibc\n",
+            muclock_vdso() ? "vDSO" : "system call", elapsed(&start, &libc));
+    if (elapsed(&start, &libc) > 100000000)
+        return 1;
+
+    muclock_gettime(CLOCK_MONOTONIC, &start);
+    musleep_ns(20000000);
+    muclock_gettime(CLOCK_MONOTONIC, &end);
+    muprint("[thread main] Slept 20 ms: %s\n",
+            elapsed(&start, &end) >= 20000000 ? "ok" : "too short");
+    if (elapsed(&start, &end) < 20000000)
+        return 1;
+
+    /* Time out on a mutex we hold, then get it */
+    struct timespec deadline;
+    muthread_mutex_lock(&mutex_normal);
+    muclock_gettime(CLOCK_MONOTONIC, &start);
+    muclock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 50000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+    st = muthread_mutex_timedlock(&mutex_normal, &deadline);
+    muclock_gettime(CLOCK_MONOTONIC, &end);
+    muthread_mutex_unlock(&mutex_normal);
+    muprint("[thread main] Timed lock of a held mutex: %s after %lu ms\n",
+            st == -ETIMEDOUT ? "timed out" : "no time out",
+            elapsed(&start, &end) / 1000000);
+    if (st != -ETIMEDOUT || elapsed(&start, &end) < 50000000)
+        return 1;
+    if (muthread_mutex_timedlock(&mutex_normal, &deadline) != 0)
+        return 1;
+    muthread_mutex_unlock(&mutex_normal);
+
+    muprint("---\n");
+    muprint("[thread main] Testing aligned allocations\n");
+    int misaligned = 0;
+    for (size_t align = 8; align <= 1024 * 1024; align *= 2) {
+        for (size_t size = 1; size <= 256 * 1024; size *= 8) {
+            void *ptr;
+            if (posix_memalign(&ptr, align, size) != 0)
+                return 1;
+            memset(ptr, 0xa5, size);
+            misaligned += ((uintptr_t) ptr & (align - 1)) != 0;
+            ptr = realloc(ptr, size * 2);
+            if (!ptr)
+                return 1;
+            free(ptr);
+            ptr = aligned_alloc(align, size);
+            misaligned += !ptr || ((uintptr_t) ptr & (align - 1)) != 0;
+            free(ptr);
+        }
+    }
+    muprint("[thread main] Alignments up to 1 MiB: %d misaligned\n",
+            misaligned);
+    if (misaligned)
+        return 1;
+
+    muprint("---\n");
+    muprint("[thread main] Testing asynchronous printing\n");
+    st = muprint_async(1);
+    if (st != 0) {
+        muprint("Failed to start the flusher: %s\n", strerror(-st));
+        return 1;
+    }
+    for (int i = 0; i < 5; ++i) {
+        st = muthread_create(&thread[i], &attr, thread_func_print,
+                             (void *) (uintptr_t) i);
+        if (st != 0) {
+            muprint("Failed to spawn thread %d: %s\n", i, strerror(-st));
+            return 1;
+        }
+    }
+    for (int i = 0; i < 5; ++i)
+        muthread_join(thread[i], 0);
+    muprint_flush();
+    muprint("[thread main] 50 lines flushed\n");
+    muprint_async(0);
 
     return 0;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <asm-generic/mman-common.h>
 #include <asm-generic/param.h>
+#include <linux/futex.h>
 #include <linux/mman.h>
 #include <linux/sched.h>
 #include <stdint.h>
@@ -14,30 +15,115 @@ void muthread_attr_init(muthread_attr_t *attr)
     attr->stack_size = 8192 * 1024;
 }
 
+/* Stack cache
+ *
+ * Exited threads leave their descriptor and stack here for the next
+ * muthread_create with the same stack size, saving the mmap, mprotect and
+ * munmap system calls and the page faults of a fresh stack. A detached
+ * thread puts itself in the cache while it is still running on the stack:
+ * an entry can only be reused once the kernel cleared its tid
+ * (CLONE_CHILD_CLEARTID), which happens after the thread is gone.
+ */
+#define STACK_CACHE 16
+
+enum { THREAD_JOINABLE, THREAD_DETACHED, THREAD_EXITED };
+
+static muthread_mutex_t cache_lock = TBTHREAD_MUTEX_INITIALIZER;
+static muthread_t cached;
+static uint32_t ncached;
+
+/* A cached thread with a stack of stack_size, or 0 */
+static muthread_t cache_get(uint32_t stack_size)
+{
+    muthread_mutex_lock(&cache_lock);
+    muthread_t *cursor = &cached;
+    while (*cursor) {
+        muthread_t th = *cursor;
+        if (th->stack_size == stack_size &&
+            !__atomic_load_n(&th->tid, __ATOMIC_ACQUIRE)) {
+            *cursor = th->next;
+            --ncached;
+            muthread_mutex_unlock(&cache_lock);
+            return th;
+        }
+        cursor = &th->next;
+    }
+    muthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/* Cache a thread, false if the cache is full */
+static int cache_put(muthread_t th)
+{
+    muthread_mutex_lock(&cache_lock);
+    if (ncached >= STACK_CACHE) {
+        muthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    th->next = cached;
+    cached = th;
+    ++ncached;
+    muthread_mutex_unlock(&cache_lock);
+    return 1;
+}
+
+/* Wait for the thread to be gone, then recycle it */
+static void reap(muthread_t th)
+{
+    int tid;
+    while ((tid = __atomic_load_n(&th->tid, __ATOMIC_ACQUIRE)))
+        SYSCALL3(__NR_futex, &th->tid, FUTEX_WAIT, tid);
+
+    if (!cache_put(th)) {
+        mumunmap(th->stack, th->stack_size);
+        free(th);
+    }
+}
+
+/* Terminate the calling thread */
+static void __attribute__((noreturn)) thread_exit(muthread_t th, void *retval)
+{
+    th->retval = retval;
+    mucache_release(th);
+
+    /* Joinable: the joiner recycles us once the kernel cleared the tid */
+    int state = THREAD_JOINABLE;
+    if (!__atomic_compare_exchange_n(&th->state, &state, THREAD_EXITED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        !cache_put(th)) {
+        /* Detached with a full cache: free everything ourselves. Nobody
+         * must clear the tid in the freed descriptor.
+         */
+        uint32_t stack_size = th->stack_size;
+        void *stack = th->stack;
+        SYSCALL1(__NR_set_tid_address, 0);
+        free(th);
+
+        /* Free the stack and exit. We do it this way because we remove the
+         * stack from underneath our feet and cannot allow the C code to
+         * write on it anymore.
+         */
+        register long a1 asm("rdi") = (long) stack;
+        register long a2 asm("rsi") = stack_size;
+        asm volatile(
+            "syscall\n\t"
+            "movq $60, %%rax\n\t"  // 60 = __NR_exit
+            "movq $0, %%rdi\n\t"
+            "syscall"
+            :
+            : "a"(__NR_munmap), "r"(a1), "r"(a2)
+            : "memory", "cc", "r11", "cx");
+    }
+
+    while (1)
+        SYSCALL1(__NR_exit, 0);
+}
+
 /* Thread function wrapper */
 static int start_thread(void *arg)
 {
     muthread_t th = (muthread_t) arg;
-    uint32_t stack_size = th->stack_size;
-    void *stack = th->stack;
-    th->fn(th->arg);
-    free(th);
-
-    /* Free the stack and exit. We do it this way because we remove the stack
-     * from underneath our feet and cannot allow the C code to write on it
-     * anymore.
-     */
-    register long a1 asm("rdi") = (long) stack;
-    register long a2 asm("rsi") = stack_size;
-    asm volatile(
-        "syscall\n\t"
-        "movq $60, %%rax\n\t"  // 60 = __NR_exit
-        "movq $0, %%rdi\n\t"
-        "syscall"
-        :
-        : "a"(__NR_munmap), "r"(a1), "r"(a2)
-        : "memory", "cc", "r11", "cx");
-    return 0;
+    thread_exit(th, th->fn(th->arg));
 }
 
 /* Spawn a thread */
@@ -46,41 +132,98 @@ int muthread_create(muthread_t *thread,
                     void *(*f)(void *),
                     void *arg)
 {
-    /* Allocate the stack with a guard page at the end so that we could protect
-     * from overflows (by receiving a SIGSEGV)
-     */
-    void *stack = mummap(NULL, attr->stack_size, PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    long status = (long) stack;
-    if (status < 0)
-        return status;
-
-    status = SYSCALL3(__NR_mprotect, stack, EXEC_PAGESIZE, PROT_NONE);
-    if (status < 0) {
-        mumunmap(stack, attr->stack_size);
-        return status;
+    muthread_t th = cache_get(attr->stack_size);
+    if (!th) {
+        /* Allocate the stack with a guard page at the end so that we could
+         * protect from overflows (by receiving a SIGSEGV)
+         */
+        void *stack = mummap(NULL, attr->stack_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        long status = (long) stack;
+        if (status < 0)
+            return status;
+
+        status = SYSCALL3(__NR_mprotect, stack, EXEC_PAGESIZE, PROT_NONE);
+        if (status < 0) {
+            mumunmap(stack, attr->stack_size);
+            return status;
+        }
+
+        th = malloc(sizeof(struct muthread));
+        if (!th) {
+            mumunmap(stack, attr->stack_size);
+            return -ENOMEM;
+        }
+        th->stack = stack;
+        th->stack_size = attr->stack_size;
     }
 
-    /* Pack everything up */
-    *thread = malloc(sizeof(struct muthread));
-    memset(*thread, 0, sizeof(struct muthread));
-    (*thread)->self = *thread;
-    (*thread)->stack = stack;
-    (*thread)->stack_size = attr->stack_size;
-    (*thread)->fn = f;
-    (*thread)->arg = arg;
+    /* Pack everything up, the stack stays */
+    void *stack = th->stack;
+    memset(th, 0, sizeof(struct muthread));
+    th->self = th;
+    th->magic = MUTHREAD_MAGIC;
+    th->stack = stack;
+    th->stack_size = attr->stack_size;
+    th->fn = f;
+    th->arg = arg;
+    th->state = THREAD_JOINABLE;
 
-    /* Spawn the thread */
+    /* Spawn the thread. The kernel sets tid before we return and clears it
+     * and wakes up the futex on it when the thread is gone.
+     */
     int flags =
         CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SYSVSEM | CLONE_SIGHAND;
     flags |= CLONE_THREAD | CLONE_SETTLS;
-    int tid = muclone(start_thread, *thread, flags,
-                      (char *) stack + attr->stack_size, 0, 0, *thread);
+    flags |= CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+    int tid = muclone(start_thread, th, flags,
+                      (char *) stack + attr->stack_size, &th->tid, &th->tid,
+                      th);
     if (tid < 0) {
         mumunmap(stack, attr->stack_size);
-        free(*thread);
+        free(th);
         return tid;
     }
 
+    *thread = th;
+    return 0;
+}
+
+/* Terminate the calling thread with retval */
+void muthread_exit(void *retval)
+{
+    thread_exit(muthread_self(), retval);
+}
+
+/* Wait for a thread to terminate and get what it returned */
+int muthread_join(muthread_t thread, void **retval)
+{
+    if (thread == muthread_self())
+        return -EDEADLK;
+    if (__atomic_load_n(&thread->state, __ATOMIC_ACQUIRE) == THREAD_DETACHED)
+        return -EINVAL;
+
+    int tid;
+    while ((tid = __atomic_load_n(&thread->tid, __ATOMIC_ACQUIRE)))
+        SYSCALL3(__NR_futex, &thread->tid, FUTEX_WAIT, tid);
+
+    if (retval)
+        *retval = thread->retval;
+    reap(thread);
     return 0;
-}
\ No newline at end of file
+}
+
+/* Let the thread recycle itself when it terminates */
+int muthread_detach(muthread_t thread)
+{
+    int state = THREAD_JOINABLE;
+    if (__atomic_compare_exchange_n(&thread->state, &state, THREAD_DETACHED,
+                                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    if (state == THREAD_DETACHED)
+        return -EINVAL;
+
+    /* Already exited, nobody is going to join it */
+    reap(thread);
+    return 0;
+}
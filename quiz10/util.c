@@ -1,27 +1,30 @@
 #include "mu.h"
 
+#include <asm-generic/mman-common.h>
 #include <asm-generic/param.h>
 #include <linux/futex.h>
+#include <linux/mman.h>
 #include <linux/time.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 
-/* A futex for serializing the writes */
+/* A futex lock for the output and the allocator: 0 when unlocked, 1 when
+ * locked and 2 when somebody may be waiting, so that unlocking makes no
+ * system call unless needed
+ */
 static void futex_lock(int *futex)
 {
-    while (1) {
-        int val = *futex;
-        if (val == 0 && atomic_bool_cmpxchg(futex, val, 1))
-            return;
-        SYSCALL3(__NR_futex, futex, FUTEX_WAIT, 1);
-    }
+    if (atomic_bool_cmpxchg(futex, 0, 1))
+        return;
+    while (__atomic_exchange_n(futex, 2, __ATOMIC_ACQUIRE) != 0)
+        SYSCALL3(__NR_futex, futex, FUTEX_WAIT_PRIVATE, 2);
 }
 
 static void futex_unlock(int *futex)
 {
-    atomic_bool_cmpxchg(futex, 1, 0);
-    SYSCALL3(__NR_futex, futex, FUTEX_WAKE, 1);
+    if (__atomic_exchange_n(futex, 0, __ATOMIC_RELEASE) == 2)
+        SYSCALL3(__NR_futex, futex, FUTEX_WAKE_PRIVATE, 1);
 }
 
 static inline int muwrite(int fd, const char *buffer, unsigned long len)
@@ -29,57 +32,257 @@ static inline int muwrite(int fd, const char *buffer, unsigned long len)
     return SYSCALL3(__NR_write, fd, buffer, len);
 }
 
+/* Write it all, whatever the kernel takes at a time */
+static void muwrite_all(int fd, const char *buffer, unsigned long len)
+{
+    while (len) {
+        int ret = muwrite(fd, buffer, len);
+        if (ret == -EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        buffer += ret;
+        len -= ret;
+    }
+}
+
+/* Printing
+ *
+ * muprint formats the whole message in a buffer on the stack of the
+ * calling thread, or in a bigger one from malloc if it does not fit, and
+ * writes it with a single system call: no lock needed, the kernel does
+ * not interleave writes to a file (nor to a pipe, up to PIPE_BUF bytes).
+ *
+ * In asynchronous mode the messages are copied to the active one of two
+ * log buffers instead, and a flusher thread swaps them and writes the full
+ * one at least every LOG_PERIOD, or sooner once it is half full.
+ */
+#define PRINT_BUFFER 4096
+#define LOG_BUFFER (64 * 1024)
+#define LOG_PERIOD 10000000 /* ns */
+
+/* The allocator is further down */
+void *malloc(size_t size);
+void free(void *ptr);
+
+typedef struct {
+    char *data;
+    uint32_t len;
+    uint32_t size;
+    char local[PRINT_BUFFER];
+} printbuf_t;
+
+static struct {
+    int lock;
+    int enabled;
+    int stop;
+    int event;    /* Futex the flusher sleeps on */
+    int kicked;   /* The flusher was woken up for the active buffer */
+    int swaps;    /* Buffers handed to the flusher */
+    int flushed;  /* And written, futex for the ones waiting for it */
+    int active;
+    uint32_t len; /* In the active buffer */
+    muthread_t thread;
+    char data[2][LOG_BUFFER];
+} logger;
+
+static void log_kick()
+{
+    __atomic_fetch_add(&logger.event, 1, __ATOMIC_RELEASE);
+    SYSCALL3(__NR_futex, &logger.event, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Wait until the flusher wrote the buffers swapped so far, and the active
+ * one too if full
+ */
+static void log_wait(int full)
+{
+    futex_lock(&logger.lock);
+    int target = logger.swaps + (full && logger.len);
+    futex_unlock(&logger.lock);
+
+    while (1) {
+        int flushed = __atomic_load_n(&logger.flushed, __ATOMIC_ACQUIRE);
+        if (flushed - target >= 0)
+            return;
+        log_kick();
+        SYSCALL3(__NR_futex, &logger.flushed, FUTEX_WAIT_PRIVATE, flushed);
+    }
+}
+
+/* Queue a message for the flusher, false if it does not run */
+static int log_append(const char *data, uint32_t len)
+{
+    while (1) {
+        futex_lock(&logger.lock);
+        if (!logger.enabled) {
+            futex_unlock(&logger.lock);
+            return 0;
+        }
+        if (logger.len + len <= LOG_BUFFER)
+            break;
+        futex_unlock(&logger.lock);
+        log_wait(1);
+    }
+
+    memcpy(logger.data[logger.active] + logger.len, data, len);
+    logger.len += len;
+    int kick = logger.len >= LOG_BUFFER / 2 && !logger.kicked;
+    if (kick)
+        logger.kicked = 1;
+    futex_unlock(&logger.lock);
+
+    if (kick)
+        log_kick();
+    return 1;
+}
+
+static void *log_flusher(void *arg)
+{
+    struct timespec period = {.tv_sec = 0, .tv_nsec = LOG_PERIOD};
+    while (1) {
+        int event = __atomic_load_n(&logger.event, __ATOMIC_ACQUIRE);
+        futex_lock(&logger.lock);
+        uint32_t len = logger.len;
+        int full = logger.active;
+        if (len) {
+            logger.active ^= 1;
+            logger.len = 0;
+            logger.kicked = 0;
+            ++logger.swaps;
+        }
+        int stop = logger.stop;
+        futex_unlock(&logger.lock);
+
+        if (len) {
+            muwrite_all(1, logger.data[full], len);
+            __atomic_fetch_add(&logger.flushed, 1, __ATOMIC_RELEASE);
+            SYSCALL3(__NR_futex, &logger.flushed, FUTEX_WAKE_PRIVATE,
+                     INT32_MAX);
+            continue;
+        }
+        if (stop)
+            return 0;
+        SYSCALL4(__NR_futex, &logger.event, FUTEX_WAIT_PRIVATE, event,
+                 &period);
+    }
+}
+
+/* Turn asynchronous printing on or off, off flushes what is left */
+int muprint_async(int enable)
+{
+    if (enable) {
+        if (logger.thread)
+            return -EBUSY;
+        logger.stop = 0;
+        muthread_attr_t attr;
+        muthread_attr_init(&attr);
+        attr.stack_size = 64 * 1024;
+        int ret = muthread_create(&logger.thread, &attr, log_flusher, 0);
+        if (ret) {
+            logger.thread = 0;
+            return ret;
+        }
+        futex_lock(&logger.lock);
+        logger.enabled = 1;
+        futex_unlock(&logger.lock);
+        return 0;
+    }
+
+    if (!logger.thread)
+        return -EINVAL;
+    futex_lock(&logger.lock);
+    logger.enabled = 0;
+    logger.stop = 1;
+    futex_unlock(&logger.lock);
+    log_kick();
+    muthread_join(logger.thread, 0);
+    logger.thread = 0;
+    return 0;
+}
+
+/* Wait until everything printed so far is written */
+void muprint_flush()
+{
+    if (__atomic_load_n(&logger.enabled, __ATOMIC_ACQUIRE))
+        log_wait(1);
+}
+
+static void print_emit(printbuf_t *buf)
+{
+    if (!buf->len)
+        return;
+    if (buf->len > LOG_BUFFER || !log_append(buf->data, buf->len)) {
+        muprint_flush();
+        muwrite_all(1, buf->data, buf->len);
+    }
+    buf->len = 0;
+}
+
+static void print_put(printbuf_t *buf, const char *str, unsigned long len)
+{
+    if (buf->len + len > buf->size) {
+        uint64_t size = buf->size * 2;
+        while (size < buf->len + len)
+            size *= 2;
+        char *data = size <= UINT32_MAX ? malloc(size) : 0;
+        if (data) {
+            memcpy(data, buf->data, buf->len);
+            if (buf->data != buf->local)
+                free(buf->data);
+            buf->data = data;
+            buf->size = size;
+        }
+    }
+
+    /* Out of memory, the message gets written in parts */
+    while (len) {
+        if (buf->len == buf->size)
+            print_emit(buf);
+        unsigned long n = buf->size - buf->len;
+        if (n > len)
+            n = len;
+        memcpy(buf->data + buf->len, str, n);
+        buf->len += n;
+        str += n;
+        len -= n;
+    }
+}
+
 /* Print unsigned int to a string */
-static void printNum(uint64_t num, int base)
+static void printNum(printbuf_t *buf, uint64_t num, int base)
 {
     if (base <= 0 || base > 16)
         return;
-    if (num == 0) {
-        muwrite(1, "0", 1);
-        return;
-    }
-    uint64_t n = num;
-    char str[32];
-    str[31] = 0;
-    char *cursor = str + 30;
+    char str[64];
+    char *cursor = str + sizeof(str);
     char digits[] = "0123456789abcdef";
-    while (n && cursor != str) {
-        int rem = n % base;
-        *cursor = digits[rem];
-        n /= base;
-        --cursor;
-    }
-    ++cursor;
-    muwrite(1, cursor, 32 - (cursor - str));
+    do {
+        *--cursor = digits[num % base];
+        num /= base;
+    } while (num);
+    print_put(buf, cursor, str + sizeof(str) - cursor);
 }
 
 /* Print signed int to a string */
-static void printNumS(int64_t num)
+static void printNumS(printbuf_t *buf, int64_t num)
 {
-    if (num == 0) {
-        muwrite(1, "0", 1);
+    if (num < 0) {
+        print_put(buf, "-", 1);
+        printNum(buf, -(uint64_t) num, 10);
         return;
     }
-    uint64_t n = num;
-    char str[32];
-    str[31] = 0;
-    char *cursor = str + 30;
-    char digits[] = "0123456789";
-    while (n && cursor != str) {
-        int rem = n % 10;
-        *cursor = digits[rem];
-        n /= 10;
-        --cursor;
-    }
-    ++cursor;
-    muwrite(1, cursor, 32 - (cursor - str));
+    printNum(buf, num, 10);
 }
 
 /* print to stdout */
-static int print_lock;
 void muprint(const char *format, ...)
 {
-    futex_lock(&print_lock);
+    printbuf_t buf;
+    buf.data = buf.local;
+    buf.len = 0;
+    buf.size = PRINT_BUFFER;
+
     va_list ap;
     int length = 0;
     int sz = 0;
@@ -90,14 +293,14 @@ void muprint(const char *format, ...)
     va_start(ap, format);
     while (*cursor) {
         if (*cursor == '%') {
-            muwrite(1, start, length);
+            print_put(&buf, start, length);
             ++cursor;
             if (*cursor == 0)
                 break;
 
             if (*cursor == 's') {
                 const char *str = va_arg(ap, const char *);
-                muwrite(1, str, strlen(str));
+                print_put(&buf, str, strlen(str));
             }
 
             else {
@@ -125,7 +328,7 @@ void muprint(const char *format, ...)
                         num = va_arg(ap, unsigned long);
                     else
                         num = va_arg(ap, unsigned long long);
-                    printNum(num, base);
+                    printNum(&buf, num, base);
                 } else {
                     int64_t num;
                     if (sz == 0)
@@ -134,7 +337,7 @@ void muprint(const char *format, ...)
                         num = va_arg(ap, long);
                     else
                         num = va_arg(ap, long long);
-                    printNumS(num);
+                    printNumS(&buf, num);
                 }
                 sz = 0;
                 base = 0;
@@ -149,16 +352,25 @@ void muprint(const char *format, ...)
         ++cursor;
     }
     if (length)
-        muwrite(1, start, length);
+        print_put(&buf, start, length);
     va_end(ap);
-    futex_unlock(&print_lock);
+
+    print_emit(&buf);
+    if (buf.data != buf.local)
+        free(buf.data);
 }
 
 /* sleep */
 void musleep(int secs)
 {
-    struct timespec ts = {.tv_sec = secs, .tv_nsec = 0},
-                    rem = {.tv_sec = 0, .tv_nsec = 0};
+    musleep_ns(secs * 1000000000ULL);
+}
+
+void musleep_ns(uint64_t ns)
+{
+    struct timespec ts = {.tv_sec = ns / 1000000000,
+                          .tv_nsec = ns % 1000000000};
+    struct timespec rem = {.tv_sec = 0, .tv_nsec = 0};
     while (SYSCALL2(__NR_nanosleep, &ts, &rem) == -EINTR) {
         ts.tv_sec = rem.tv_sec;
         ts.tv_nsec = rem.tv_nsec;
@@ -182,100 +394,679 @@ int mumunmap(void *addr, unsigned long length)
     return SYSCALL2(__NR_munmap, addr, length);
 }
 
+/* Size-class segregated allocator
+ *
+ * Small allocations are served from spans: SPAN_SIZE aligned blocks of
+ * pages, each holding objects of a single size class. Every size class has
+ * a list of the spans with free objects in them, so malloc and free are
+ * O(1): pop or push the span's free list. A span that gets empty is
+ * recycled for any size class and unmapped when too many are cached.
+ * Allocations larger than the biggest class come from the page heap below,
+ * the largest ones get their own mapping.
+ *
+ * The header of a span (or of a large mapping) is found by masking the
+ * object pointer with SPAN_SIZE, that's why large mappings are SPAN_SIZE
+ * aligned too. Only a pointer aligned to SPAN_SIZE or more, which no span
+ * hands out, has its header a page below instead.
+ */
+#define SPAN_PAGES 16
+#define SPAN_SIZE (SPAN_PAGES * EXEC_PAGESIZE)
+#define SPAN_CACHE 16 /* Empty spans kept around */
+#define SMALL_MAX 8192
+#define NCLASSES MUCACHE_CLASSES
+#define LARGE_CLASS NCLASSES
+
+typedef struct span {
+    struct span *next; /* Spans with free objects of this class, or cached */
+    struct span *prev;
+    void *free;     /* Freed objects, linked through their first word */
+    char *bump;     /* Objects from here on have never been allocated */
+    uint64_t size;  /* Object size for small spans, mapping size for large */
+    uint32_t used;  /* Objects handed out */
+    uint32_t class; /* Size class, LARGE_CLASS for a large allocation */
+    uint64_t pad[2];
+} span_t;
+
+static int memory_lock; /* Guards the spans */
+static span_t *partial[NCLASSES];
+static span_t *cached;
+static uint32_t ncached;
+
+/* 16 byte steps up to 128, then 4 classes per power of 2 up to SMALL_MAX */
+static inline uint32_t size_to_class(size_t size)
+{
+    if (size <= 128)
+        return size ? (size - 1) >> 4 : 0;
+    uint32_t b = 63 - __builtin_clzl(size - 1);
+    return 8 + (b - 7) * 4 + ((size - 1) >> (b - 2)) - 4;
+}
+
+static inline uint64_t class_to_size(uint32_t class)
+{
+    if (class < 8)
+        return (class + 1) << 4;
+    uint32_t group = (class - 8) / 4;
+    return (128ULL << group) + ((class - 8) % 4 + 1) * (32ULL << group);
+}
+
+static inline span_t *span_of(void *ptr)
+{
+    return (span_t *) ((uintptr_t) ptr & ~((uintptr_t) SPAN_SIZE - 1));
+}
+
+/* Header of a pointer that is not in the heap */
+static inline span_t *header_of(void *ptr)
+{
+    if (!((uintptr_t) ptr & (SPAN_SIZE - 1)))
+        return (span_t *) ((char *) ptr - EXEC_PAGESIZE);
+    return span_of(ptr);
+}
+
+/* Map length bytes such that offset bytes in is aligned to align, a power
+ * of 2 of at least a page, trimming the excess
+ */
+static void *map_aligned(size_t length, size_t align, size_t offset)
+{
+    char *mem = mummap(NULL, length + align, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((long) mem < 0)
+        return 0;
+
+    char *aligned =
+        (char *) (((uintptr_t) mem + offset + align - 1) & ~(align - 1)) -
+        offset;
+    if (aligned != mem)
+        mumunmap(mem, aligned - mem);
+    if (aligned + length != mem + length + align)
+        mumunmap(aligned + length, mem + align - aligned);
+    return aligned;
+}
+
+static inline void list_push(span_t **list, span_t *span)
+{
+    span->prev = 0;
+    span->next = *list;
+    if (*list)
+        (*list)->prev = span;
+    *list = span;
+}
+
+static inline void list_remove(span_t **list, span_t *span)
+{
+    if (span->prev)
+        span->prev->next = span->next;
+    else
+        *list = span->next;
+    if (span->next)
+        span->next->prev = span->prev;
+}
+
+static span_t *span_alloc(uint32_t class)
+{
+    span_t *span = cached;
+    if (span) {
+        cached = span->next;
+        --ncached;
+    } else {
+        span = map_aligned(SPAN_SIZE, SPAN_SIZE, 0);
+        if (!span)
+            return 0;
+    }
+
+    span->free = 0;
+    span->bump = (char *) span + sizeof(span_t);
+    span->size = class_to_size(class);
+    span->used = 0;
+    span->class = class;
+    list_push(&partial[class], span);
+    return span;
+}
+
+static void span_release(span_t *span)
+{
+    list_remove(&partial[span->class], span);
+    if (ncached >= SPAN_CACHE) {
+        mumunmap(span, SPAN_SIZE);
+        return;
+    }
+    span->next = cached;
+    cached = span;
+    ++ncached;
+}
+
+/* A mapping of its own, the object align bytes after the header or right
+ * after it if align is smaller
+ */
+static void *large_alloc(size_t size, size_t align)
+{
+    if (size > ((size_t) -1 >> 2) || align > ((size_t) -1 >> 2))
+        return 0;
+
+    size_t offset = align < sizeof(span_t) ? sizeof(span_t) : align;
+    if (align >= SPAN_SIZE)
+        offset = EXEC_PAGESIZE;
+    size_t length = offset + size;
+    length = (length + EXEC_PAGESIZE - 1) & ~((size_t) EXEC_PAGESIZE - 1);
+
+    span_t *span = align >= SPAN_SIZE
+                       ? map_aligned(length, align, offset)
+                       : map_aligned(length, SPAN_SIZE, 0);
+    if (!span)
+        return 0;
+    span->size = length;
+    span->class = LARGE_CLASS;
+    return (char *) span + offset;
+}
+
+/* Page heap
+ *
+ * Allocations between SMALL_MAX and HEAP_MAX are carved out of the brk
+ * heap. Every chunk starts with boundary tags: its own size and the size of
+ * the chunk before it, so a freed chunk is merged with free neighbours on
+ * both sides in O(1). Free chunks are indexed by size in bins, 4 per power
+ * of 2, with a bitmap of the non-empty ones: only the bin of the request is
+ * searched, any chunk of a bigger bin fits. A sentinel chunk marked used
+ * ends the heap, and brk is lowered when the free chunk before it gets
+ * bigger than HEAP_TRIM.
+ */
+#define HEAP_MAX (1024 * 1024)
+#define HEAP_GROW (256 * 1024) /* brk increments at least */
+#define HEAP_TRIM (512 * 1024)
+#define HEAP_PAD (64 * 1024) /* Left free at the top when trimming */
+#define HEAP_MIN_CHUNK 4096  /* Smaller remainders are not split off */
+#define NBINS 32
+#define CHUNK_USED 1ULL
+
+typedef struct chunk {
+    uint64_t prev_size; /* Size of the chunk before, 0 for the first one */
+    uint64_t size;      /* Including this header, CHUNK_USED when in use */
+    struct chunk *next; /* Free chunks only: in the bin */
+    struct chunk *prev;
+} chunk_t;
+
+#define CHUNK_HEADER (2 * sizeof(uint64_t))
+
+static int heap_lock;
+static char *heap_base;
+static char *heap_top; /* The sentinel, atomic because free peeks at it */
+static chunk_t *bins[NBINS];
+static uint32_t bins_used;
+
 static inline void *mubrk(void *addr)
 {
     return (void *) SYSCALL1(__NR_brk, addr);
 }
 
-/* malloc helpers */
-typedef struct memchunk {
-    struct memchunk *next;
-    uint64_t size;
-} memchunk_t;
+static inline uint64_t chunk_size(chunk_t *chunk)
+{
+    return chunk->size & ~CHUNK_USED;
+}
 
-static memchunk_t head;
-static void *heap_limit;
-#define MEMCHUNK_USED 0x4000000000000000
+static inline chunk_t *chunk_next(chunk_t *chunk)
+{
+    return (chunk_t *) ((char *) chunk + chunk_size(chunk));
+}
 
-/* Malloc */
-static int memory_lock;
-void *malloc(size_t size)
+static inline uint32_t heap_bin(uint64_t size)
 {
-    futex_lock(&memory_lock);
+    uint32_t b = 63 - __builtin_clzl(size);
+    if (b < 13)
+        return 0;
+    uint32_t bin = (b - 13) * 4 + ((size >> (b - 2)) & 3);
+    return bin < NBINS ? bin : NBINS - 1;
+}
 
-    /* Allocating anything less than 16 bytes is kind of pointless, the
-     * book-keeping overhead is too big. We will also align to 8 bytes.
-     */
-    size_t alloc_size = (((size - 1) >> 3) << 3) + 8;
-    if (alloc_size < 16)
-        alloc_size = 16;
-
-    /* Try to find a suitable chunk that is unused */
-    memchunk_t *cursor = &head;
-    memchunk_t *chunk = 0;
-    while (cursor->next) {
-        chunk = cursor->next;
-        if (!(chunk->size & MEMCHUNK_USED) && chunk->size >= alloc_size)
-            break;
-        cursor = cursor->next;
+static void bin_insert(chunk_t *chunk)
+{
+    uint32_t bin = heap_bin(chunk->size);
+    chunk->prev = 0;
+    chunk->next = bins[bin];
+    if (bins[bin])
+        bins[bin]->prev = chunk;
+    bins[bin] = chunk;
+    bins_used |= 1U << bin;
+}
+
+static void bin_remove(chunk_t *chunk)
+{
+    uint32_t bin = heap_bin(chunk->size);
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        bins[bin] = chunk->next;
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+    if (!bins[bin])
+        bins_used &= ~(1U << bin);
+}
+
+/* Lower brk if the free chunk before the sentinel got too big */
+static void heap_trim(chunk_t *chunk)
+{
+    uint64_t size = chunk->size - HEAP_PAD;
+    size &= ~((uint64_t) EXEC_PAGESIZE - 1);
+
+    char *top = heap_top - size;
+    if (mubrk(top + CHUNK_HEADER) != top + CHUNK_HEADER)
+        return;
+
+    chunk->size -= size;
+    chunk_t *sentinel = (chunk_t *) top;
+    sentinel->prev_size = chunk->size;
+    sentinel->size = CHUNK_USED;
+    __atomic_store_n(&heap_top, top, __ATOMIC_RELAXED);
+}
+
+/* Merge a chunk that is not in use with its free neighbours, heap_lock held */
+static void heap_release(chunk_t *chunk, int trim)
+{
+    chunk->size &= ~CHUNK_USED;
+
+    chunk_t *next = chunk_next(chunk);
+    if (!(next->size & CHUNK_USED)) {
+        bin_remove(next);
+        chunk->size += next->size;
+    }
+
+    if ((char *) chunk > heap_base) {
+        chunk_t *prev = (chunk_t *) ((char *) chunk - chunk->prev_size);
+        if (!(prev->size & CHUNK_USED)) {
+            bin_remove(prev);
+            prev->size += chunk->size;
+            chunk = prev;
+        }
+    }
+
+    next = chunk_next(chunk);
+    next->prev_size = chunk->size;
+    if (trim && (char *) next == heap_top && chunk->size >= HEAP_TRIM)
+        heap_trim(chunk);
+    bin_insert(chunk);
+}
+
+/* Move the sentinel up for a chunk of at least size, heap_lock held */
+static int heap_grow(uint64_t size)
+{
+    if (!heap_base) {
+        char *base = mubrk(0);
+        base = (char *) (((uintptr_t) base + 15) & ~(uintptr_t) 15);
+        if (mubrk(base + CHUNK_HEADER) != base + CHUNK_HEADER)
+            return 0;
+        heap_base = base;
+        ((chunk_t *) base)->prev_size = 0;
+        ((chunk_t *) base)->size = CHUNK_USED;
+        __atomic_store_n(&heap_top, base, __ATOMIC_RELAXED);
+    }
+
+    if (size < HEAP_GROW)
+        size = HEAP_GROW;
+    size = (size + EXEC_PAGESIZE - 1) & ~((uint64_t) EXEC_PAGESIZE - 1);
+
+    /* brk returns the old limit if it could not move it */
+    char *end = heap_top + size + CHUNK_HEADER;
+    if (mubrk(end) != end)
+        return 0;
+
+    /* The old sentinel heads the new chunk */
+    chunk_t *chunk = (chunk_t *) heap_top;
+    chunk->size = size;
+    chunk_t *sentinel = chunk_next(chunk);
+    sentinel->size = CHUNK_USED;
+    __atomic_store_n(&heap_top, (char *) sentinel, __ATOMIC_RELAXED);
+    heap_release(chunk, 0);
+    return 1;
+}
+
+static chunk_t *heap_find(uint64_t size)
+{
+    uint32_t bin = heap_bin(size);
+    for (chunk_t *chunk = bins[bin]; chunk; chunk = chunk->next) {
+        if (chunk->size >= size)
+            return chunk;
     }
 
-    /* No chunk found, ask Linux for more memory */
-    if (!cursor->next) {
-        /* We have been called for the first time and don't know the heap limit
-         * yet. On Linux, the brk syscall will return the previous heap limit on
-         * error. We try to set the heap limit at 0, which is obviously wrong,
-         * so that we could figure out what the current heap limit is.
-         */
-        if (!heap_limit)
-            heap_limit = mubrk(0);
-
-        /* We will allocate at least one page at a time */
-        size_t chunk_size = (size + sizeof(memchunk_t) - 1) / EXEC_PAGESIZE;
-        chunk_size *= EXEC_PAGESIZE;
-        chunk_size += EXEC_PAGESIZE;
-
-        void *new_heap_limit = mubrk((char *) heap_limit + chunk_size);
-        uint64_t new_chunk_size = (char *) new_heap_limit - (char *) heap_limit;
-
-        if (heap_limit == new_heap_limit) {
-            futex_unlock(&memory_lock);
+    uint32_t bigger = bin + 1 < NBINS ? bins_used & (~0U << (bin + 1)) : 0;
+    if (!bigger)
+        return 0;
+    return bins[__builtin_ctz(bigger)];
+}
+
+static void *heap_alloc(size_t size)
+{
+    uint64_t need = (size + CHUNK_HEADER + 15) & ~15ULL;
+
+    futex_lock(&heap_lock);
+    chunk_t *chunk = heap_find(need);
+    if (!chunk) {
+        if (!heap_grow(need)) {
+            futex_unlock(&heap_lock);
             return 0;
         }
+        chunk = heap_find(need);
+    }
+    bin_remove(chunk);
+
+    if (chunk->size - need >= HEAP_MIN_CHUNK) {
+        chunk_t *rest = (chunk_t *) ((char *) chunk + need);
+        rest->size = chunk->size - need;
+        rest->prev_size = need;
+        chunk_next(rest)->prev_size = rest->size;
+        bin_insert(rest);
+        chunk->size = need;
+    }
+
+    chunk->size |= CHUNK_USED;
+    futex_unlock(&heap_lock);
+    return (char *) chunk + CHUNK_HEADER;
+}
+
+/* Is ptr in the heap? A pointer handed out by the heap is always below the
+ * sentinel, but the sentinel may have gone down and a span been mapped
+ * where it was since we looked: that is checked again under heap_lock.
+ */
+static inline int heap_may_own(void *ptr)
+{
+    char *base = __atomic_load_n(&heap_base, __ATOMIC_RELAXED);
+    return (char *) ptr >= base &&
+           (char *) ptr < __atomic_load_n(&heap_top, __ATOMIC_RELAXED);
+}
+
+/* Free ptr if it is in the heap */
+static int heap_free(void *ptr)
+{
+    if (!heap_may_own(ptr))
+        return 0;
 
-        cursor->next = heap_limit;
-        chunk = cursor->next;
-        chunk->size = new_chunk_size - sizeof(memchunk_t);
-        chunk->next = 0;
-        heap_limit = new_heap_limit;
+    futex_lock(&heap_lock);
+    if ((char *) ptr >= heap_top) {
+        futex_unlock(&heap_lock);
+        return 0;
+    }
+    heap_release((chunk_t *) ((char *) ptr - CHUNK_HEADER), 1);
+    futex_unlock(&heap_lock);
+    return 1;
+}
+
+/* Usable size of ptr if it is in the heap, 0 otherwise */
+static size_t heap_usable(void *ptr)
+{
+    if (!heap_may_own(ptr))
+        return 0;
+
+    futex_lock(&heap_lock);
+    size_t size = 0;
+    if ((char *) ptr < heap_top) {
+        chunk_t *chunk = (chunk_t *) ((char *) ptr - CHUNK_HEADER);
+        size = chunk_size(chunk) - CHUNK_HEADER;
+    }
+    futex_unlock(&heap_lock);
+    return size;
+}
+
+/* Usable size of an allocation */
+static inline size_t alloc_size(void *ptr)
+{
+    size_t size = heap_usable(ptr);
+    if (size)
+        return size;
+
+    span_t *span = header_of(ptr);
+    if (span->class == LARGE_CLASS)
+        return span->size - ((char *) ptr - (char *) span);
+    return span->size;
+}
+
+/* Take an object of class out of its spans, memory_lock held */
+static void *span_pop(uint32_t class)
+{
+    span_t *span = partial[class];
+    if (!span) {
+        span = span_alloc(class);
+        if (!span)
+            return 0;
     }
 
-    /* Split the chunk if it's big enough to contain one more header and at
-     * least 16 more bytes
-     */
-    if (chunk->size > alloc_size + sizeof(memchunk_t) + 16) {
-        memchunk_t *new_chunk =
-            (memchunk_t *) ((char *) chunk + sizeof(memchunk_t) + alloc_size);
-        new_chunk->size = chunk->size - alloc_size - sizeof(memchunk_t);
-        new_chunk->next = chunk->next;
-        chunk->next = new_chunk;
-        chunk->size = alloc_size;
+    void *ptr = span->free;
+    if (ptr)
+        span->free = *(void **) ptr;
+    else {
+        ptr = span->bump;
+        span->bump += span->size;
     }
+    ++span->used;
 
-    /* Mark the chunk as used and return the memory */
-    chunk->size |= MEMCHUNK_USED;
+    /* Full, no point in finding it again until something is freed */
+    if (!span->free && span->bump + span->size > (char *) span + SPAN_SIZE)
+        list_remove(&partial[class], span);
+    return ptr;
+}
+
+/* Give a small object back to its span, memory_lock held */
+static void span_push(void *ptr)
+{
+    span_t *span = span_of(ptr);
+    int full =
+        !span->free && span->bump + span->size > (char *) span + SPAN_SIZE;
+    *(void **) ptr = span->free;
+    span->free = ptr;
+    --span->used;
+
+    if (full)
+        list_push(&partial[span->class], span);
+    if (!span->used)
+        span_release(span);
+}
+
+/* Thread caches
+ *
+ * Every muthread keeps a list of free objects per size class in its
+ * descriptor, malloc and free use it without taking memory_lock. An empty
+ * list is refilled and a list grown past twice the batch is trimmed, a
+ * batch of objects at a time under a single lock. The main thread is not a
+ * muthread (%fs points to the libc thread block), the magic tells them
+ * apart.
+ */
+#define CACHE_BYTES 16384 /* Batch size in bytes, 2 to 32 objects */
+
+static inline mucache_t *thread_cache(uint32_t class)
+{
+    muthread_t self = muthread_self();
+    if (self->magic != MUTHREAD_MAGIC)
+        return 0;
+    return &self->cache[class];
+}
+
+static inline uint32_t cache_batch(uint32_t class)
+{
+    uint64_t batch = CACHE_BYTES / class_to_size(class);
+    return batch < 2 ? 2 : batch > 32 ? 32 : batch;
+}
+
+static void *cache_refill(mucache_t *cache, uint32_t class)
+{
+    uint32_t batch = cache_batch(class);
+
+    futex_lock(&memory_lock);
+    void *ptr = span_pop(class);
+    for (uint32_t i = 1; ptr && i < batch; ++i) {
+        void *obj = span_pop(class);
+        if (!obj)
+            break;
+        *(void **) obj = cache->head;
+        cache->head = obj;
+        ++cache->count;
+    }
+    futex_unlock(&memory_lock);
+    return ptr;
+}
+
+static void cache_trim(mucache_t *cache, uint32_t keep)
+{
+    futex_lock(&memory_lock);
+    while (cache->count > keep) {
+        void *obj = cache->head;
+        cache->head = *(void **) obj;
+        --cache->count;
+        span_push(obj);
+    }
+    futex_unlock(&memory_lock);
+}
+
+/* Flush the cache of an exiting thread, it must not be used anymore */
+void mucache_release(muthread_t thread)
+{
+    thread->magic = 0;
+    for (uint32_t class = 0; class < NCLASSES; ++class)
+        cache_trim(&thread->cache[class], 0);
+}
+
+static void *alloc_small(uint32_t class)
+{
+    mucache_t *cache = thread_cache(class);
+    if (cache) {
+        void *ptr = cache->head;
+        if (!ptr)
+            return cache_refill(cache, class);
+        cache->head = *(void **) ptr;
+        --cache->count;
+        return ptr;
+    }
+
+    futex_lock(&memory_lock);
+    void *ptr = span_pop(class);
     futex_unlock(&memory_lock);
-    return (char *) chunk + sizeof(memchunk_t);
+    return ptr;
+}
+
+static void *alloc(size_t size)
+{
+    if (size > SMALL_MAX) {
+        void *ptr = size <= HEAP_MAX ? heap_alloc(size) : 0;
+        return ptr ? ptr : large_alloc(size, 0);
+    }
+    return alloc_small(size_to_class(size));
+}
+
+/* Every allocation is 16 byte aligned. Objects of a class are aligned to
+ * the largest power of 2 dividing both their size and the span header, up
+ * to 64 bytes; larger alignments get a mapping.
+ */
+static void *alloc_aligned(size_t align, size_t size)
+{
+    if (align <= 16)
+        return alloc(size);
+
+    if (align <= sizeof(span_t) && size <= SMALL_MAX) {
+        for (uint32_t class = size_to_class(size); class < NCLASSES;
+             ++class) {
+            if (!(class_to_size(class) & (align - 1)))
+                return alloc_small(class);
+        }
+    }
+    return large_alloc(size, align);
+}
+
+/* Malloc */
+void *malloc(size_t size)
+{
+    return alloc(size);
 }
 
 /* Free */
 void free(void *ptr)
 {
-    if (!ptr)
+    if (!ptr || heap_free(ptr))
         return;
 
+    span_t *span = header_of(ptr);
+    if (span->class == LARGE_CLASS) {
+        mumunmap(span, span->size);
+        return;
+    }
+
+    mucache_t *cache = thread_cache(span->class);
+    if (cache) {
+        *(void **) ptr = cache->head;
+        cache->head = ptr;
+        if (++cache->count > 2 * cache_batch(span->class))
+            cache_trim(cache, cache_batch(span->class));
+        return;
+    }
+
     futex_lock(&memory_lock);
-    memchunk_t *chunk = (memchunk_t *) ((char *) ptr - sizeof(memchunk_t));
-    chunk->size &= ~MEMCHUNK_USED;
+    span_push(ptr);
     futex_unlock(&memory_lock);
-}
\ No newline at end of file
+}
+
+/* Calloc, our free must never see memory from libc's one */
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+        return 0;
+
+    /* Not malloc, GCC would turn malloc and memset back into calloc */
+    void *ptr = alloc(total);
+    /* Fresh mappings are zeroed already */
+    if (ptr && total <= HEAP_MAX)
+        memset(ptr, 0, total);
+    return ptr;
+}
+
+/* Realloc */
+void *realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return malloc(size);
+    if (!size) {
+        free(ptr);
+        return 0;
+    }
+
+    /* Still fits, and does not waste more than half of a large mapping */
+    size_t old_size = alloc_size(ptr);
+    if (size <= old_size && (old_size <= SMALL_MAX || size > old_size / 2))
+        return ptr;
+
+    void *new_ptr = malloc(size);
+    if (!new_ptr)
+        return 0;
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    free(ptr);
+    return new_ptr;
+}
+
+/* Aligned allocations, free must not get one from libc either */
+void *memalign(size_t align, size_t size)
+{
+    if (!align || (align & (align - 1)))
+        return 0;
+    return alloc_aligned(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    if (align < sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+    void *ptr = alloc_aligned(align, size);
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    return alloc_aligned(EXEC_PAGESIZE, size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t pages = (size + EXEC_PAGESIZE - 1) & ~((size_t) EXEC_PAGESIZE - 1);
+    return alloc_aligned(EXEC_PAGESIZE, pages < size ? (size_t) -1 : pages);
+}
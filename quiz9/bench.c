@@ -0,0 +1,225 @@
+/* Scalability and latency benchmark of lf_timer
+ *
+ * Setter threads concurrently set, reset and cancel their own timers (and
+ * occasionally free and allocate them again) with timeouts up to MAX_DELAY
+ * in the future, while expirer threads drive the tick from CLOCK_MONOTONIC
+ * and expire timers. Reports the rate of operations, the CAS retries on the
+ * earliest expiration and on the freelist (build with -DLF_TIMER_STATS) and
+ * the distribution of lateness: callback time minus requested expiration.
+ *
+ * Usage: bench [setters [expirers [seconds [timers per setter]]]]
+ */
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lf_timer.h"
+
+#define MAX_DELAY 1000000 /* ns */
+#define BUCKETS 64        /* Lateness histogram, power of 2 buckets */
+#define MAX_THREADS 1024  /* Setters, and expirers */
+#define MAX_SECONDS 3600
+#define MAX_TIMERS (1U << 22) /* Per setter, as many as a pool holds */
+
+static uint32_t ntimers = 1000;
+static volatile int stop;
+
+/* Lateness histogram, merged from the expirer threads when they exit */
+static __thread uint64_t lateness[BUCKETS];
+static uint64_t histogram[BUCKETS];
+
+static uint64_t ops, expired;
+
+static inline uint32_t bucket_of(uint64_t ns)
+{
+    return ns ? 64 - __builtin_clzll(ns) : 0;
+}
+
+static void callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    (void) tim;
+    (void) arg;
+    lf_tick_t now = lf_timer_clock_now();
+    lateness[bucket_of(now > tmo ? now - tmo : 0)]++;
+}
+
+static void *setter(void *arg)
+{
+    unsigned int seed = (unsigned int) (uintptr_t) arg;
+    lf_timer_t *tims = malloc(ntimers * sizeof(lf_timer_t));
+    if (tims == NULL)
+        abort();
+    for (uint32_t i = 0; i < ntimers; i++) {
+        tims[i] = lf_timer_alloc(callback, NULL);
+        if (tims[i] == LF_TIMER_NULL)
+            abort();
+    }
+
+    uint64_t n = 0;
+    while (!stop) {
+        uint32_t i = rand_r(&seed) % ntimers;
+        lf_tick_t tmo = lf_timer_clock_now() + rand_r(&seed) % MAX_DELAY;
+        switch (rand_r(&seed) % 8) {
+        case 0:
+            lf_timer_cancel(tims[i]);
+            break;
+        case 1:
+            lf_timer_cancel(tims[i]);
+            lf_timer_free(tims[i]);
+            tims[i] = lf_timer_alloc(callback, NULL);
+            if (tims[i] == LF_TIMER_NULL)
+                abort();
+            n += 2;
+            break;
+        case 2:
+        case 3:
+            lf_timer_reset(tims[i], tmo);
+            break;
+        default:
+            if (!lf_timer_set(tims[i], tmo))
+                lf_timer_reset(tims[i], tmo);
+            break;
+        }
+        n++;
+    }
+
+    for (uint32_t i = 0; i < ntimers; i++) {
+        lf_timer_cancel(tims[i]);
+        lf_timer_free(tims[i]);
+    }
+    free(tims);
+    __atomic_fetch_add(&ops, n, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void *expirer(void *arg)
+{
+    (void) arg;
+    while (!stop) {
+        lf_timer_tick_set(lf_timer_clock_now());
+        lf_timer_expire_parallel();
+    }
+
+    uint64_t n = 0;
+    for (uint32_t b = 0; b < BUCKETS; b++) {
+        __atomic_fetch_add(&histogram[b], lateness[b], __ATOMIC_RELAXED);
+        n += lateness[b];
+    }
+    __atomic_fetch_add(&expired, n, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static uint64_t percentile(uint64_t total, double p)
+{
+    uint64_t sum = 0;
+    for (uint32_t b = 0; b < BUCKETS; b++) {
+        sum += histogram[b];
+        if (sum >= total * p)
+            return UINT64_C(1) << b;
+    }
+    return 0;
+}
+
+/* A count from the command line, 0 unless it is a number from 1 to max */
+static uint32_t parse_count(const char *arg, uint32_t max)
+{
+    /* strtoul would negate a negative number */
+    if (arg[0] < '0' || arg[0] > '9')
+        return 0;
+    char *end;
+    unsigned long count = strtoul(arg, &end, 10);
+    if (*end != '\0' || count > max)
+        return 0;
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t nsetters = argc > 1 ? parse_count(argv[1], MAX_THREADS) : 4;
+    uint32_t nexpirers = argc > 2 ? parse_count(argv[2], MAX_THREADS) : 1;
+    uint32_t seconds = argc > 3 ? parse_count(argv[3], MAX_SECONDS) : 2;
+    if (argc > 4)
+        ntimers = parse_count(argv[4], MAX_TIMERS);
+    if (nsetters == 0 || nexpirers == 0 || seconds == 0 || ntimers == 0) {
+        fprintf(stderr,
+                "usage: %s [setters [expirers [seconds [timers per "
+                "setter]]]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    pthread_t *threads = malloc((nsetters + nexpirers) * sizeof(pthread_t));
+    if (threads == NULL)
+        return 1;
+    lf_timer_stats_t before, after;
+    lf_timer_stats_get(&before);
+    /* Only the threads created are joined, whatever failed */
+    uint32_t created = 0;
+    int err = 0;
+    for (; created < nsetters + nexpirers; created++) {
+        uint32_t i = created;
+        if (i < nexpirers)
+            err = pthread_create(&threads[i], NULL, expirer, NULL);
+        else
+            err = pthread_create(&threads[i], NULL, setter,
+                                 (void *) (uintptr_t) (i - nexpirers + 1));
+        if (err != 0)
+            break;
+    }
+
+    if (err == 0) {
+        struct timespec ts = {.tv_sec = seconds};
+        nanosleep(&ts, NULL);
+    }
+    stop = 1;
+    for (uint32_t i = 0; i < created; i++)
+        pthread_join(threads[i], NULL);
+    lf_timer_stats_get(&after);
+    free(threads);
+    if (err != 0) {
+        fprintf(stderr, "cannot create thread %u of %u: %s\n", created + 1,
+                nsetters + nexpirers, strerror(err));
+        return 1;
+    }
+
+    uint64_t earliest = after.earliest_retries - before.earliest_retries;
+    uint64_t freelist = after.freelist_retries - before.freelist_retries;
+    printf("%u setters, %u expirers, %u timers per setter, %us\n", nsetters,
+           nexpirers, ntimers, seconds);
+    printf("operations:        %12.0f/s\n", (double) ops / seconds);
+    printf("expirations:       %12.0f/s\n", (double) expired / seconds);
+#ifdef LF_TIMER_STATS
+    printf("earliest retries:  %12" PRIu64 " (%.4f per op)\n", earliest,
+           ops ? (double) earliest / ops : 0.0);
+    printf("freelist retries:  %12" PRIu64 " (%.4f per op)\n", freelist,
+           ops ? (double) freelist / ops : 0.0);
+#else
+    (void) earliest;
+    (void) freelist;
+    printf("CAS retries:       not counted, build with -DLF_TIMER_STATS\n");
+#endif
+
+    if (expired == 0)
+        return 0;
+    uint32_t max_lateness = 0;
+    for (uint32_t b = 0; b < BUCKETS; b++) {
+        if (histogram[b] != 0)
+            max_lateness = b;
+    }
+    printf("lateness p50 < %" PRIu64 "ns, p99 < %" PRIu64 "ns, p99.9 < %" PRIu64
+           "ns, max < %" PRIu64 "ns\n",
+           percentile(expired, 0.5), percentile(expired, 0.99),
+           percentile(expired, 0.999), UINT64_C(1) << max_lateness);
+    printf("%12s %12s %8s\n", "lateness <", "count", "percent");
+    for (uint32_t b = 0; b < BUCKETS; b++) {
+        if (histogram[b] == 0)
+            continue;
+        printf("%10" PRIu64 "ns %12" PRIu64 " %7.3f%%\n",
+               UINT64_C(1) << b, histogram[b],
+               100.0 * histogram[b] / expired);
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* Microbenchmark of the expiration scan in lf_timer_group_expire()
+ *
+ * Every round one timer is due and the other active ones expire far in the
+ * future, so each lf_timer_group_expire() call scans all active timers.
+ * With every timer active the scan is dense and goes through the vectorized
+ * scan; with 1% active, the active timer bitmap skips idle regions.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lf_timer.h"
+
+#define FAR_AWAY (UINT64_C(1) << 62)
+#define SCANNED_TICKS (UINT64_C(1) << 27) /* Per implementation and size */
+
+static const struct {
+    lf_timer_scan_t impl;
+    const char *name;
+} impls[] = {
+    {LF_TIMER_SCAN_SCALAR, "scalar"},
+    {LF_TIMER_SCAN_SSE, "sse4.2"},
+    {LF_TIMER_SCAN_AVX2, "avx2"},
+    {LF_TIMER_SCAN_AVX512, "avx512"},
+};
+
+static const uint32_t sizes[] = {8192, 65536, 262144, 1048576};
+static const uint32_t percent_active[] = {100, 1};
+
+static void callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    (void) tim;
+    (void) tmo;
+    (*(uint64_t *) arg)++;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static int bench(uint32_t ntimers, uint32_t percent)
+{
+    uint32_t stride = 100 / percent;
+    lf_timer_group_t *grp = lf_timer_group_create();
+    lf_timer_t *tims = malloc(ntimers * sizeof(lf_timer_t));
+    uint64_t expired = 0;
+    if (!grp || !tims) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    /* tims[0] is the one due each round */
+    for (uint32_t i = 0; i < ntimers; i++) {
+        tims[i] = lf_timer_group_alloc(grp, callback, &expired);
+        if (tims[i] == LF_TIMER_NULL) {
+            fprintf(stderr, "cannot allocate %u timers\n", ntimers);
+            return 1;
+        }
+        if (i != 0 && i % stride == 0)
+            lf_timer_group_set(grp, tims[i], FAR_AWAY + i);
+    }
+
+    uint32_t rounds = SCANNED_TICKS / ntimers;
+    lf_tick_t tick = lf_timer_group_tick_get(grp);
+    for (size_t j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+        if (!lf_timer_scan_select(impls[j].impl))
+            continue;
+
+        expired = 0;
+        uint64_t start = now_ns();
+        for (uint32_t r = 0; r < rounds; r++) {
+            lf_timer_group_set(grp, tims[0], ++tick);
+            lf_timer_group_tick_set(grp, tick);
+            lf_timer_group_expire(grp);
+        }
+        uint64_t elapsed = now_ns() - start;
+        if (expired != rounds) {
+            fprintf(stderr, "%s: expired %" PRIu64 " of %u timers\n",
+                    impls[j].name, expired, rounds);
+            return 1;
+        }
+        printf("%-8s %10u %7u%% %12.0f %10.3f\n", impls[j].name, ntimers,
+               percent, (double) elapsed / rounds,
+               (double) elapsed / rounds / ntimers);
+    }
+
+    for (uint32_t i = 0; i < ntimers; i++) {
+        lf_timer_group_cancel(grp, tims[i]);
+        lf_timer_group_free(grp, tims[i]);
+    }
+    free(tims);
+    lf_timer_group_destroy(grp);
+    return 0;
+}
+
+int main(void)
+{
+    printf("%-8s %10s %8s %12s %10s\n", "scan", "timers", "active",
+           "ns/expire", "ns/timer");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t p = 0; p < sizeof(percent_active) / sizeof(uint32_t); p++) {
+            if (bench(sizes[s], percent_active[p]))
+                return 1;
+        }
+    }
+    return 0;
+}
@@ -3,6 +3,7 @@
 /* Compiler hints */
 #define ALWAYS_INLINE __attribute__((always_inline))
 #define INIT_FUNCTION __attribute__((constructor))
+#define LIKELY(x) __builtin_expect(!!(x), 1)
 #define UNLIKELY(x) __builtin_expect(!!(x), 0)
 
 /* Hardware hints */
@@ -18,6 +19,13 @@
         tmp_a < tmp_b ? tmp_a : tmp_b; \
     })
 
+#define MAX(a, b)                      \
+    ({                                 \
+        __typeof__(a) tmp_a = (a);     \
+        __typeof__(b) tmp_b = (b);     \
+        tmp_a > tmp_b ? tmp_a : tmp_b; \
+    })
+
 #if __SIZEOF_POINTER__ == 4
 typedef unsigned long long ptrpair_t; /* assume 64 bits */
 #else                                 /* __SIZEOF_POINTER__ == 8 */
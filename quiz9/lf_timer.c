@@ -1,13 +1,51 @@
+#include <immintrin.h>
 #include <inttypes.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lf_timer.h"
 
 #define CACHE_LINE 64
-#define MAXTIMERS 8192
+
+/* Timers are allocated in segments of SEG_SIZE timers. Segments are appended
+ * on demand to a fixed directory, so the pool grows up to MAXTIMERS without
+ * paying for unused timers up front.
+ */
+#define SEG_SHIFT 10
+#define SEG_SIZE (1U << SEG_SHIFT)
+#define SEG_MASK (SEG_SIZE - 1)
+#define MAXSEGS 4096
+#define MAXTIMERS (MAXSEGS * SEG_SIZE)
+
+/* Active timers are indexed by a two-level bitmap: one bit per timer in the
+ * segments and one summary bit per bitmap word in the group
+ */
+#define WORD_SHIFT 6
+#define WORD_BITS (1U << WORD_SHIFT)
+#define SEG_WORDS (SEG_SIZE / WORD_BITS)
+#define SUMMARY_WORDS (MAXTIMERS / WORD_BITS / WORD_BITS)
+
+/* Bitmap words with at least this many active timers are scanned as a whole
+ * with scan_impl instead of bit by bit
+ */
+#define DENSE_WORD 8
+
+/* Each thread caches up to MAG_SIZE free timers per group in a magazine,
+ * moved from and to the freelist MAG_BATCH at a time. Threads get one of
+ * MAG_THREADS magazine slots, released when they exit.
+ */
+#define MAG_SIZE 32
+#define MAG_BATCH (MAG_SIZE / 2)
+#define MAG_THREADS 256
 
 /* Parameters for smp_fence() */
 enum {
@@ -32,9 +70,21 @@ static inline void smp_fence(unsigned int mask)
 #include "common.h"
 #include "lockfree.h"
 
+#ifdef LF_TIMER_STATS
+/* CAS retries, shared by all groups */
+static uint64_t stat_earliest_retries ALIGNED(CACHE_LINE);
+static uint64_t stat_freelist_retries ALIGNED(CACHE_LINE);
+#define STAT_INC(name) __atomic_fetch_add(&stat_##name, 1, __ATOMIC_RELAXED)
+#else
+#define STAT_INC(name) ((void) 0)
+#endif
+
 struct timer {
-    lf_timer_cb cb; /* User-defined callback */
-    void *arg;      /* User-defined argument to callback */
+    lf_timer_cb cb;   /* User-defined callback */
+    void *arg;        /* User-defined argument to callback */
+    lf_tick_t period; /* Re-armed by expiry if non-zero */
+    uint32_t idx;     /* Index of this timer in the pool */
+    uint32_t arming;  /* Claimed by a set writing the period */
 };
 
 struct freelist {
@@ -42,42 +92,424 @@ struct freelist {
     uintptr_t count; /* For ABA protection */
 };
 
-static struct {
+struct magazine {
+    uint32_t count;
+    struct timer *timers[MAG_SIZE];
+};
+
+struct segment {
+    lf_tick_t expirations[SEG_SIZE] ALIGNED(CACHE_LINE);
+    struct timer timers[SEG_SIZE] ALIGNED(CACHE_LINE);
+    /* Set bits for timers that may be active. A bit may stay set for an
+     * inactive timer until the next scan, but is never clear for an active
+     * timer that lf_timer_set() has returned for.
+     */
+    uint64_t active[SEG_WORDS] ALIGNED(CACHE_LINE);
+};
+
+struct lf_timer_group {
+    /* Updated by lf_timer_set() and every expiry scan, keep it apart */
     lf_tick_t earliest ALIGNED(CACHE_LINE);
-    lf_tick_t current;
+    lf_tick_t current ALIGNED(CACHE_LINE);
     uint32_t hi_watermark;
+    uint32_t nsegs; /* Number of segments appended to segs[] */
 
-    /* +4 for sentinels */
-    lf_tick_t expirations[MAXTIMERS + 4] ALIGNED(CACHE_LINE);
-    struct timer timers[MAXTIMERS] ALIGNED(CACHE_LINE);
-    struct freelist freelist;
-} g_timer;
+    /* Cooperative scan by lf_timer_expire_parallel(): number of segments
+     * to scan in the upper half, next segment to claim in the lower half
+     */
+    uint64_t scan_work ALIGNED(CACHE_LINE);
+
+    struct freelist freelist ALIGNED(CACHE_LINE);
+    struct segment *segs[MAXSEGS] ALIGNED(CACHE_LINE);
+
+    /* Free timers cached by each thread slot, only used by its owner */
+    struct magazine mags[MAG_THREADS] ALIGNED(CACHE_LINE);
+
+    /* One bit per segment bitmap word that may be non-zero, only cleared by
+     * the expiry scan
+     */
+    uint64_t summary[SUMMARY_WORDS] ALIGNED(CACHE_LINE);
+
+    /* Deferred dispatch of callbacks, NULL when invoked by the scan */
+    struct dispatch *dispatch;
+
+    /* Clock driver: the tick it sleeps until (0 when awake) and a futex
+     * word bumped to wake it up before that
+     */
+    lf_tick_t driver_deadline ALIGNED(CACHE_LINE);
+    uint32_t driver_wake;
+    bool driver_stop;
+    bool driver_running;
+    pthread_t driver;
+};
+
+/* Default group used by the lf_timer_xxx() API */
+static struct lf_timer_group g_timer;
+
+static void init_group(struct lf_timer_group *grp)
+{
+    grp->earliest = LF_TIMER_TICK_INVALID;
+    grp->current = 0;
+    grp->hi_watermark = 0;
+    grp->nsegs = 0;
+    grp->scan_work = 0;
+    grp->dispatch = NULL;
+    grp->driver_deadline = 0;
+    grp->driver_wake = 0;
+    grp->driver_stop = false;
+    grp->driver_running = false;
+
+    /* Segments are allocated by the first lf_timer_alloc() */
+    grp->freelist.head = NULL;
+    grp->freelist.count = 0;
+    for (uint32_t i = 0; i < MAXSEGS; i++)
+        grp->segs[i] = NULL;
+    for (uint32_t i = 0; i < SUMMARY_WORDS; i++)
+        grp->summary[i] = 0;
+    for (uint32_t i = 0; i < MAG_THREADS; i++)
+        grp->mags[i].count = 0;
+}
+
+/* Magazine slot of this thread: 0 if not yet claimed, MAG_THREADS + 1 if
+ * none was available
+ */
+static __thread uint32_t thread_slot;
+static uint64_t slots_used[MAG_THREADS / 64];
+static pthread_key_t slot_key;
+
+static void release_slot(void *value)
+{
+    uint32_t slot = (uint32_t) (uintptr_t) value - 1;
+    /* The magazines of the slot are handed over to its next owner */
+    __atomic_fetch_and(&slots_used[slot / 64], ~(UINT64_C(1) << (slot % 64)),
+                       __ATOMIC_RELEASE);
+    thread_slot = MAG_THREADS + 1;
+}
+
+static uint32_t claim_slot(void)
+{
+    for (uint32_t i = 0; i < MAG_THREADS / 64; i++) {
+        uint64_t used = __atomic_load_n(&slots_used[i], __ATOMIC_RELAXED);
+        while (~used != 0) {
+            uint32_t bit = __builtin_ctzll(~used);
+            /* Failure reloads 'used' */
+            if (__atomic_compare_exchange_n(&slots_used[i], &used,
+                                            used | (UINT64_C(1) << bit),
+                                            /*weak=*/true, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                uint32_t slot = i * 64 + bit + 1;
+                pthread_setspecific(slot_key, (void *) (uintptr_t) slot);
+                return thread_slot = slot;
+            }
+        }
+    }
+    return thread_slot = MAG_THREADS + 1;
+}
+
+static inline struct magazine *magazine_of(struct lf_timer_group *grp)
+{
+    uint32_t slot = thread_slot;
+    if (UNLIKELY(slot == 0))
+        slot = claim_slot();
+    return LIKELY(slot <= MAG_THREADS) ? &grp->mags[slot - 1] : NULL;
+}
 
 INIT_FUNCTION
 static void init_timers(void)
 {
-    g_timer.earliest = LF_TIMER_TICK_INVALID;
-    g_timer.current = 0;
-    g_timer.hi_watermark = 0;
-    for (uint32_t i = 0; i < MAXTIMERS; i++) {
-        /* All timers beyond hi_watermark <= now */
-        g_timer.expirations[i] = 0;
-        g_timer.timers[i].cb = NULL;
-        g_timer.timers[i].arg = &g_timer.timers[i + 1];
+    init_group(&g_timer);
+    lf_timer_scan_select(LF_TIMER_SCAN_AUTO);
+    if (pthread_key_create(&slot_key, release_slot) != 0) {
+        /* Threads cannot give their slot back, do not use magazines */
+        thread_slot = MAG_THREADS + 1;
+        slots_used[0] = ~UINT64_C(0);
+        for (uint32_t i = 1; i < MAG_THREADS / 64; i++)
+            slots_used[i] = ~UINT64_C(0);
     }
+}
 
-    /* Ensure sentinels trigger expiration compare and loop termination */
-    g_timer.expirations[MAXTIMERS + 0] = 0;
-    g_timer.expirations[MAXTIMERS + 1] = 0;
-    g_timer.expirations[MAXTIMERS + 2] = 0;
-    g_timer.expirations[MAXTIMERS + 3] = 0;
+static inline struct segment *segment_of(struct lf_timer_group *grp,
+                                         uint32_t idx)
+{
+    return __atomic_load_n(&grp->segs[idx >> SEG_SHIFT], __ATOMIC_ACQUIRE);
+}
 
-    /* Last timer must end freelist */
-    g_timer.timers[MAXTIMERS - 1].arg = NULL;
+static inline lf_tick_t *expiration_of(struct lf_timer_group *grp,
+                                       uint32_t idx)
+{
+    return &segment_of(grp, idx)->expirations[idx & SEG_MASK];
+}
+
+static inline struct timer *timer_of(struct lf_timer_group *grp,
+                                     uint32_t idx)
+{
+    return &segment_of(grp, idx)->timers[idx & SEG_MASK];
+}
+
+/* Only timers of segments already handed over to the freelist are valid */
+static inline bool valid_timer(struct lf_timer_group *grp, lf_timer_t idx)
+{
+    uint32_t nsegs = __atomic_load_n(&grp->nsegs, __ATOMIC_ACQUIRE);
+    return (uint32_t) idx < (nsegs << SEG_SHIFT);
+}
+
+/* Flag a timer as active in both bitmap levels. The bitmaps are cleared
+ * concurrently by the scan, so loads and updates are sequentially consistent
+ * with the update of the expiration tick.
+ */
+static inline void mark_active(struct lf_timer_group *grp,
+                               struct segment *seg,
+                               uint32_t idx)
+{
+    uint64_t *word = &seg->active[(idx & SEG_MASK) >> WORD_SHIFT];
+    uint64_t bit = UINT64_C(1) << (idx & (WORD_BITS - 1));
+    if (!(__atomic_load_n(word, __ATOMIC_SEQ_CST) & bit))
+        __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
 
-    /* Initialize head of freelist */
-    g_timer.freelist.head = g_timer.timers;
-    g_timer.freelist.count = 0;
+    uint32_t w = idx >> WORD_SHIFT;
+    uint64_t *sum = &grp->summary[w >> WORD_SHIFT];
+    uint64_t sbit = UINT64_C(1) << (w & (WORD_BITS - 1));
+    if (!(__atomic_load_n(sum, __ATOMIC_SEQ_CST) & sbit))
+        __atomic_fetch_or(sum, sbit, __ATOMIC_SEQ_CST);
+}
+
+/* Clear the active bit of a timer that was found inactive. A racing
+ * lf_timer_set() may activate it again meanwhile, then the bit is restored.
+ * @return the expiration tick after clearing, which the caller must account
+ *         for in 'earliest' unless LF_TIMER_TICK_INVALID
+ */
+static inline lf_tick_t clear_active(struct lf_timer_group *grp,
+                                     struct segment *seg,
+                                     uint32_t idx)
+{
+    uint64_t *word = &seg->active[(idx & SEG_MASK) >> WORD_SHIFT];
+    uint64_t bit = UINT64_C(1) << (idx & (WORD_BITS - 1));
+    __atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST);
+
+    lf_tick_t exp =
+        __atomic_load_n(&seg->expirations[idx & SEG_MASK], __ATOMIC_SEQ_CST);
+    if (UNLIKELY(exp != LF_TIMER_TICK_INVALID))
+        mark_active(grp, seg, idx);
+    return exp;
+}
+
+/* Push a chain of timers linked through 'arg' onto the freelist */
+static void freelist_push(struct lf_timer_group *grp,
+                          struct timer *first,
+                          struct timer *last)
+{
+    union {
+        struct freelist fl;
+        ptrpair_t pp;
+    } old, neu;
+
+    for (;;) {
+        old.fl = grp->freelist;
+        last->arg = old.fl.head;
+        neu.fl.head = first;
+        neu.fl.count = old.fl.count + 1;
+        if (LIKELY(lockfree_compare_exchange_pp(
+                (ptrpair_t *) &grp->freelist, &old.pp, neu.pp,
+                /*weak=*/true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)))
+            break;
+        STAT_INC(freelist_retries);
+    }
+}
+
+/* Append one more segment of timers to the pool and hand them over to the
+ * freelist. Racing threads compete for the same directory slot; losers just
+ * help publishing the segment count and retry the freelist.
+ * @return false if the pool cannot grow anymore
+ */
+static bool grow_timers(struct lf_timer_group *grp)
+{
+    uint32_t n = __atomic_load_n(&grp->nsegs, __ATOMIC_ACQUIRE);
+    if (UNLIKELY(n >= MAXSEGS))
+        return false;
+
+    if (__atomic_load_n(&grp->segs[n], __ATOMIC_ACQUIRE) != NULL) {
+        lockfree_fetch_umax_4(&grp->nsegs, n + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    struct segment *seg = aligned_alloc(CACHE_LINE, sizeof(struct segment));
+    if (UNLIKELY(seg == NULL))
+        return false;
+
+    for (uint32_t i = 0; i < SEG_SIZE; i++) {
+        /* Inactive timers never expire */
+        seg->expirations[i] = LF_TIMER_TICK_INVALID;
+        seg->timers[i].cb = NULL;
+        seg->timers[i].arg = &seg->timers[i + 1];
+        seg->timers[i].idx = (n << SEG_SHIFT) + i;
+        seg->timers[i].arming = 0;
+    }
+    for (uint32_t i = 0; i < SEG_WORDS; i++)
+        seg->active[i] = 0;
+
+    struct segment *expected = NULL;
+    if (!__atomic_compare_exchange_n(&grp->segs[n], &expected, seg,
+                                     /*weak=*/false, __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED)) {
+        /* Some other thread appended segment n first */
+        free(seg);
+        lockfree_fetch_umax_4(&grp->nsegs, n + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    lockfree_fetch_umax_4(&grp->nsegs, n + 1, __ATOMIC_RELEASE);
+
+    freelist_push(grp, &seg->timers[0], &seg->timers[SEG_SIZE - 1]);
+    return true;
+}
+
+static inline void futex_wake(uint32_t *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL,
+            0);
+}
+
+/* Wait while *addr == val, at most until the CLOCK_MONOTONIC time 'until' */
+static inline void futex_wait_until(uint32_t *addr,
+                                    uint32_t val,
+                                    lf_tick_t until)
+{
+    struct timespec ts = {
+        .tv_sec = until / 1000000000,
+        .tv_nsec = until % 1000000000,
+    };
+    syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val,
+            until == LF_TIMER_TICK_INVALID ? NULL : &ts, NULL,
+            FUTEX_BITSET_MATCH_ANY);
+}
+
+/* Deferred dispatch: expired timers are queued to a pool of dispatcher threads
+ * instead of having their callback invoked by the scan
+ */
+typedef struct dispatch_item {
+    lf_timer_cb cb;
+    void *arg;
+    lf_timer_t tim;
+    lf_tick_t tmo;
+    lf_tick_t expired; /* lf_timer_clock_now() when queued */
+} dispatch_item;
+
+#define QUEUE_MP 1
+#define QUEUE_MC 1
+#define QUEUE_TYPE dispatch_item
+#define QUEUE_IMPLEMENTATION
+#include "pronlem2/queues.h"
+
+struct dispatch_thread {
+    /* Latency statistics, only written by the thread itself */
+    uint64_t count ALIGNED(CACHE_LINE);
+    uint64_t total_ns;
+    uint64_t max_ns;
+    struct dispatch *dsp;
+    pthread_t thread;
+};
+
+struct dispatch {
+    Queue_Mpmc_dispatch_item *queue;
+    struct dispatch_thread *threads;
+    uint32_t nthreads;
+
+    /* Set by expiring threads when they queued a timer */
+    bool queued ALIGNED(CACHE_LINE);
+    uint64_t inline_count; /* Callbacks invoked by the scan, queue full */
+
+    /* Eventcount the dispatcher threads park on */
+    uint32_t seq ALIGNED(CACHE_LINE);
+    uint32_t waiters;
+    bool stop;
+};
+
+static bool dispatch_enqueue(struct dispatch *dsp,
+                             struct timer *tim,
+                             lf_tick_t exp)
+{
+    dispatch_item item = {
+        .cb = tim->cb,
+        .arg = tim->arg,
+        .tim = tim->idx,
+        .tmo = exp,
+        .expired = lf_timer_clock_now(),
+    };
+    if (UNLIKELY(mpmc_enqueue_dispatch_item(dsp->queue, &item) !=
+                 QueueResult_Ok)) {
+        __atomic_fetch_add(&dsp->inline_count, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    if (!__atomic_load_n(&dsp->queued, __ATOMIC_RELAXED))
+        __atomic_store_n(&dsp->queued, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* Wake up parked dispatcher threads once per scan that queued timers */
+static inline void dispatch_notify(struct lf_timer_group *grp)
+{
+    struct dispatch *dsp = __atomic_load_n(&grp->dispatch, __ATOMIC_ACQUIRE);
+    if (dsp == NULL || !__atomic_load_n(&dsp->queued, __ATOMIC_RELAXED) ||
+        !__atomic_exchange_n(&dsp->queued, false, __ATOMIC_RELAXED))
+        return;
+    /* Our enqueues must be visible before we check for waiters */
+    smp_fence(StoreLoad);
+    if (__atomic_load_n(&dsp->waiters, __ATOMIC_RELAXED) != 0) {
+        __atomic_fetch_add(&dsp->seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&dsp->seq, INT32_MAX);
+    }
+}
+
+static void dispatch_one(struct dispatch_thread *self, dispatch_item *item)
+{
+    lf_tick_t lat = lf_timer_clock_now() - item->expired;
+    item->cb(item->tim, item->tmo, item->arg);
+    __atomic_store_n(&self->count, self->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->total_ns, self->total_ns + lat, __ATOMIC_RELAXED);
+    if (lat > self->max_ns)
+        __atomic_store_n(&self->max_ns, lat, __ATOMIC_RELAXED);
+}
+
+static void *dispatch_main(void *arg)
+{
+    struct dispatch_thread *self = arg;
+    struct dispatch *dsp = self->dsp;
+    dispatch_item item;
+    for (;;) {
+        if (mpmc_dequeue_dispatch_item(dsp->queue, &item) == QueueResult_Ok) {
+            dispatch_one(self, &item);
+            continue;
+        }
+
+        /* Queue empty: register as waiter, then check again before parking */
+        __atomic_fetch_add(&dsp->waiters, 1, __ATOMIC_SEQ_CST);
+        smp_fence(StoreLoad);
+        uint32_t seq = __atomic_load_n(&dsp->seq, __ATOMIC_ACQUIRE);
+        bool stop = __atomic_load_n(&dsp->stop, __ATOMIC_ACQUIRE);
+        QueueResult_t res = mpmc_dequeue_dispatch_item(dsp->queue, &item);
+        if (res != QueueResult_Ok && !stop)
+            futex_wait_until(&dsp->seq, seq, LF_TIMER_TICK_INVALID);
+        __atomic_fetch_sub(&dsp->waiters, 1, __ATOMIC_RELAXED);
+
+        if (res == QueueResult_Ok)
+            dispatch_one(self, &item);
+        else if (stop) /* Queue drained */
+            break;
+    }
+    return NULL;
+}
+
+/* Next expiration of a periodic timer, skipping the periods missed */
+static inline lf_tick_t next_period(lf_tick_t exp,
+                                    lf_tick_t now,
+                                    lf_tick_t period)
+{
+    if (period == 0)
+        return LF_TIMER_TICK_INVALID;
+    lf_tick_t next = (now - exp) / period + 1;
+    if (__builtin_mul_overflow(next, period, &next) ||
+        __builtin_add_overflow(exp, next, &next))
+        return LF_TIMER_TICK_INVALID; /* Periods end with time */
+    return next;
 }
 
 /* There might be user-defined data associated with a timer
@@ -85,264 +517,1088 @@ static void init_timers(void)
  * Set (and reset) a timer has release semantics wrt this data
  * Expire a timer thus needs acquire semantics
  */
-static void expire_one_timer(lf_tick_t now, lf_tick_t *ptr)
+static lf_tick_t expire_one_timer(struct lf_timer_group *grp,
+                                  lf_tick_t now,
+                                  struct segment *seg,
+                                  lf_tick_t *ptr)
 {
-    lf_tick_t exp;
+    struct timer *tim = &seg->timers[ptr - &seg->expirations[0]];
+    lf_tick_t exp, next;
     do {
         /* Explicit reloading => smaller code */
-        exp = __atomic_load_n(ptr, __ATOMIC_RELAXED);
-        if (!(exp - now)) { /* exp > now */
+        exp = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+        if (exp > now) {
             /* If timer does not expire anymore it means some thread has
-             * (re-)set the timer and then also updated g_timer.earliest
+             * (re-)set the timer and then also updated the group's earliest
              */
-            return;
+            return exp;
         }
-    } while (!__atomic_compare_exchange_n(ptr, &exp, LF_TIMER_TICK_INVALID,
+        /* The period was written before the release that set the timer */
+        lf_tick_t period = __atomic_load_n(&tim->period, __ATOMIC_RELAXED);
+        next = next_period(exp, now, period);
+    } while (!__atomic_compare_exchange_n(ptr, &exp, next,
                                           /*weak=*/true, __ATOMIC_ACQUIRE,
                                           __ATOMIC_RELAXED));
-    uint32_t tim = ptr - &g_timer.expirations[0];
-    g_timer.timers[tim].cb(tim, exp, g_timer.timers[tim].arg);
+    /* A re-armed periodic timer stays active. Else clear the active bit
+     * before the callback gets a chance to set the timer again.
+     */
+    if (next == LF_TIMER_TICK_INVALID)
+        next = clear_active(grp, seg, tim->idx);
+    struct dispatch *dsp = __atomic_load_n(&grp->dispatch, __ATOMIC_ACQUIRE);
+    if (dsp == NULL || !dispatch_enqueue(dsp, tim, exp))
+        tim->cb(tim->idx, exp, tim->arg);
+    return next;
 }
 
-// ToDo: Can be improved
-static lf_tick_t scan_timers(lf_tick_t now, lf_tick_t *cur, lf_tick_t *top)
+static lf_tick_t scan_timers(struct lf_timer_group *grp,
+                             lf_tick_t now,
+                             struct segment *seg,
+                             lf_tick_t *ptr,
+                             lf_tick_t *top)
 {
     lf_tick_t earliest = LF_TIMER_TICK_INVALID;
-    lf_tick_t *ptr = cur;
-    lf_tick_t pair0 = *ptr++;
-    lf_tick_t pair1 = *ptr++;
 
     /* Optimize: Interleave loads and compares in order to hide load-to-use
-     * latencies. Sentinel will ensure we eventually terminate the loop
+     * latencies. Scanned ranges are whole bitmap words, i.e. even counts.
      */
-    for (;;) {
-        lf_tick_t w0 = pair0;
-        lf_tick_t w1 = pair1;
-        pair0 = *ptr++;
-        pair1 = *ptr++;
+    for (; ptr < top; ptr += 2) {
+        lf_tick_t w0 = ptr[0];
+        lf_tick_t w1 = ptr[1];
         if (UNLIKELY(w0 <= now)) {
-            lf_tick_t *pw0 = (lf_tick_t *) (ptr - 4);
-            if (pw0 >= top)
-                break;
-
-            expire_one_timer(now, pw0);
-            /* If timer did not actually expire, it was reset by some thread
-             * and g_timer.earliest updated which means we do not have to
-             * include it in our update of earliest.
+            /* A periodic timer comes back with its next tick. A timer that
+             * did not actually expire was reset by some thread, which also
+             * updated the group's earliest, taking its tick is harmless.
              */
+            lf_tick_t next = expire_one_timer(grp, now, seg, ptr);
+            earliest = MIN(earliest, next);
         } else { /* 'w0' > 'now' */
             earliest = MIN(earliest, w0);
         }
         if (UNLIKELY(w1 <= now)) {
-            lf_tick_t *pw1 = (lf_tick_t *) (ptr - 4) + 1;
-            if (pw1 >= top)
-                break;
-            expire_one_timer(now, pw1);
+            lf_tick_t next = expire_one_timer(grp, now, seg, ptr + 1);
+            earliest = MIN(earliest, next);
         } else { /* 'w1' > 'now' */
             earliest = MIN(earliest, w1);
         }
-        w0 = pair0;
-        w1 = pair1;
-        pair0 = *ptr++;
-        pair1 = *ptr++;
-        if (UNLIKELY(w0 <= now)) {
-            lf_tick_t *pw0 = (lf_tick_t *) (ptr - 4);
-            if (pw0 >= top)
-                break;
-            expire_one_timer(now, pw0);
-        } else { /* 'w0' > 'now' */
-            earliest = MIN(earliest, w0);
+    }
+    return earliest;
+}
+
+/* Scan the expiration ticks that are left over by a vectorized loop */
+static inline lf_tick_t scan_tail(struct lf_timer_group *grp,
+                                  lf_tick_t now,
+                                  struct segment *seg,
+                                  lf_tick_t *ptr,
+                                  lf_tick_t *top,
+                                  lf_tick_t earliest)
+{
+    for (; ptr < top; ptr++) {
+        lf_tick_t w = *ptr;
+        if (UNLIKELY(w <= now))
+            earliest = MIN(earliest, expire_one_timer(grp, now, seg, ptr));
+        else
+            earliest = MIN(earliest, w);
+    }
+    return earliest;
+}
+
+/* Expire the timers flagged in 'due', one bit per expiration tick, and fold
+ * the next ticks of the periodic ones into 'earliest'
+ */
+static inline lf_tick_t expire_mask(struct lf_timer_group *grp,
+                                    lf_tick_t now,
+                                    struct segment *seg,
+                                    lf_tick_t *ptr,
+                                    unsigned int due,
+                                    lf_tick_t earliest)
+{
+    while (due) {
+        lf_tick_t next =
+            expire_one_timer(grp, now, seg, ptr + __builtin_ctz(due));
+        earliest = MIN(earliest, next);
+        due &= due - 1;
+    }
+    return earliest;
+}
+
+/* The vectorized scans below compare several expiration ticks against 'now'
+ * at once, expire the due ones through a bitmask and keep a running minimum
+ * of the others in a register. Lanes that are due are replaced by
+ * LF_TIMER_TICK_INVALID before taking the minimum.
+ *
+ * SSE and AVX2 only have signed 64-bit compares, so ticks are biased by
+ * INT64_MIN which maps unsigned order onto signed order.
+ */
+#define TICK_BIAS INT64_MIN
+
+__attribute__((target("sse4.2"))) static lf_tick_t
+scan_timers_sse(struct lf_timer_group *grp,
+                lf_tick_t now,
+                struct segment *seg,
+                lf_tick_t *ptr,
+                lf_tick_t *top)
+{
+    const __m128i bias = _mm_set1_epi64x(TICK_BIAS);
+    const __m128i vnow = _mm_xor_si128(_mm_set1_epi64x(now), bias);
+    const __m128i vinv = _mm_xor_si128(_mm_set1_epi64x(-1), bias);
+    __m128i vmin = vinv;
+    lf_tick_t rearmed = LF_TIMER_TICK_INVALID; /* Next periodic expiration */
+    for (; ptr + 2 <= top; ptr += 2) {
+        __m128i v = _mm_xor_si128(_mm_load_si128((__m128i *) ptr), bias);
+        __m128i later = _mm_cmpgt_epi64(v, vnow);
+        unsigned int due = ~_mm_movemask_pd(_mm_castsi128_pd(later)) & 0x3;
+        v = _mm_blendv_epi8(vinv, v, later);
+        vmin = _mm_blendv_epi8(vmin, v, _mm_cmpgt_epi64(vmin, v));
+        if (UNLIKELY(due))
+            rearmed = expire_mask(grp, now, seg, ptr, due, rearmed);
+    }
+
+    lf_tick_t lanes[2] ALIGNED(16);
+    _mm_store_si128((__m128i *) lanes, _mm_xor_si128(vmin, bias));
+    lf_tick_t earliest = MIN(rearmed, MIN(lanes[0], lanes[1]));
+    return scan_tail(grp, now, seg, ptr, top, earliest);
+}
+
+__attribute__((target("avx2"))) static lf_tick_t
+scan_timers_avx2(struct lf_timer_group *grp,
+                 lf_tick_t now,
+                 struct segment *seg,
+                 lf_tick_t *ptr,
+                 lf_tick_t *top)
+{
+    const __m256i bias = _mm256_set1_epi64x(TICK_BIAS);
+    const __m256i vnow = _mm256_xor_si256(_mm256_set1_epi64x(now), bias);
+    const __m256i vinv = _mm256_xor_si256(_mm256_set1_epi64x(-1), bias);
+    __m256i vmin = vinv;
+    lf_tick_t rearmed = LF_TIMER_TICK_INVALID; /* Next periodic expiration */
+    for (; ptr + 4 <= top; ptr += 4) {
+        __m256i v = _mm256_xor_si256(_mm256_load_si256((__m256i *) ptr), bias);
+        __m256i later = _mm256_cmpgt_epi64(v, vnow);
+        unsigned int due =
+            ~_mm256_movemask_pd(_mm256_castsi256_pd(later)) & 0xF;
+        v = _mm256_blendv_epi8(vinv, v, later);
+        vmin = _mm256_blendv_epi8(vmin, v, _mm256_cmpgt_epi64(vmin, v));
+        if (UNLIKELY(due))
+            rearmed = expire_mask(grp, now, seg, ptr, due, rearmed);
+    }
+
+    lf_tick_t lanes[4] ALIGNED(32);
+    _mm256_store_si256((__m256i *) lanes, _mm256_xor_si256(vmin, bias));
+    lf_tick_t earliest = MIN(MIN(lanes[0], lanes[1]), MIN(lanes[2], lanes[3]));
+    earliest = MIN(earliest, rearmed);
+    return scan_tail(grp, now, seg, ptr, top, earliest);
+}
+
+__attribute__((target("avx512f"))) static lf_tick_t
+scan_timers_avx512(struct lf_timer_group *grp,
+                   lf_tick_t now,
+                   struct segment *seg,
+                   lf_tick_t *ptr,
+                   lf_tick_t *top)
+{
+    const __m512i vnow = _mm512_set1_epi64(now);
+    __m512i vmin = _mm512_set1_epi64(LF_TIMER_TICK_INVALID);
+    lf_tick_t rearmed = LF_TIMER_TICK_INVALID; /* Next periodic expiration */
+    for (; ptr + 8 <= top; ptr += 8) {
+        __m512i v = _mm512_load_si512(ptr);
+        __mmask8 due = _mm512_cmple_epu64_mask(v, vnow);
+        vmin = _mm512_mask_min_epu64(vmin, (__mmask8) ~due, vmin, v);
+        if (UNLIKELY(due))
+            rearmed = expire_mask(grp, now, seg, ptr, due, rearmed);
+    }
+
+    lf_tick_t earliest = MIN(rearmed, _mm512_reduce_min_epu64(vmin));
+    return scan_tail(grp, now, seg, ptr, top, earliest);
+}
+
+typedef lf_tick_t (*scan_fn)(struct lf_timer_group *grp,
+                             lf_tick_t now,
+                             struct segment *seg,
+                             lf_tick_t *ptr,
+                             lf_tick_t *top);
+
+static scan_fn scan_impl = scan_timers;
+
+bool lf_timer_scan_select(lf_timer_scan_t impl)
+{
+    __builtin_cpu_init();
+    switch (impl) {
+    case LF_TIMER_SCAN_AUTO:
+        if (__builtin_cpu_supports("avx512f"))
+            scan_impl = scan_timers_avx512;
+        else if (__builtin_cpu_supports("avx2"))
+            scan_impl = scan_timers_avx2;
+        else if (__builtin_cpu_supports("sse4.2"))
+            scan_impl = scan_timers_sse;
+        else
+            scan_impl = scan_timers;
+        return true;
+    case LF_TIMER_SCAN_SCALAR:
+        scan_impl = scan_timers;
+        return true;
+    case LF_TIMER_SCAN_SSE:
+        if (!__builtin_cpu_supports("sse4.2"))
+            return false;
+        scan_impl = scan_timers_sse;
+        return true;
+    case LF_TIMER_SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return false;
+        scan_impl = scan_timers_avx2;
+        return true;
+    case LF_TIMER_SCAN_AVX512:
+        if (!__builtin_cpu_supports("avx512f"))
+            return false;
+        scan_impl = scan_timers_avx512;
+        return true;
+    }
+    return false;
+}
+
+/* Clear the active bits of the timers of a word scanned as a whole that
+ * expired or were cancelled, as clear_active does for a single timer: a
+ * racing lf_timer_set() may activate some of them again meanwhile.
+ * @return the earliest expiration of these, LF_TIMER_TICK_INVALID if none
+ */
+static lf_tick_t prune_word(struct lf_timer_group *grp,
+                            struct segment *seg,
+                            uint32_t w)
+{
+    lf_tick_t *base = &seg->expirations[w << WORD_SHIFT];
+    uint64_t idle = 0;
+    for (uint32_t i = 0; i < WORD_BITS; i++) {
+        lf_tick_t exp = __atomic_load_n(&base[i], __ATOMIC_RELAXED);
+        idle |= (uint64_t) (exp == LF_TIMER_TICK_INVALID) << i;
+    }
+    idle &= __atomic_load_n(&seg->active[w], __ATOMIC_SEQ_CST);
+    if (idle == 0)
+        return LF_TIMER_TICK_INVALID;
+
+    __atomic_fetch_and(&seg->active[w], ~idle, __ATOMIC_SEQ_CST);
+    uint32_t first = seg->timers[0].idx + (w << WORD_SHIFT);
+    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
+    while (idle) {
+        uint32_t i = __builtin_ctzll(idle);
+        idle &= idle - 1;
+        lf_tick_t exp = __atomic_load_n(&base[i], __ATOMIC_SEQ_CST);
+        if (UNLIKELY(exp != LF_TIMER_TICK_INVALID)) {
+            mark_active(grp, seg, first + i);
+            earliest = MIN(earliest, exp);
         }
-        if (UNLIKELY(w1 <= now)) {
-            lf_tick_t *pw1 = (lf_tick_t *) (ptr - 4) + 1;
-            if (pw1 >= top)
-                break;
-            expire_one_timer(now, pw1);
-        } else { /* 'w1' > 'now' */
-            earliest = MIN(earliest, w1);
+    }
+    return earliest;
+}
+
+/* Clear the summary bit 'sbit' of an active word found empty, then check
+ * that no timer was activated in the meantime
+ * @return the active word, 0 if the summary bit stays clear
+ */
+static inline uint64_t clear_summary(uint64_t *sum,
+                                     uint64_t sbit,
+                                     uint64_t *active)
+{
+    __atomic_fetch_and(sum, ~sbit, __ATOMIC_SEQ_CST);
+    uint64_t bits = __atomic_load_n(active, __ATOMIC_SEQ_CST);
+    if (bits != 0)
+        __atomic_fetch_or(sum, sbit, __ATOMIC_SEQ_CST);
+    return bits;
+}
+
+/* Scan the timers flagged in one bitmap word of a segment */
+static lf_tick_t scan_word(struct lf_timer_group *grp,
+                           lf_tick_t now,
+                           struct segment *seg,
+                           uint32_t w,
+                           uint64_t bits)
+{
+    lf_tick_t *base = &seg->expirations[w << WORD_SHIFT];
+    if (__builtin_popcountll(bits) >= DENSE_WORD) {
+        lf_tick_t earliest = scan_impl(grp, now, seg, base, base + WORD_BITS);
+        return MIN(earliest, prune_word(grp, seg, w));
+    }
+
+    uint32_t first = seg->timers[0].idx + (w << WORD_SHIFT);
+    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
+    while (bits) {
+        uint32_t i = __builtin_ctzll(bits);
+        bits &= bits - 1;
+        lf_tick_t exp = __atomic_load_n(&base[i], __ATOMIC_RELAXED);
+        if (exp <= now)
+            exp = expire_one_timer(grp, now, seg, &base[i]);
+        else if (exp == LF_TIMER_TICK_INVALID) /* Cancelled or expired */
+            exp = clear_active(grp, seg, first + i);
+        earliest = MIN(earliest, exp);
+    }
+    return earliest;
+}
+
+/* Scan the active timers of segment 'n', skipping idle bitmap words */
+static lf_tick_t scan_segment(struct lf_timer_group *grp,
+                              lf_tick_t now,
+                              uint32_t n)
+{
+    struct segment *seg = segment_of(grp, n << SEG_SHIFT);
+    uint32_t first = n * SEG_WORDS; /* Summary bit of the first word */
+    uint64_t *sum = &grp->summary[first >> WORD_SHIFT];
+    uint32_t shift = first & (WORD_BITS - 1);
+    uint64_t all = (UINT64_C(1) << SEG_WORDS) - 1;
+    uint64_t words = (__atomic_load_n(sum, __ATOMIC_SEQ_CST) >> shift) & all;
+    if (words == all) {
+        /* Busy segment, scan it as a whole. The bitmaps must still follow
+         * the timers that expired or were cancelled, or the segment would be
+         * scanned in full for ever.
+         */
+        lf_tick_t *base = &seg->expirations[0];
+        lf_tick_t earliest = scan_impl(grp, now, seg, base, base + SEG_SIZE);
+        for (uint32_t w = 0; w < SEG_WORDS; w++) {
+            earliest = MIN(earliest, prune_word(grp, seg, w));
+            if (__atomic_load_n(&seg->active[w], __ATOMIC_SEQ_CST) == 0)
+                clear_summary(sum, UINT64_C(1) << (shift + w),
+                              &seg->active[w]);
         }
+        return earliest;
+    }
+
+    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
+
+    while (words) {
+        uint32_t w = __builtin_ctzll(words);
+        words &= words - 1;
+        uint64_t bits = __atomic_load_n(&seg->active[w], __ATOMIC_SEQ_CST);
+        if (bits == 0) {
+            bits = clear_summary(sum, UINT64_C(1) << (shift + w),
+                                 &seg->active[w]);
+            if (bits == 0)
+                continue;
+        }
+        lf_tick_t e = scan_word(grp, now, seg, w, bits);
+        earliest = MIN(earliest, e);
     }
     return earliest;
 }
 
-/* Perform an atomic-min operation on g_timer.earliest */
-static inline void update_earliest(lf_tick_t exp)
+/* Wake the clock driver up from a sleep until 'deadline' */
+static void wake_driver(struct lf_timer_group *grp,
+                        lf_tick_t exp,
+                        lf_tick_t deadline)
 {
-    lf_tick_t old;
     do {
+        /* The thread that clears the deadline makes the system call */
+        if (__atomic_compare_exchange_n(&grp->driver_deadline, &deadline, 0,
+                                        /*weak=*/false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST)) {
+            __atomic_fetch_add(&grp->driver_wake, 1, __ATOMIC_RELEASE);
+            futex_wake(&grp->driver_wake, 1);
+            return;
+        }
+    } while (exp < deadline);
+}
+
+/* Perform an atomic-min operation on grp->earliest */
+static inline void update_earliest(struct lf_timer_group *grp, lf_tick_t exp)
+{
+    lf_tick_t old;
+    for (;;) {
         /* Explicit reloading => smaller code */
-        old = __atomic_load_n(&g_timer.earliest, __ATOMIC_RELAXED);
+        old = __atomic_load_n(&grp->earliest, __ATOMIC_RELAXED);
         if (exp >= old) {
             /* Our expiration time is same or later => no update */
             return;
         }
         /* Else our expiration time is earlier than the previous 'earliest' */
-    } while (UNLIKELY(!__atomic_compare_exchange_n(
-        &g_timer.earliest, &old, exp,
-        /*weak=*/true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+        if (LIKELY(__atomic_compare_exchange_n(
+                &grp->earliest, &old, exp,
+                /*weak=*/true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)))
+            break;
+        STAT_INC(earliest_retries);
+    }
+
+    /* Ordered after the update of 'earliest': either the clock driver sees
+     * our expiration time before it goes to sleep or we see its deadline
+     */
+    lf_tick_t deadline =
+        __atomic_load_n(&grp->driver_deadline, __ATOMIC_SEQ_CST);
+    if (UNLIKELY(exp < deadline))
+        wake_driver(grp, exp, deadline);
 }
 
-void lf_timer_expire(void)
+/* Reset 'earliest' before scanning, timers (re-)set from now on will lower
+ * it again
+ */
+static inline void start_scan(struct lf_timer_group *grp)
 {
-    lf_tick_t now = __atomic_load_n(&g_timer.current, __ATOMIC_RELAXED);
-    lf_tick_t earliest = __atomic_load_n(&g_timer.earliest, __ATOMIC_RELAXED);
+    lf_tick_t *first = expiration_of(grp, 0);
+    PREFETCH_FOR_READ(first);
+    PREFETCH_FOR_READ((char *) first + 1 * CACHE_LINE);
+    PREFETCH_FOR_READ((char *) first + 2 * CACHE_LINE);
+    PREFETCH_FOR_READ((char *) first + 3 * CACHE_LINE);
+
+    /* Reset 'earliest' */
+    __atomic_store_n(&grp->earliest, LF_TIMER_TICK_INVALID, __ATOMIC_RELAXED);
+
+    /* We need our earliest reset to be visible before we start to
+     * scan the timer array
+     */
+    smp_fence(StoreLoad);
+}
+
+void lf_timer_group_expire(lf_timer_group_t *grp)
+{
+    lf_tick_t now = __atomic_load_n(&grp->current, __ATOMIC_RELAXED);
+    lf_tick_t earliest = __atomic_load_n(&grp->earliest, __ATOMIC_RELAXED);
     if (earliest <= now) {
         /* There exists at least one timer that is due for expiration */
-        PREFETCH_FOR_READ(&g_timer.expirations[0]);
-        PREFETCH_FOR_READ((char *) &g_timer.expirations[0] + 1 * CACHE_LINE);
-        PREFETCH_FOR_READ((char *) &g_timer.expirations[0] + 2 * CACHE_LINE);
-        PREFETCH_FOR_READ((char *) &g_timer.expirations[0] + 3 * CACHE_LINE);
-
-        /* Reset 'earliest' */
-        __atomic_store_n(&g_timer.earliest, LF_TIMER_TICK_INVALID,
-                         __ATOMIC_RELAXED);
+        start_scan(grp);
 
-        /* We need our g_timer.earliest reset to be visible before we start to
-         * scan the timer array
+        /* Scan active timers looking for expired timers, one segment at
+         * a time
          */
-        smp_fence(StoreLoad);
-
-        /* Scan expiration ticks looking for expired timers */
-        earliest = scan_timers(now, &g_timer.expirations[0],
-                               &g_timer.expirations[g_timer.hi_watermark]);
-        update_earliest(earliest);
+        uint32_t hi = __atomic_load_n(&grp->hi_watermark, __ATOMIC_SEQ_CST);
+        uint32_t nsegs = (hi + SEG_SIZE - 1) >> SEG_SHIFT;
+        earliest = LF_TIMER_TICK_INVALID;
+        for (uint32_t n = 0; n < nsegs; n++) {
+            lf_tick_t e = scan_segment(grp, now, n);
+            earliest = MIN(earliest, e);
+        }
+        update_earliest(grp, earliest);
+        dispatch_notify(grp);
     }
     /* Else: no timers due for expiration */
 }
 
-void lf_timer_tick_set(lf_tick_t tck)
+/* Claim segments of the current cooperative scan until none are left. Any
+ * thread may scan a segment with a later 'now' than the thread that started
+ * the scan, it then just expires more timers.
+ */
+static void help_scan(struct lf_timer_group *grp)
+{
+    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
+    uint64_t work = __atomic_load_n(&grp->scan_work, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t next = (uint32_t) work;
+        uint32_t limit = work >> 32;
+        if (next >= limit)
+            break;
+        /* Failure reloads 'work', possibly from a newer scan */
+        if (!__atomic_compare_exchange_n(&grp->scan_work, &work, work + 1,
+                                         /*weak=*/true, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_ACQUIRE))
+            continue;
+
+        lf_tick_t now = __atomic_load_n(&grp->current, __ATOMIC_RELAXED);
+        lf_tick_t e = scan_segment(grp, now, next);
+        earliest = MIN(earliest, e);
+        work = __atomic_load_n(&grp->scan_work, __ATOMIC_ACQUIRE);
+    }
+    update_earliest(grp, earliest);
+}
+
+void lf_timer_group_expire_parallel(lf_timer_group_t *grp)
+{
+    lf_tick_t now = __atomic_load_n(&grp->current, __ATOMIC_RELAXED);
+    lf_tick_t earliest = __atomic_load_n(&grp->earliest, __ATOMIC_RELAXED);
+    if (earliest <= now) {
+        start_scan(grp);
+
+        /* Publish a new scan over all segments. Segments not yet claimed from
+         * an older scan are dropped, this scan covers them too.
+         */
+        uint32_t hi = __atomic_load_n(&grp->hi_watermark, __ATOMIC_SEQ_CST);
+        uint64_t nsegs = (hi + SEG_SIZE - 1) >> SEG_SHIFT;
+        __atomic_store_n(&grp->scan_work, nsegs << 32, __ATOMIC_RELEASE);
+    }
+    /* Help with our own scan or with one started by another thread */
+    help_scan(grp);
+    dispatch_notify(grp);
+}
+
+void lf_timer_group_tick_set(lf_timer_group_t *grp, lf_tick_t tck)
 {
     if (tck == LF_TIMER_TICK_INVALID) {
         fprintf(stderr, "invalid tick: %ld\n", tck);
         return;
     }
-    lf_tick_t old = __atomic_load_n(&g_timer.current, __ATOMIC_RELAXED);
+    lf_tick_t old = __atomic_load_n(&grp->current, __ATOMIC_RELAXED);
     do {
         if (tck <= old) /* Time cannot run backwards */
             return;
     } while (UNLIKELY(!__atomic_compare_exchange_n(
-        &g_timer.current, &old, /* Updated on failure */
+        &grp->current, &old, /* Updated on failure */
         tck,
         /*weak=*/true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)));
 }
 
-lf_tick_t lf_timer_tick_get(void)
+lf_tick_t lf_timer_group_tick_get(lf_timer_group_t *grp)
 {
-    return __atomic_load_n(&g_timer.current, __ATOMIC_RELAXED);
+    return __atomic_load_n(&grp->current, __ATOMIC_RELAXED);
 }
 
-lf_timer_t lf_timer_alloc(lf_timer_cb cb, void *arg)
+/* Pop up to *n timers from the freelist with a single CAS, growing the pool
+ * if it is empty
+ * @return first timer, linked to the others through 'arg', NULL if none left
+ */
+static struct timer *freelist_pop(struct lf_timer_group *grp, uint32_t *n)
 {
     union {
         struct freelist fl;
         ptrpair_t pp;
     } old, neu;
 
-    do {
+    for (;;) {
         old.fl.count =
-            __atomic_load_n(&g_timer.freelist.count, __ATOMIC_ACQUIRE);
+            __atomic_load_n(&grp->freelist.count, __ATOMIC_ACQUIRE);
         /* count will be read before head, torn read will be detected by CAS */
-        old.fl.head = __atomic_load_n(&g_timer.freelist.head, __ATOMIC_ACQUIRE);
+        old.fl.head = __atomic_load_n(&grp->freelist.head, __ATOMIC_ACQUIRE);
         if (UNLIKELY(old.fl.head == NULL)) {
-            return LF_TIMER_NULL;
+            /* Pool exhausted, append a new segment and try again */
+            if (!grow_timers(grp))
+                return NULL;
+            continue;
         }
-        neu.fl.head =
-            old.fl.head->arg; /* Dereferencing old.head => need acquire */
+
+        /* Follow the links to the last timer to pop. A link read after the
+         * list changed may be a user argument instead of a timer, so check
+         * that the list did not change before following a link.
+         */
+        struct timer *last = old.fl.head;
+        uint32_t k = 1;
+        for (; k < *n; k++) {
+            struct timer *next = last->arg;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (next == NULL ||
+                __atomic_load_n(&grp->freelist.count, __ATOMIC_RELAXED) !=
+                    old.fl.count)
+                break;
+            last = next;
+        }
+        neu.fl.head = last->arg; /* Dereferencing timers => need acquire */
         neu.fl.count = old.fl.count + 1;
-    } while (UNLIKELY(!lockfree_compare_exchange_pp(
-        (ptrpair_t *) &g_timer.freelist, &old.pp, neu.pp,
-        /*weak=*/true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)));
+        if (lockfree_compare_exchange_pp((ptrpair_t *) &grp->freelist,
+                                         &old.pp, neu.pp,
+                                         /*weak=*/true, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
+            *n = k;
+            return old.fl.head;
+        }
+        STAT_INC(freelist_retries);
+    }
+}
+
+/* Refill an empty magazine from the freelist */
+static bool magazine_refill(struct lf_timer_group *grp, struct magazine *mag)
+{
+    uint32_t n = MAG_BATCH;
+    struct timer *tim = freelist_pop(grp, &n);
+    if (UNLIKELY(tim == NULL))
+        return false;
+    /* Keep the order of the freelist, most recently freed on top */
+    for (uint32_t i = n; i-- > 0;) {
+        mag->timers[i] = tim;
+        tim = tim->arg;
+    }
+    mag->count = n;
+    return true;
+}
+
+/* Spill the bottom half of a full magazine to the freelist */
+static void magazine_spill(struct lf_timer_group *grp, struct magazine *mag)
+{
+    for (uint32_t i = 0; i < MAG_BATCH - 1; i++)
+        mag->timers[i]->arg = mag->timers[i + 1];
+    freelist_push(grp, mag->timers[0], mag->timers[MAG_BATCH - 1]);
+    for (uint32_t i = MAG_BATCH; i < MAG_SIZE; i++)
+        mag->timers[i - MAG_BATCH] = mag->timers[i];
+    mag->count = MAG_SIZE - MAG_BATCH;
+}
 
-    uint32_t idx = old.fl.head - g_timer.timers;
-    g_timer.expirations[idx] = LF_TIMER_TICK_INVALID;
-    g_timer.timers[idx].cb = cb;
-    g_timer.timers[idx].arg = arg;
+lf_timer_t lf_timer_group_alloc(lf_timer_group_t *grp,
+                                lf_timer_cb cb,
+                                void *arg)
+{
+    struct timer *tim;
+    struct magazine *mag = magazine_of(grp);
+    if (LIKELY(mag != NULL)) {
+        if (UNLIKELY(mag->count == 0) && !magazine_refill(grp, mag))
+            return LF_TIMER_NULL;
+        tim = mag->timers[--mag->count];
+    } else {
+        uint32_t n = 1;
+        tim = freelist_pop(grp, &n);
+        if (UNLIKELY(tim == NULL))
+            return LF_TIMER_NULL;
+    }
+
+    uint32_t idx = tim->idx;
+    *expiration_of(grp, idx) = LF_TIMER_TICK_INVALID;
+    tim->arg = arg;
+    /* A non-NULL callback marks the timer allocated for recede_watermark() */
+    __atomic_store_n(&tim->cb, cb, __ATOMIC_SEQ_CST);
 
     /* Update high watermark of allocated timers */
-    lockfree_fetch_umax_4(&g_timer.hi_watermark, idx + 1, __ATOMIC_RELEASE);
+    lockfree_fetch_umax_4(&grp->hi_watermark, idx + 1, __ATOMIC_SEQ_CST);
     return idx;
 }
 
-void lf_timer_free(lf_timer_t idx)
+/* Lower the high watermark past freed timers at the top so that the expiry
+ * scan does not visit their segments anymore
+ */
+static void recede_watermark(struct lf_timer_group *grp)
 {
-    if (UNLIKELY((uint32_t) idx >= g_timer.hi_watermark)) {
+    uint32_t hi = __atomic_load_n(&grp->hi_watermark, __ATOMIC_SEQ_CST);
+    while (hi != 0 &&
+           __atomic_load_n(&timer_of(grp, hi - 1)->cb, __ATOMIC_SEQ_CST) ==
+               NULL) {
+        /* Failure reloads 'hi' */
+        if (!__atomic_compare_exchange_n(&grp->hi_watermark, &hi, hi - 1,
+                                         /*weak=*/true, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_SEQ_CST))
+            continue;
+
+        /* The timer may have been allocated after we checked it, and its
+         * allocator may have seen the old watermark. Restore the watermark
+         * and make sure a scan that missed the timer meanwhile is redone.
+         */
+        if (__atomic_load_n(&timer_of(grp, hi - 1)->cb, __ATOMIC_SEQ_CST) !=
+            NULL) {
+            lockfree_fetch_umax_4(&grp->hi_watermark, hi, __ATOMIC_SEQ_CST);
+            lf_tick_t exp =
+                __atomic_load_n(expiration_of(grp, hi - 1), __ATOMIC_SEQ_CST);
+            if (exp != LF_TIMER_TICK_INVALID)
+                update_earliest(grp, exp);
+            return;
+        }
+        hi--;
+    }
+}
+
+void lf_timer_group_free(lf_timer_group_t *grp, lf_timer_t idx)
+{
+    if (UNLIKELY(!valid_timer(grp, idx))) {
         fprintf(stderr, "invalid timer: %d\n", idx);
         return;
     }
 
-    if (__atomic_load_n(&g_timer.expirations[idx], __ATOMIC_ACQUIRE) !=
+    if (__atomic_load_n(expiration_of(grp, idx), __ATOMIC_ACQUIRE) !=
         LF_TIMER_TICK_INVALID) {
         fprintf(stderr, "cannot free active timer: %d\n", idx);
         return;
     }
 
-    struct timer *tim = &g_timer.timers[idx];
-    union {
-        struct freelist fl;
-        ptrpair_t pp;
-    } old, neu;
+    struct timer *tim = timer_of(grp, idx);
+    __atomic_store_n(&tim->cb, NULL, __ATOMIC_SEQ_CST);
+    recede_watermark(grp);
 
-    do {
-        old.fl = g_timer.freelist;
-        tim->cb = NULL;
-        tim->arg = old.fl.head;
-        neu.fl.head = tim;
-        neu.fl.count = old.fl.count + 1;
-    } while (UNLIKELY(!lockfree_compare_exchange_pp(
-        (ptrpair_t *) &g_timer.freelist, &old.pp, neu.pp,
-        /*weak=*/true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+    struct magazine *mag = magazine_of(grp);
+    if (UNLIKELY(mag == NULL)) {
+        freelist_push(grp, tim, tim);
+        return;
+    }
+    if (UNLIKELY(mag->count == MAG_SIZE))
+        magazine_spill(grp, mag);
+    mag->timers[mag->count++] = tim;
 }
 
-static inline bool update_expiration(lf_timer_t idx,
+/* Set (inactive timer), reset or cancel (active timer) the expiration time
+ * of a timer. Instead of updating the group's earliest expiration, lower
+ * *earliest to the new expiration time.
+ */
+static inline bool change_expiration(struct lf_timer_group *grp,
+                                     lf_timer_t idx,
                                      lf_tick_t exp,
+                                     lf_tick_t period, /* Set only */
                                      bool active,
-                                     int mo)
+                                     int mo,
+                                     lf_tick_t *earliest)
 {
-    if (UNLIKELY((uint32_t) idx >= g_timer.hi_watermark)) {
+    if (UNLIKELY(!valid_timer(grp, idx))) {
         fprintf(stderr, "invalid timer: %d", idx);
         return false;
     }
 
+    struct segment *seg = segment_of(grp, idx);
+    struct timer *tim = &seg->timers[idx & SEG_MASK];
+    lf_tick_t *ptr = &seg->expirations[idx & SEG_MASK];
+
+    /* Set: claim the timer before writing its period, so that a set losing
+     * the race cannot overwrite the period of the winner. While claimed and
+     * inactive, nobody else changes the expiration: the set below cannot
+     * fail and the period is published by its release.
+     */
+    if (!active) {
+        if (__atomic_load_n(ptr, __ATOMIC_RELAXED) != LF_TIMER_TICK_INVALID ||
+            __atomic_exchange_n(&tim->arming, 1, __ATOMIC_ACQUIRE))
+            return false;
+        if (__atomic_load_n(ptr, __ATOMIC_ACQUIRE) != LF_TIMER_TICK_INVALID) {
+            /* Set by another thread before we claimed it */
+            __atomic_store_n(&tim->arming, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+        __atomic_store_n(&tim->period, period, __ATOMIC_RELAXED);
+    }
+
     lf_tick_t old;
     do {
         /* Explicit reloading => smaller code */
-        old = __atomic_load_n(&g_timer.expirations[idx], __ATOMIC_RELAXED);
+        old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
         if (active ? old == LF_TIMER_TICK_INVALID :  // Timer inactive/expired
                 old != LF_TIMER_TICK_INVALID) {      // Timer already active
+            if (!active)
+                __atomic_store_n(&tim->arming, 0, __ATOMIC_RELEASE);
             return false;
         }
     } while (UNLIKELY(
-        !__atomic_compare_exchange_n(&g_timer.expirations[idx], &old, exp,
+        !__atomic_compare_exchange_n(ptr, &old, exp,
                                      /*weak=*/true, mo, __ATOMIC_RELAXED)));
-    if (exp != LF_TIMER_TICK_INVALID)
-        update_earliest(exp);
+    if (!active)
+        __atomic_store_n(&tim->arming, 0, __ATOMIC_RELEASE);
+    if (exp != LF_TIMER_TICK_INVALID) {
+        mark_active(grp, seg, idx);
+    } else {
+        exp = clear_active(grp, seg, idx);
+        if (exp == LF_TIMER_TICK_INVALID)
+            return true;
+        /* Set again by another thread while we cleared the active bit */
+    }
+    *earliest = MIN(*earliest, exp);
+    return true;
+}
+
+static inline bool update_expiration(struct lf_timer_group *grp,
+                                     lf_timer_t idx,
+                                     lf_tick_t exp,
+                                     lf_tick_t period,
+                                     bool active,
+                                     int mo)
+{
+    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
+    if (!change_expiration(grp, idx, exp, period, active, mo, &earliest))
+        return false;
+    update_earliest(grp, earliest);
     return true;
 }
 
 /* Setting a timer has release order (with regards to user-defined data
  * associated with the timer)
  */
-bool lf_timer_set(lf_timer_t idx, lf_tick_t exp)
+bool lf_timer_group_set(lf_timer_group_t *grp,
+                        lf_timer_t idx,
+                        lf_tick_t exp)
 {
     if (UNLIKELY(exp == LF_TIMER_TICK_INVALID)) {
         fprintf(stderr, "invalid expiration time: %ld\n", exp);
         return false;
     }
 
-    return update_expiration(idx, exp, false, __ATOMIC_RELEASE);
+    return update_expiration(grp, idx, exp, 0, false, __ATOMIC_RELEASE);
 }
 
-bool lf_timer_reset(lf_timer_t idx, lf_tick_t exp)
+bool lf_timer_group_set_periodic(lf_timer_group_t *grp,
+                                 lf_timer_t idx,
+                                 lf_tick_t exp,
+                                 lf_tick_t period)
+{
+    if (UNLIKELY(exp == LF_TIMER_TICK_INVALID || period == 0)) {
+        fprintf(stderr, "invalid expiration time: %ld period: %ld\n", exp,
+                period);
+        return false;
+    }
+    return update_expiration(grp, idx, exp, period, false, __ATOMIC_RELEASE);
+}
+
+uint32_t lf_timer_group_set_batch(lf_timer_group_t *grp,
+                                  const lf_timer_t tims[],
+                                  const lf_tick_t exps[],
+                                  uint32_t n)
+{
+    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (UNLIKELY(exps[i] == LF_TIMER_TICK_INVALID)) {
+            fprintf(stderr, "invalid expiration time: %ld\n", exps[i]);
+            continue;
+        }
+        count += change_expiration(grp, tims[i], exps[i], 0, false,
+                                   __ATOMIC_RELEASE, &earliest);
+    }
+    /* A single update for all timers */
+    update_earliest(grp, earliest);
+    return count;
+}
+
+bool lf_timer_group_reset(lf_timer_group_t *grp,
+                          lf_timer_t idx,
+                          lf_tick_t exp)
 {
     if (UNLIKELY(exp == LF_TIMER_TICK_INVALID)) {
         fprintf(stderr, "invalid expiration time: %ld\n", exp);
         return false;
     }
-    return update_expiration(idx, exp, true, __ATOMIC_RELEASE);
+    return update_expiration(grp, idx, exp, 0, true, __ATOMIC_RELEASE);
 }
 
-bool lf_timer_cancel(lf_timer_t idx)
+bool lf_timer_group_cancel(lf_timer_group_t *grp, lf_timer_t idx)
 {
-    return update_expiration(idx, LF_TIMER_TICK_INVALID, true,
+    return update_expiration(grp, idx, LF_TIMER_TICK_INVALID, 0, true,
                              __ATOMIC_RELAXED);
 }
+
+lf_timer_group_t *lf_timer_group_create(void)
+{
+    struct lf_timer_group *grp =
+        aligned_alloc(CACHE_LINE, sizeof(struct lf_timer_group));
+    if (UNLIKELY(grp == NULL))
+        return NULL;
+    init_group(grp);
+    return grp;
+}
+
+lf_tick_t lf_timer_clock_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lf_tick_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *driver_main(void *arg)
+{
+    struct lf_timer_group *grp = arg;
+
+    /* The default slack of 50us would dominate the lateness of timers */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    for (;;) {
+        /* Read before checking for work so no wake-up is missed */
+        uint32_t seq = __atomic_load_n(&grp->driver_wake, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&grp->driver_stop, __ATOMIC_ACQUIRE))
+            break;
+
+        lf_timer_group_tick_set(grp, lf_timer_clock_now());
+        lf_timer_group_expire(grp);
+
+        /* Publish our deadline, then check that no timer was set before it
+         * in the meantime (those would not wake us)
+         */
+        lf_tick_t deadline =
+            __atomic_load_n(&grp->earliest, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&grp->driver_deadline, deadline, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&grp->earliest, __ATOMIC_SEQ_CST) >= deadline &&
+            deadline > lf_timer_clock_now())
+            futex_wait_until(&grp->driver_wake, seq, deadline);
+        __atomic_store_n(&grp->driver_deadline, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+bool lf_timer_group_driver_start(lf_timer_group_t *grp)
+{
+    if (grp->driver_running)
+        return false;
+    grp->driver_stop = false;
+    if (pthread_create(&grp->driver, NULL, driver_main, grp) != 0)
+        return false;
+    grp->driver_running = true;
+    return true;
+}
+
+void lf_timer_group_driver_stop(lf_timer_group_t *grp)
+{
+    if (!grp->driver_running)
+        return;
+    __atomic_store_n(&grp->driver_stop, true, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&grp->driver_wake, 1, __ATOMIC_RELEASE);
+    futex_wake(&grp->driver_wake, 1);
+    pthread_join(grp->driver, NULL);
+    grp->driver_running = false;
+}
+
+static void dispatch_free(struct dispatch *dsp)
+{
+    free(dsp->threads);
+    free(dsp->queue);
+    free(dsp);
+}
+
+bool lf_timer_group_dispatch_start(lf_timer_group_t *grp,
+                                   uint32_t nthreads,
+                                   uint32_t queue_size)
+{
+    if (grp->dispatch != NULL || nthreads == 0)
+        return false;
+    struct dispatch *dsp = aligned_alloc(CACHE_LINE, sizeof(struct dispatch));
+    if (UNLIKELY(dsp == NULL))
+        return false;
+    memset(dsp, 0, sizeof(*dsp));
+
+    size_t bytes;
+    if (mpmc_make_queue_dispatch_item(queue_size, NULL, &bytes) !=
+        QueueResult_Ok)
+        goto fail;
+    bytes = (bytes + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    dsp->queue = aligned_alloc(CACHE_LINE, bytes);
+    dsp->threads =
+        aligned_alloc(CACHE_LINE, nthreads * sizeof(struct dispatch_thread));
+    if (UNLIKELY(dsp->queue == NULL || dsp->threads == NULL))
+        goto fail;
+    mpmc_make_queue_dispatch_item(queue_size, dsp->queue, &bytes);
+
+    memset(dsp->threads, 0, nthreads * sizeof(struct dispatch_thread));
+    for (; dsp->nthreads < nthreads; dsp->nthreads++) {
+        struct dispatch_thread *thr = &dsp->threads[dsp->nthreads];
+        thr->dsp = dsp;
+        if (pthread_create(&thr->thread, NULL, dispatch_main, thr) != 0)
+            break;
+    }
+    if (dsp->nthreads == 0)
+        goto fail;
+    __atomic_store_n(&grp->dispatch, dsp, __ATOMIC_RELEASE);
+    return true;
+
+fail:
+    dispatch_free(dsp);
+    return false;
+}
+
+void lf_timer_group_dispatch_stop(lf_timer_group_t *grp)
+{
+    struct dispatch *dsp = grp->dispatch;
+    if (dsp == NULL)
+        return;
+    __atomic_store_n(&grp->dispatch, NULL, __ATOMIC_RELEASE);
+
+    /* Dispatcher threads drain the queue before they exit */
+    __atomic_store_n(&dsp->stop, true, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&dsp->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&dsp->seq, INT32_MAX);
+    for (uint32_t i = 0; i < dsp->nthreads; i++)
+        pthread_join(dsp->threads[i].thread, NULL);
+    dispatch_free(dsp);
+}
+
+bool lf_timer_group_dispatch_stats(lf_timer_group_t *grp,
+                                   lf_timer_dispatch_stats_t *stats)
+{
+    struct dispatch *dsp = __atomic_load_n(&grp->dispatch, __ATOMIC_ACQUIRE);
+    if (dsp == NULL)
+        return false;
+    stats->count = 0;
+    stats->total_ns = 0;
+    stats->max_ns = 0;
+    stats->inline_count =
+        __atomic_load_n(&dsp->inline_count, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < dsp->nthreads; i++) {
+        struct dispatch_thread *thr = &dsp->threads[i];
+        stats->count += __atomic_load_n(&thr->count, __ATOMIC_RELAXED);
+        stats->total_ns += __atomic_load_n(&thr->total_ns, __ATOMIC_RELAXED);
+        stats->max_ns =
+            MAX(stats->max_ns, __atomic_load_n(&thr->max_ns, __ATOMIC_RELAXED));
+    }
+    return true;
+}
+
+void lf_timer_group_destroy(lf_timer_group_t *grp)
+{
+    if (grp == NULL || grp == &g_timer)
+        return;
+    lf_timer_group_driver_stop(grp);
+    lf_timer_group_dispatch_stop(grp);
+    for (uint32_t i = 0; i < MAXSEGS && grp->segs[i]; i++)
+        free(grp->segs[i]);
+    free(grp);
+}
+
+void lf_timer_stats_get(lf_timer_stats_t *stats)
+{
+#ifdef LF_TIMER_STATS
+    stats->earliest_retries =
+        __atomic_load_n(&stat_earliest_retries, __ATOMIC_RELAXED);
+    stats->freelist_retries =
+        __atomic_load_n(&stat_freelist_retries, __ATOMIC_RELAXED);
+#else
+    stats->earliest_retries = 0;
+    stats->freelist_retries = 0;
+#endif
+}
+
+/* The lf_timer_xxx() API operates on the default group */
+
+lf_timer_t lf_timer_alloc(lf_timer_cb cb, void *arg)
+{
+    return lf_timer_group_alloc(&g_timer, cb, arg);
+}
+
+void lf_timer_free(lf_timer_t tim)
+{
+    lf_timer_group_free(&g_timer, tim);
+}
+
+bool lf_timer_set(lf_timer_t tim, lf_tick_t tmo)
+{
+    return lf_timer_group_set(&g_timer, tim, tmo);
+}
+
+bool lf_timer_set_periodic(lf_timer_t tim, lf_tick_t tmo, lf_tick_t period)
+{
+    return lf_timer_group_set_periodic(&g_timer, tim, tmo, period);
+}
+
+uint32_t lf_timer_set_batch(const lf_timer_t tims[],
+                            const lf_tick_t tmos[],
+                            uint32_t n)
+{
+    return lf_timer_group_set_batch(&g_timer, tims, tmos, n);
+}
+
+bool lf_timer_reset(lf_timer_t tim, lf_tick_t tmo)
+{
+    return lf_timer_group_reset(&g_timer, tim, tmo);
+}
+
+bool lf_timer_cancel(lf_timer_t tim)
+{
+    return lf_timer_group_cancel(&g_timer, tim);
+}
+
+lf_tick_t lf_timer_tick_get(void)
+{
+    return lf_timer_group_tick_get(&g_timer);
+}
+
+void lf_timer_tick_set(lf_tick_t now)
+{
+    lf_timer_group_tick_set(&g_timer, now);
+}
+
+void lf_timer_expire(void)
+{
+    lf_timer_group_expire(&g_timer);
+}
+
+void lf_timer_expire_parallel(void)
+{
+    lf_timer_group_expire_parallel(&g_timer);
+}
+
+bool lf_timer_driver_start(void)
+{
+    return lf_timer_group_driver_start(&g_timer);
+}
+
+void lf_timer_driver_stop(void)
+{
+    lf_timer_group_driver_stop(&g_timer);
+}
+
+bool lf_timer_dispatch_start(uint32_t nthreads, uint32_t queue_size)
+{
+    return lf_timer_group_dispatch_start(&g_timer, nthreads, queue_size);
+}
+
+void lf_timer_dispatch_stop(void)
+{
+    lf_timer_group_dispatch_stop(&g_timer);
+}
+
+bool lf_timer_dispatch_stats(lf_timer_dispatch_stats_t *stats)
+{
+    return lf_timer_group_dispatch_stats(&g_timer, stats);
+}
@@ -24,6 +24,21 @@ void lf_timer_free(lf_timer_t tim);
  */
 bool lf_timer_set(lf_timer_t tim, lf_tick_t tmo);
 
+/** Set (activate) an inactive timer that expires at 'tmo' and then every
+ * 'period' ticks until cancelled. Expiry re-arms the timer before invoking
+ * the callback, periods missed by the time of expiry are skipped.
+ * @return false if timer already active or period is 0
+ */
+bool lf_timer_set_periodic(lf_timer_t tim, lf_tick_t tmo, lf_tick_t period);
+
+/** Set (activate) inactive timers tims[i] to expire at tmos[i], updating the
+ * earliest expiration once for all of them
+ * @return number of timers set, active timers are left as they are
+ */
+uint32_t lf_timer_set_batch(const lf_timer_t tims[],
+                            const lf_tick_t tmos[],
+                            uint32_t n);
+
 /** Reset an active (not yet expired) timer
  * @return false if timer inactive (already expired or cancelled)
  */
@@ -41,4 +56,127 @@ lf_tick_t lf_timer_tick_get(void);
 void lf_timer_tick_set(lf_tick_t now);
 
 /** Expire timers <= current tick and invoke callbacks */
-void lf_timer_expire(void);
\ No newline at end of file
+void lf_timer_expire(void);
+
+/** Expire timers <= current tick, cooperating with other threads.
+ * Several threads may call this at the same time: the expiration array is
+ * split in segments that each thread claims in turn, invoking the callbacks
+ * of the due timers in its own segments. A thread that finds no due timers
+ * helps to finish a scan started by another thread.
+ */
+void lf_timer_expire_parallel(void);
+
+/** Independent group of timers with its own tick, freelist and expirations.
+ * The lf_timer_xxx() functions above operate on a default group, each
+ * lf_timer_group_xxx() function is the equivalent for an explicit group.
+ * Timer handles are only valid within the group that allocated them.
+ */
+typedef struct lf_timer_group lf_timer_group_t;
+
+/** Create a timer group
+ * @return NULL if out of memory
+ */
+lf_timer_group_t *lf_timer_group_create(void);
+
+/** Destroy a timer group, no thread may use it or its timers anymore */
+void lf_timer_group_destroy(lf_timer_group_t *grp);
+
+lf_timer_t lf_timer_group_alloc(lf_timer_group_t *grp,
+                                lf_timer_cb cb,
+                                void *arg);
+void lf_timer_group_free(lf_timer_group_t *grp, lf_timer_t tim);
+bool lf_timer_group_set(lf_timer_group_t *grp, lf_timer_t tim, lf_tick_t tmo);
+bool lf_timer_group_set_periodic(lf_timer_group_t *grp,
+                                 lf_timer_t tim,
+                                 lf_tick_t tmo,
+                                 lf_tick_t period);
+uint32_t lf_timer_group_set_batch(lf_timer_group_t *grp,
+                                  const lf_timer_t tims[],
+                                  const lf_tick_t tmos[],
+                                  uint32_t n);
+bool lf_timer_group_reset(lf_timer_group_t *grp,
+                          lf_timer_t tim,
+                          lf_tick_t tmo);
+bool lf_timer_group_cancel(lf_timer_group_t *grp, lf_timer_t tim);
+lf_tick_t lf_timer_group_tick_get(lf_timer_group_t *grp);
+void lf_timer_group_tick_set(lf_timer_group_t *grp, lf_tick_t now);
+void lf_timer_group_expire(lf_timer_group_t *grp);
+void lf_timer_group_expire_parallel(lf_timer_group_t *grp);
+
+/** Return the CLOCK_MONOTONIC time in nanoseconds, the tick used by the
+ * clock driver
+ */
+lf_tick_t lf_timer_clock_now(void);
+
+/** Start a thread that drives the timers from the clock: it sets the tick to
+ * lf_timer_clock_now() and expires timers, sleeping until the earliest one
+ * is due. Setting a timer before that wakes it up early. Expiration times of
+ * a driven group are thus in CLOCK_MONOTONIC nanoseconds and the callbacks
+ * are invoked by the driver thread. Start and stop are not thread-safe.
+ * @return false if already started or the thread could not be created
+ */
+bool lf_timer_driver_start(void);
+
+/** Stop the clock driver thread and wait for it to exit */
+void lf_timer_driver_stop(void);
+
+bool lf_timer_group_driver_start(lf_timer_group_t *grp);
+void lf_timer_group_driver_stop(lf_timer_group_t *grp);
+
+/** Invoke the callbacks of expired timers from a pool of dispatcher threads
+ * instead of from the expiration scan, so that slow callbacks do not delay
+ * the expiration of other timers. Expired timers are queued to the pool,
+ * the scan invokes the callback itself when the queue is full. Start and
+ * stop are not thread-safe, no thread may expire timers meanwhile.
+ * @param nthreads Number of dispatcher threads
+ * @param queue_size Number of queued timers, a power of 2
+ * @return false if already started or out of resources
+ */
+bool lf_timer_dispatch_start(uint32_t nthreads, uint32_t queue_size);
+
+/** Stop the dispatcher threads once they have drained the queue */
+void lf_timer_dispatch_stop(void);
+
+typedef struct {
+    uint64_t count;        /* Callbacks invoked by dispatcher threads */
+    uint64_t total_ns;     /* Sum of latencies from expiry to callback */
+    uint64_t max_ns;       /* Largest latency from expiry to callback */
+    uint64_t inline_count; /* Callbacks invoked by the scan, queue full */
+} lf_timer_dispatch_stats_t;
+
+/** Read the statistics of the dispatcher threads
+ * @return false if dispatch not started
+ */
+bool lf_timer_dispatch_stats(lf_timer_dispatch_stats_t *stats);
+
+bool lf_timer_group_dispatch_start(lf_timer_group_t *grp,
+                                   uint32_t nthreads,
+                                   uint32_t queue_size);
+void lf_timer_group_dispatch_stop(lf_timer_group_t *grp);
+bool lf_timer_group_dispatch_stats(lf_timer_group_t *grp,
+                                   lf_timer_dispatch_stats_t *stats);
+
+/** Contention counters of all groups, only maintained when lf_timer.c is
+ * built with -DLF_TIMER_STATS (all zero otherwise)
+ */
+typedef struct {
+    uint64_t earliest_retries; /* Failed CAS on the earliest expiration */
+    uint64_t freelist_retries; /* Failed CAS on the freelist */
+} lf_timer_stats_t;
+
+void lf_timer_stats_get(lf_timer_stats_t *stats);
+
+/** Implementations of the expiration scan in lf_timer_expire() */
+typedef enum {
+    LF_TIMER_SCAN_AUTO,   /* Widest one supported by the CPU (default) */
+    LF_TIMER_SCAN_SCALAR, /* Unrolled loop, 1 tick per compare */
+    LF_TIMER_SCAN_SSE,    /* SSE4.2, 2 ticks per compare */
+    LF_TIMER_SCAN_AVX2,   /* 4 ticks per compare */
+    LF_TIMER_SCAN_AVX512, /* 8 ticks per compare */
+} lf_timer_scan_t;
+
+/** Select the expiration scan used by all groups, this is not synchronized
+ * with concurrent calls to lf_timer_expire()
+ * @return false if the CPU does not support it
+ */
+bool lf_timer_scan_select(lf_timer_scan_t impl);
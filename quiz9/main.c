@@ -1,6 +1,8 @@
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "lf_timer.h"
 
@@ -23,6 +25,378 @@ static void callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
     *(lf_tick_t *) arg = tck;
 }
 
+static void count_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    (void) tim;
+    (void) tmo;
+    (*(uint32_t *) arg)++;
+}
+
+/* Allocate more timers than the initial pool holds so that it has to grow */
+#define MANY_TIMERS (4 * 8192 + 1)
+
+static void test_many_timers(void (*expire)(void))
+{
+    static lf_timer_t tims[MANY_TIMERS];
+    uint32_t count = 0;
+    lf_tick_t now = lf_timer_tick_get();
+
+    for (uint32_t i = 0; i < MANY_TIMERS; i++) {
+        tims[i] = lf_timer_alloc(count_callback, &count);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        EXPECT(lf_timer_set(tims[i], now + 1 + (i & 1)));
+    }
+
+    lf_timer_tick_set(now + 1);
+    expire();
+    EXPECT(count == MANY_TIMERS / 2 + 1);
+
+    lf_timer_tick_set(now + 2);
+    expire();
+    EXPECT(count == MANY_TIMERS);
+
+    for (uint32_t i = 0; i < MANY_TIMERS; i++)
+        lf_timer_free(tims[i]);
+}
+
+/* Several threads expire a group in parallel while the tick moves on: they
+ * claim segments of each other's scans and newer scans replace older ones,
+ * every timer must still fire exactly once
+ */
+#define PARALLEL_TIMERS (4 * 1024 + 100)
+#define PARALLEL_THREADS 4
+#define PARALLEL_TICKS 64
+
+static uint32_t parallel_counts[PARALLEL_TIMERS];
+static uint32_t parallel_fired;
+static int parallel_stop;
+
+static void parallel_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    (void) tim;
+    (void) tmo;
+    __atomic_fetch_add((uint32_t *) arg, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&parallel_fired, 1, __ATOMIC_RELEASE);
+}
+
+static void *parallel_expirer(void *arg)
+{
+    lf_timer_group_t *grp = arg;
+    while (!__atomic_load_n(&parallel_stop, __ATOMIC_ACQUIRE))
+        lf_timer_group_expire_parallel(grp);
+    return NULL;
+}
+
+static void test_expire_parallel(void)
+{
+    static lf_timer_t tims[PARALLEL_TIMERS];
+    lf_timer_group_t *grp = lf_timer_group_create();
+    EXPECT(grp != NULL);
+    for (uint32_t i = 0; i < PARALLEL_TIMERS; i++) {
+        tims[i] = lf_timer_group_alloc(grp, parallel_callback,
+                                       &parallel_counts[i]);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        EXPECT(lf_timer_group_set(grp, tims[i], 1 + i % PARALLEL_TICKS));
+    }
+
+    pthread_t threads[PARALLEL_THREADS];
+    for (int i = 0; i < PARALLEL_THREADS; i++)
+        EXPECT(pthread_create(&threads[i], NULL, parallel_expirer, grp) == 0);
+    for (lf_tick_t tick = 1; tick <= PARALLEL_TICKS; tick++) {
+        lf_timer_group_tick_set(grp, tick);
+        nanosleep(&(struct timespec){.tv_nsec = 100000}, NULL);
+    }
+    /* Up to 5s for the last ones */
+    for (int i = 0; i < 5000; i++) {
+        if (__atomic_load_n(&parallel_fired, __ATOMIC_ACQUIRE) ==
+            PARALLEL_TIMERS)
+            break;
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    __atomic_store_n(&parallel_stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < PARALLEL_THREADS; i++)
+        EXPECT(pthread_join(threads[i], NULL) == 0);
+
+    /* Nothing left to fire a second time */
+    lf_timer_group_expire_parallel(grp);
+    lf_timer_group_expire(grp);
+    EXPECT(parallel_fired == PARALLEL_TIMERS);
+    for (uint32_t i = 0; i < PARALLEL_TIMERS; i++)
+        EXPECT(parallel_counts[i] == 1);
+
+    for (uint32_t i = 0; i < PARALLEL_TIMERS; i++)
+        lf_timer_group_free(grp, tims[i]);
+    lf_timer_group_destroy(grp);
+}
+
+/* Timers in different groups do not see each other's tick */
+static void test_groups(void)
+{
+    lf_timer_group_t *grp_a = lf_timer_group_create();
+    lf_timer_group_t *grp_b = lf_timer_group_create();
+    EXPECT(grp_a != NULL && grp_b != NULL);
+
+    uint32_t count_a = 0, count_b = 0;
+    lf_timer_t tim_a = lf_timer_group_alloc(grp_a, count_callback, &count_a);
+    lf_timer_t tim_b = lf_timer_group_alloc(grp_b, count_callback, &count_b);
+    EXPECT(tim_a != LF_TIMER_NULL && tim_b != LF_TIMER_NULL);
+    EXPECT(lf_timer_group_set(grp_a, tim_a, 10));
+    EXPECT(lf_timer_group_set(grp_b, tim_b, 10));
+
+    lf_timer_group_tick_set(grp_a, 10);
+    lf_timer_group_expire(grp_a);
+    lf_timer_group_expire(grp_b);
+    EXPECT(count_a == 1 && count_b == 0);
+    EXPECT(lf_timer_group_tick_get(grp_b) == 0);
+
+    lf_timer_group_tick_set(grp_b, 10);
+    lf_timer_group_expire(grp_b);
+    EXPECT(count_a == 1 && count_b == 1);
+
+    lf_timer_group_free(grp_a, tim_a);
+    lf_timer_group_free(grp_b, tim_b);
+    lf_timer_group_destroy(grp_a);
+    lf_timer_group_destroy(grp_b);
+}
+
+/* Periodic timers must be re-armed whichever way their bitmap word is
+ * scanned: sparse, dense (at least 8 active timers in a word) or as a whole
+ * busy segment (1024 timers)
+ */
+static void test_periodic_many(uint32_t ntimers)
+{
+    static lf_timer_t tims[1024];
+    static uint32_t counts[1024];
+    lf_timer_group_t *grp = lf_timer_group_create();
+    EXPECT(grp != NULL);
+    for (uint32_t i = 0; i < ntimers; i++) {
+        counts[i] = 0;
+        tims[i] = lf_timer_group_alloc(grp, count_callback, &counts[i]);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        EXPECT(lf_timer_group_set_periodic(grp, tims[i], 10, 10));
+    }
+    for (lf_tick_t tick = 10; tick <= 50; tick += 10) {
+        lf_timer_group_tick_set(grp, tick);
+        lf_timer_group_expire(grp);
+        for (uint32_t i = 0; i < ntimers; i++)
+            EXPECT(counts[i] == tick / 10);
+    }
+    for (uint32_t i = 0; i < ntimers; i++) {
+        EXPECT(lf_timer_group_cancel(grp, tims[i]));
+        lf_timer_group_free(grp, tims[i]);
+    }
+    lf_timer_group_destroy(grp);
+}
+
+/* A busy segment is scanned as a whole, and so is a dense bitmap word: the
+ * timers that expired or were cancelled must leave the bitmaps all the same,
+ * and come back to them when set again
+ */
+static void test_busy_segment(void)
+{
+    static lf_timer_t tims[1024];
+    static uint32_t counts[1024];
+    lf_timer_group_t *grp = lf_timer_group_create();
+    EXPECT(grp != NULL);
+    for (uint32_t i = 0; i < 1024; i++) {
+        counts[i] = 0;
+        tims[i] = lf_timer_group_alloc(grp, count_callback, &counts[i]);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        EXPECT(lf_timer_group_set(grp, tims[i], 10));
+    }
+    lf_timer_group_tick_set(grp, 10);
+    lf_timer_group_expire(grp);
+    for (uint32_t i = 0; i < 1024; i++)
+        EXPECT(counts[i] == 1);
+
+    /* Every third timer again, the others stay idle */
+    for (uint32_t i = 0; i < 1024; i += 3)
+        EXPECT(lf_timer_group_set(grp, tims[i], 20));
+    lf_timer_group_tick_set(grp, 20);
+    lf_timer_group_expire(grp);
+    for (uint32_t i = 0; i < 1024; i++)
+        EXPECT(counts[i] == (i % 3 == 0 ? 2 : 1));
+
+    /* All of them, cancelled but a few */
+    for (uint32_t i = 0; i < 1024; i++)
+        EXPECT(lf_timer_group_set(grp, tims[i], 30));
+    for (uint32_t i = 0; i < 1024; i++) {
+        if (i % 100 != 0)
+            EXPECT(lf_timer_group_cancel(grp, tims[i]));
+    }
+    lf_timer_group_tick_set(grp, 30);
+    lf_timer_group_expire(grp);
+    for (uint32_t i = 0; i < 1024; i++)
+        EXPECT(counts[i] == (i % 3 == 0 ? 2 : 1) + (i % 100 == 0));
+
+    for (uint32_t i = 0; i < 1024; i++)
+        lf_timer_group_free(grp, tims[i]);
+    lf_timer_group_destroy(grp);
+}
+
+static void test_periodic(void)
+{
+    for (int impl = LF_TIMER_SCAN_SCALAR; impl <= LF_TIMER_SCAN_AVX512; impl++) {
+        if (!lf_timer_scan_select(impl))
+            continue;
+        test_periodic_many(4);
+        test_periodic_many(16);
+        test_periodic_many(1024);
+        test_busy_segment();
+    }
+    lf_timer_scan_select(LF_TIMER_SCAN_AUTO);
+
+    lf_timer_group_t *grp = lf_timer_group_create();
+    EXPECT(grp != NULL);
+    uint32_t count = 0;
+    lf_timer_t tim = lf_timer_group_alloc(grp, count_callback, &count);
+    EXPECT(tim != LF_TIMER_NULL);
+    EXPECT(!lf_timer_group_set_periodic(grp, tim, 10, 0));
+    EXPECT(lf_timer_group_set_periodic(grp, tim, 10, 5));
+    EXPECT(!lf_timer_group_set(grp, tim, 10));
+
+    static const struct {
+        lf_tick_t tick;
+        uint32_t count;
+    } steps[] = {
+        {10, 1}, {14, 1}, {15, 2}, {31, 3}, /* 20, 25 and 30 skipped */
+        {34, 3}, {35, 4},
+    };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        lf_timer_group_tick_set(grp, steps[i].tick);
+        lf_timer_group_expire(grp);
+        EXPECT(count == steps[i].count);
+    }
+    EXPECT(lf_timer_group_cancel(grp, tim));
+    lf_timer_group_tick_set(grp, 100);
+    lf_timer_group_expire(grp);
+    EXPECT(count == 4);
+
+    /* Set again as a one-shot timer */
+    EXPECT(lf_timer_group_set(grp, tim, 101));
+    lf_timer_group_tick_set(grp, 200);
+    lf_timer_group_expire(grp);
+    EXPECT(count == 5);
+    EXPECT(!lf_timer_group_cancel(grp, tim));
+
+    /* Batch set, skipping the timer already active */
+    uint32_t counts[3] = {0, 0, 0};
+    lf_timer_t tims[3];
+    for (int i = 0; i < 3; i++) {
+        tims[i] = lf_timer_group_alloc(grp, count_callback, &counts[i]);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+    }
+    EXPECT(lf_timer_group_set(grp, tims[2], 300));
+    lf_tick_t tmos[3] = {220, 210, 230};
+    EXPECT(lf_timer_group_set_batch(grp, tims, tmos, 3) == 2);
+    lf_timer_group_tick_set(grp, 210);
+    lf_timer_group_expire(grp);
+    EXPECT(counts[0] == 0 && counts[1] == 1 && counts[2] == 0);
+    lf_timer_group_tick_set(grp, 300);
+    lf_timer_group_expire(grp);
+    EXPECT(counts[0] == 1 && counts[1] == 1 && counts[2] == 1);
+
+    for (int i = 0; i < 3; i++)
+        lf_timer_group_free(grp, tims[i]);
+    lf_timer_group_free(grp, tim);
+    lf_timer_group_destroy(grp);
+}
+
+static void fired_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    (void) tim;
+    (void) tmo;
+    __atomic_store_n((lf_tick_t *) arg, lf_timer_clock_now(), __ATOMIC_RELEASE);
+}
+
+/* Wait up to 1s for a driven timer to fire */
+static lf_tick_t wait_fired(lf_tick_t *fired)
+{
+    for (int i = 0; i < 1000; i++) {
+        lf_tick_t t = __atomic_load_n(fired, __ATOMIC_ACQUIRE);
+        if (t != 0)
+            return t;
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    return 0;
+}
+
+static void test_driver(void)
+{
+    lf_timer_group_t *grp = lf_timer_group_create();
+    EXPECT(grp != NULL);
+    lf_tick_t fired_a = 0, fired_b = 0;
+    lf_timer_t tim_a = lf_timer_group_alloc(grp, fired_callback, &fired_a);
+    lf_timer_t tim_b = lf_timer_group_alloc(grp, fired_callback, &fired_b);
+    EXPECT(tim_a != LF_TIMER_NULL && tim_b != LF_TIMER_NULL);
+    EXPECT(lf_timer_group_driver_start(grp));
+    EXPECT(!lf_timer_group_driver_start(grp));
+
+    /* The driver sleeps until tim_a, tim_b must wake it up early */
+    lf_tick_t tmo_a = lf_timer_clock_now() + 10000000000;
+    EXPECT(lf_timer_group_set(grp, tim_a, tmo_a));
+    nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    lf_tick_t tmo_b = lf_timer_clock_now() + 2000000;
+    EXPECT(lf_timer_group_set(grp, tim_b, tmo_b));
+    lf_tick_t fired = wait_fired(&fired_b);
+    EXPECT(fired >= tmo_b);
+    printf("driver: timer fired %" PRIu64 "ns late\n", fired - tmo_b);
+    EXPECT(fired_a == 0);
+    EXPECT(lf_timer_group_cancel(grp, tim_a));
+
+    lf_timer_group_driver_stop(grp);
+    lf_timer_group_free(grp, tim_a);
+    lf_timer_group_free(grp, tim_b);
+    lf_timer_group_destroy(grp);
+}
+
+static void atomic_count_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    (void) tim;
+    (void) tmo;
+    __atomic_fetch_add((uint32_t *) arg, 1, __ATOMIC_RELAXED);
+}
+
+#define DISPATCH_TIMERS 1000
+
+static void test_dispatch(void)
+{
+    lf_timer_group_t *grp = lf_timer_group_create();
+    EXPECT(grp != NULL);
+    lf_timer_dispatch_stats_t stats;
+    EXPECT(!lf_timer_group_dispatch_stats(grp, &stats));
+    EXPECT(!lf_timer_group_dispatch_start(grp, 2, 100));
+    EXPECT(lf_timer_group_dispatch_start(grp, 2, 256));
+
+    /* More timers than queue cells, the scan invokes the overflow */
+    static lf_timer_t tims[DISPATCH_TIMERS];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < DISPATCH_TIMERS; i++) {
+        tims[i] = lf_timer_group_alloc(grp, atomic_count_callback, &count);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        EXPECT(lf_timer_group_set(grp, tims[i], 1));
+    }
+    lf_timer_group_tick_set(grp, 1);
+    lf_timer_group_expire(grp);
+    for (int i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&count, __ATOMIC_RELAXED) == DISPATCH_TIMERS)
+            break;
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    EXPECT(count == DISPATCH_TIMERS);
+    EXPECT(lf_timer_group_dispatch_stats(grp, &stats));
+    EXPECT(stats.count + stats.inline_count == DISPATCH_TIMERS);
+    printf("dispatch: %" PRIu64 " dispatched (avg %" PRIu64 "ns, max %" PRIu64
+           "ns), %" PRIu64 " inline\n",
+           stats.count, stats.count ? stats.total_ns / stats.count : 0,
+           stats.max_ns, stats.inline_count);
+
+    lf_timer_group_dispatch_stop(grp);
+    for (uint32_t i = 0; i < DISPATCH_TIMERS; i++)
+        lf_timer_group_free(grp, tims[i]);
+    lf_timer_group_destroy(grp);
+}
+
 int main(void)
 {
     lf_tick_t exp_a = LF_TIMER_TICK_INVALID;
@@ -49,6 +423,14 @@ int main(void)
     lf_timer_tick_set(3);
     lf_timer_expire();
     EXPECT(exp_a == 1);
+
+    for (int impl = LF_TIMER_SCAN_SCALAR; impl <= LF_TIMER_SCAN_AVX512; impl++) {
+        if (lf_timer_scan_select(impl))
+            test_many_timers(lf_timer_expire);
+    }
+    lf_timer_scan_select(LF_TIMER_SCAN_AUTO);
+    test_many_timers(lf_timer_expire_parallel);
+    EXPECT(exp_a == 1);
     EXPECT(!lf_timer_reset(tim_a, UINT64_C(0xFFFFFFFFFFFFFFFE)));
     EXPECT(lf_timer_set(tim_a, UINT64_C(0xFFFFFFFFFFFFFFFE)));
     EXPECT(lf_timer_reset(tim_a, UINT64_C(0xFFFFFFFFFFFFFFFE)));
@@ -62,6 +444,12 @@ int main(void)
 
     lf_timer_free(tim_a);
 
+    test_groups();
+    test_expire_parallel();
+    test_periodic();
+    test_driver();
+    test_dispatch();
+
     printf("timer tests complete\n");
     return 0;
 }
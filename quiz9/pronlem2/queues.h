@@ -45,6 +45,7 @@ typedef enum {
     QueueResult_Full,
     QueueResult_Empty,
     QueueResult_Contention,
+    QueueResult_Timeout,
 
     QueueResult_Error = 128,
     QueueResult_Error_Too_Small,
@@ -52,11 +53,268 @@ typedef enum {
     QueueResult_Error_Not_Pow2,
     QueueResult_Error_Not_Aligned_16_Bytes,
     QueueResult_Error_Null_Bytes,
-    QueueResult_Error_Bytes_Smaller_Than_Needed
+    QueueResult_Error_Bytes_Smaller_Than_Needed,
+    QueueResult_Error_Out_Of_Memory,
+    QueueResult_Error_Too_Many_Threads,
+    QueueResult_Error_Not_Aligned_Cacheline
 } QueueResult_t;
+
+// Cell of the masked position index with QUEUE_CELL_SHUFFLE. The cells are
+// seen as a matrix of 1 << lines_bits cache lines of 1 << line_bits cells,
+// walked column by column, so that consecutive positions land on different
+// cache lines. line_bits 0 (one cell per line) keeps the identity.
+static inline size_t queue_cell_shuffle(size_t index,
+                                        unsigned line_bits,
+                                        unsigned lines_bits)
+{
+    if (!line_bits) {
+        return index;
+    }
+
+    size_t line = index & ((((size_t) 1) << lines_bits) - 1);
+
+    return (line << line_bits) | (index >> lines_bits);
+}
+
+// Bits for queue_cell_shuffle(): the cells of cell_bytes fully held by a
+// cache line, rounded down to a power of 2, and the cache lines needed
+static inline void queue_cell_shuffle_setup(size_t cell_bytes,
+                                            size_t cell_count,
+                                            unsigned *line_bits,
+                                            unsigned *lines_bits)
+{
+    size_t per_line = QUEUE_CACHELINE_BYTES / cell_bytes;
+    unsigned count_bits = 0;
+
+    *line_bits = 0;
+
+    while ((((size_t) 2) << *line_bits) <= per_line) {
+        (*line_bits)++;
+    }
+
+    while ((((size_t) 1) << count_bits) < cell_count) {
+        count_bits++;
+    }
+
+    // Fewer cells than a cache line holds, nothing to spread
+    if (count_bits <= *line_bits) {
+        *line_bits = 0;
+    }
+
+    *lines_bits = count_bits - *line_bits;
+}
 #endif
 // -----------------------------------------------------------------------------
 
+// QUEUE_BLOCKING adds enqueue_wait/dequeue_wait functions that park on a
+// futex while the queue is full/empty. Every successful operation then also
+// checks for parked threads to wake up, the system call is only made if
+// there are some.
+
+#if defined(QUEUE_BLOCKING) && !defined(QUEUE_BLOCKING_COMMON_DEFINED)
+
+#define QUEUE_BLOCKING_COMMON_DEFINED
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline void queue_notify(atomic_uint *waiters,
+                                atomic_uint *event,
+                                size_t count)
+{
+    // Our update of the cells must be visible before we check for waiters
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(waiters, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(event, 1, QUEUE_ORDER_RELEASE);
+
+        syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE,
+                count < INT_MAX ? (int) count : INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// Register as waiter, return the event count to wait on
+static inline unsigned queue_wait_prepare(atomic_uint *waiters,
+                                          atomic_uint *event)
+{
+    atomic_fetch_add_explicit(waiters, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_load_explicit(event, QUEUE_ORDER_ACQUIRE);
+}
+
+// Park until the event count changes or the CLOCK_MONOTONIC deadline
+// passes (NULL for no deadline)
+static inline void queue_wait(atomic_uint *waiters,
+                              atomic_uint *event,
+                              unsigned seen,
+                              struct timespec const *deadline)
+{
+    syscall(SYS_futex, event, FUTEX_WAIT_BITSET_PRIVATE, seen, deadline, NULL,
+            FUTEX_BITSET_MATCH_ANY);
+
+    atomic_fetch_sub_explicit(waiters, 1, QUEUE_ORDER_RELAXED);
+}
+
+// Deadline timeout_ns from now, NULL if timeout_ns is negative (no timeout)
+static inline struct timespec *queue_deadline(int64_t timeout_ns,
+                                              struct timespec *deadline)
+{
+    if (timeout_ns < 0) {
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    deadline->tv_sec += timeout_ns / 1000000000;
+    deadline->tv_nsec += timeout_ns % 1000000000;
+
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+
+    return deadline;
+}
+
+static inline int queue_deadline_passed(struct timespec const *deadline)
+{
+    if (!deadline) {
+        return 0;
+    }
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+#endif
+
+#if defined(QUEUE_BLOCKING)
+#define QUEUE_NOTIFY_CONSUMERS(q, n) \
+    queue_notify(&(q)->consumers_waiting, &(q)->not_empty, n)
+#define QUEUE_NOTIFY_PRODUCERS(q, n) \
+    queue_notify(&(q)->producers_waiting, &(q)->not_full, n)
+#else
+#define QUEUE_NOTIFY_CONSUMERS(q, n)
+#define QUEUE_NOTIFY_PRODUCERS(q, n)
+#endif
+
+// QUEUE_UNBOUNDED generates a queue that never gets full: a linked list of
+// segments of cell_count cells, each used for a single lap. Segments are
+// appended on demand and freed once consumed, protected by one hazard
+// pointer per thread. No bulk or blocking operations.
+
+#if defined(QUEUE_UNBOUNDED) && defined(QUEUE_BLOCKING)
+#error QUEUE_UNBOUNDED queues cannot be QUEUE_BLOCKING
+#endif
+
+#if defined(QUEUE_UNBOUNDED) && !defined(QUEUE_UNBOUNDED_COMMON_DEFINED)
+
+#define QUEUE_UNBOUNDED_COMMON_DEFINED
+
+#include <stdlib.h>
+#include <threads.h>
+
+#if !defined(QUEUE_HAZARD_THREADS)
+#define QUEUE_HAZARD_THREADS 128
+#endif
+
+typedef struct Queue_Hazard {
+    _Atomic(void *) pointer;
+    uint8_t pad[QUEUE_CACHELINE_BYTES - sizeof(void *)];
+} Queue_Hazard;
+
+static Queue_Hazard queue_hazards[QUEUE_HAZARD_THREADS];
+static atomic_uint_fast64_t
+    queue_hazards_used[(QUEUE_HAZARD_THREADS + 63) / 64];
+static _Thread_local Queue_Hazard *queue_hazard_mine;
+static tss_t queue_hazard_key;
+static once_flag queue_hazard_once = ONCE_FLAG_INIT;
+
+// Give the hazard pointer of an exiting thread back
+static void queue_hazard_release(void *hazard)
+{
+    Queue_Hazard *mine = (Queue_Hazard *) hazard;
+    size_t index = (size_t) (mine - queue_hazards);
+
+    atomic_store_explicit(&mine->pointer, NULL, QUEUE_ORDER_RELEASE);
+    atomic_fetch_and_explicit(&queue_hazards_used[index / 64],
+                              ~(UINT64_C(1) << (index % 64)),
+                              QUEUE_ORDER_RELEASE);
+
+    queue_hazard_mine = NULL;
+}
+
+static void queue_hazard_init(void)
+{
+    tss_create(&queue_hazard_key, queue_hazard_release);
+}
+
+// Hazard pointer of this thread, NULL if QUEUE_HAZARD_THREADS threads
+// already have one
+static inline Queue_Hazard *queue_hazard(void)
+{
+    if (queue_hazard_mine) {
+        return queue_hazard_mine;
+    }
+
+    call_once(&queue_hazard_once, queue_hazard_init);
+
+    for (size_t i = 0; i < QUEUE_HAZARD_THREADS; i++) {
+        uint_fast64_t bit = UINT64_C(1) << (i % 64);
+        uint_fast64_t used = atomic_fetch_or_explicit(
+            &queue_hazards_used[i / 64], bit, QUEUE_ORDER_ACQUIRE);
+
+        if (!(used & bit)) {
+            queue_hazard_mine = &queue_hazards[i];
+            tss_set(queue_hazard_key, queue_hazard_mine);
+            return queue_hazard_mine;
+        }
+    }
+
+    return NULL;
+}
+
+// Protect the pointer read from *source, until the hazard is cleared
+static inline void *queue_hazard_protect(Queue_Hazard *mine,
+                                         _Atomic(void *) *source)
+{
+    void *pointer = atomic_load_explicit(source, QUEUE_ORDER_RELAXED);
+
+    for (;;) {
+        atomic_store_explicit(&mine->pointer, pointer, memory_order_seq_cst);
+
+        void *again = atomic_load_explicit(source, memory_order_seq_cst);
+
+        if (again == pointer) {
+            return pointer;
+        }
+
+        pointer = again;
+    }
+}
+
+static inline int queue_hazard_protected(void *pointer)
+{
+    for (size_t i = 0; i < QUEUE_HAZARD_THREADS; i++) {
+        if (atomic_load_explicit(&queue_hazards[i].pointer,
+                                 memory_order_seq_cst) == pointer) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+
 #if (QUEUE_MP)
 #define QUEUE_P_NAME_FN mp
 #define QUEUE_P_NAME_TYPE Mp
@@ -100,6 +358,33 @@ typedef enum {
 #define QUEUE_STRUCT_C QUEUE_MERGE(QUEUE_STRUCT_B, QUEUE_TYPE)
 #define QUEUE_STRUCT QUEUE_MERGE(Queue_, QUEUE_STRUCT_C)
 #define QUEUE_CELL QUEUE_MERGE(Cell_, QUEUE_STRUCT_C)
+#define QUEUE_SEGMENT QUEUE_MERGE(Segment_, QUEUE_STRUCT_C)
+
+// Cell layout knobs, both against false sharing between threads working on
+// neighbouring positions when several cells fit in a cache line:
+// QUEUE_CELL_PADDED gives every cell its own cache line (the queue memory
+// must then be cacheline aligned), QUEUE_CELL_SHUFFLE keeps the cells
+// packed but maps consecutive positions to different cache lines.
+
+#if defined(QUEUE_CELL_PADDED)
+#define QUEUE_CELL_ALIGN _Alignas(QUEUE_CACHELINE_BYTES)
+#define QUEUE_ALIGN_MASK (QUEUE_CACHELINE_BYTES - 1)
+#else
+#define QUEUE_CELL_ALIGN
+#define QUEUE_ALIGN_MASK 0x0F
+#endif
+
+#if defined(QUEUE_CELL_SHUFFLE)
+#define QUEUE_CELL_INDEX(q, pos)                                 \
+    queue_cell_shuffle((pos) & (q)->cell_mask, (q)->line_bits, \
+                       (q)->lines_bits)
+#define QUEUE_CELL_SETUP(q, cell_count)                                 \
+    queue_cell_shuffle_setup(sizeof(QUEUE_CELL), cell_count, &(q)->line_bits, \
+                             &(q)->lines_bits)
+#else
+#define QUEUE_CELL_INDEX(q, pos) ((pos) & (q)->cell_mask)
+#define QUEUE_CELL_SETUP(q, cell_count)
+#endif
 
 // -----------------------------------------------------------------------------
 
@@ -115,6 +400,41 @@ QueueResult_t QUEUE_FN(try_dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data);
 QueueResult_t QUEUE_FN(enqueue)(QUEUE_STRUCT *queue, QUEUE_TYPE const *data);
 QueueResult_t QUEUE_FN(dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data);
 
+#if defined(QUEUE_UNBOUNDED)
+// Free the segments of an unbounded queue, no thread may use it anymore
+void QUEUE_FN(destroy_queue)(QUEUE_STRUCT *queue);
+#else
+// Bulk versions move all count elements or none, claiming their cells with a
+// single update of the index. Cells still being released by the other side
+// are waited for.
+QueueResult_t QUEUE_FN(try_enqueue_bulk)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE const *data,
+                                         size_t count);
+QueueResult_t QUEUE_FN(try_dequeue_bulk)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE *data,
+                                         size_t count);
+QueueResult_t QUEUE_FN(enqueue_bulk)(QUEUE_STRUCT *queue,
+                                     QUEUE_TYPE const *data,
+                                     size_t count);
+QueueResult_t QUEUE_FN(dequeue_bulk)(QUEUE_STRUCT *queue,
+                                     QUEUE_TYPE *data,
+                                     size_t count);
+#endif
+
+#if defined(QUEUE_BLOCKING)
+// Wait while the queue is full/empty. The _wait_for versions give up after
+// timeout_ns nanoseconds (no timeout if negative) with QueueResult_Timeout.
+QueueResult_t QUEUE_FN(enqueue_wait)(QUEUE_STRUCT *queue,
+                                     QUEUE_TYPE const *data);
+QueueResult_t QUEUE_FN(dequeue_wait)(QUEUE_STRUCT *queue, QUEUE_TYPE *data);
+QueueResult_t QUEUE_FN(enqueue_wait_for)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE const *data,
+                                         int64_t timeout_ns);
+QueueResult_t QUEUE_FN(dequeue_wait_for)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE *data,
+                                         int64_t timeout_ns);
+#endif
+
 // -----------------------------------------------------------------------------
 
 #if defined(QUEUE_IMPLEMENTATION)
@@ -122,10 +442,11 @@ QueueResult_t QUEUE_FN(dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data);
 #undef QUEUE_IMPLEMENTATION
 
 typedef struct QUEUE_CELL {
-    QUEUE_ATOMIC_SIZE_T sequence;
+    QUEUE_CELL_ALIGN QUEUE_ATOMIC_SIZE_T sequence;
     QUEUE_TYPE data;
 } QUEUE_CELL;
 
+#if !defined(QUEUE_UNBOUNDED)
 typedef struct QUEUE_STRUCT {
     uint8_t pad0[QUEUE_CACHELINE_BYTES];
 
@@ -136,7 +457,26 @@ typedef struct QUEUE_STRUCT {
     uint8_t pad3[QUEUE_CACHELINE_BYTES - sizeof(QUEUE_C_TYPE)];
 
     size_t cell_mask;
-    uint8_t pad4[QUEUE_CACHELINE_BYTES - sizeof(size_t)];
+    unsigned line_bits; // QUEUE_CELL_SHUFFLE only
+    unsigned lines_bits;
+    uint8_t pad4[QUEUE_CACHELINE_BYTES - sizeof(size_t) - 2 * sizeof(unsigned)];
+
+#if defined(QUEUE_BLOCKING)
+    // Futex event counts, bumped when waiters need a wake up. Every
+    // successful operation reads a waiter count, so it does not share a line
+    // with the event count that a wake up writes.
+    atomic_uint not_empty;
+    uint8_t pad5[QUEUE_CACHELINE_BYTES - sizeof(atomic_uint)];
+
+    atomic_uint consumers_waiting;
+    uint8_t pad6[QUEUE_CACHELINE_BYTES - sizeof(atomic_uint)];
+
+    atomic_uint not_full;
+    uint8_t pad7[QUEUE_CACHELINE_BYTES - sizeof(atomic_uint)];
+
+    atomic_uint producers_waiting;
+    uint8_t pad8[QUEUE_CACHELINE_BYTES - sizeof(atomic_uint)];
+#endif
 
     QUEUE_CELL cells[];
 } QUEUE_STRUCT;
@@ -179,14 +519,21 @@ QueueResult_t QUEUE_FN(make_queue)(size_t cell_count,
         if (queue_value & 0x0F) {
             return QueueResult_Error_Not_Aligned_16_Bytes;
         }
+
+        if (queue_value & QUEUE_ALIGN_MASK) {
+            return QueueResult_Error_Not_Aligned_Cacheline;
+        }
     }
 
     memset(queue, 0, bytes_local);
 
     queue->cell_mask = cell_count - 1;
 
+    QUEUE_CELL_SETUP(queue, cell_count);
+
     for (size_t i = 0; i < cell_count; i++) {
-        QUEUE_ATOMIC_STORE(&queue->cells[i].sequence, i, QUEUE_ORDER_RELAXED);
+        QUEUE_ATOMIC_STORE(&queue->cells[QUEUE_CELL_INDEX(queue, i)].sequence,
+                           i, QUEUE_ORDER_RELAXED);
     }
 
     QUEUE_P_SETUP(queue->enqueue_index, 0, QUEUE_ORDER_RELAXED);
@@ -199,7 +546,7 @@ QueueResult_t QUEUE_FN(try_enqueue)(QUEUE_STRUCT *queue, QUEUE_TYPE const *data)
 {
     size_t pos = QUEUE_P_LOAD(queue->enqueue_index, QUEUE_ORDER_RELAXED);
 
-    QUEUE_CELL *cell = &queue->cells[pos & queue->cell_mask];
+    QUEUE_CELL *cell = &queue->cells[QUEUE_CELL_INDEX(queue, pos)];
 
     size_t sequence = QUEUE_ATOMIC_LOAD(&cell->sequence, QUEUE_ORDER_ACQUIRE);
 
@@ -213,6 +560,8 @@ QueueResult_t QUEUE_FN(try_enqueue)(QUEUE_STRUCT *queue, QUEUE_TYPE const *data)
 
             QUEUE_ATOMIC_STORE(&cell->sequence, pos + 1, QUEUE_ORDER_RELEASE);
 
+            QUEUE_NOTIFY_CONSUMERS(queue, 1);
+
             return QueueResult_Ok;
         }
     }
@@ -228,7 +577,7 @@ QueueResult_t QUEUE_FN(try_dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
 {
     size_t pos = QUEUE_C_LOAD(queue->dequeue_index, QUEUE_ORDER_RELAXED);
 
-    QUEUE_CELL *cell = &queue->cells[pos & queue->cell_mask];
+    QUEUE_CELL *cell = &queue->cells[QUEUE_CELL_INDEX(queue, pos)];
 
     size_t sequence = QUEUE_ATOMIC_LOAD(&cell->sequence, QUEUE_ORDER_ACQUIRE);
 
@@ -243,6 +592,8 @@ QueueResult_t QUEUE_FN(try_dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
             QUEUE_ATOMIC_STORE(&cell->sequence, pos + queue->cell_mask + 1,
                                QUEUE_ORDER_RELEASE);
 
+            QUEUE_NOTIFY_PRODUCERS(queue, 1);
+
             return QueueResult_Ok;
         }
     }
@@ -254,6 +605,371 @@ QueueResult_t QUEUE_FN(try_dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
     return QueueResult_Contention;
 }
 
+#else
+typedef struct QUEUE_SEGMENT {
+    struct QUEUE_SEGMENT *_Atomic next;
+    size_t base; // Position of the first cell
+    QUEUE_ATOMIC_SIZE_T consumed;
+    uint8_t pad0[QUEUE_CACHELINE_BYTES - 2 * sizeof(size_t) - sizeof(void *)];
+
+    QUEUE_CELL cells[];
+} QUEUE_SEGMENT;
+
+typedef struct QUEUE_STRUCT {
+    uint8_t pad0[QUEUE_CACHELINE_BYTES];
+
+    QUEUE_P_TYPE enqueue_index;
+    uint8_t pad2[QUEUE_CACHELINE_BYTES - sizeof(QUEUE_P_TYPE)];
+
+    QUEUE_C_TYPE dequeue_index;
+    uint8_t pad3[QUEUE_CACHELINE_BYTES - sizeof(QUEUE_C_TYPE)];
+
+    // Oldest segment not completely consumed, newest segment. Segments are
+    // void * for queue_hazard_protect().
+    _Atomic(void *) head;
+    _Atomic(void *) tail;
+    uint8_t pad4[QUEUE_CACHELINE_BYTES - 2 * sizeof(void *)];
+
+    // Oldest segment not freed yet, only touched by the reclaiming thread
+    QUEUE_SEGMENT *retired;
+    size_t cell_mask;
+    unsigned line_bits; // QUEUE_CELL_SHUFFLE only
+    unsigned lines_bits;
+    atomic_flag reclaiming;
+    uint8_t pad5[QUEUE_CACHELINE_BYTES - 2 * sizeof(size_t) -
+                 2 * sizeof(unsigned) - sizeof(atomic_flag)];
+} QUEUE_STRUCT;
+
+static QUEUE_SEGMENT *QUEUE_FN(new_segment)(QUEUE_STRUCT *queue, size_t base)
+{
+    size_t bytes =
+        sizeof(QUEUE_SEGMENT) + sizeof(QUEUE_CELL) * (queue->cell_mask + 1);
+
+    // aligned_alloc() wants a multiple of the alignment
+    bytes = (bytes + QUEUE_CACHELINE_BYTES - 1) & ~(QUEUE_CACHELINE_BYTES - 1);
+
+    QUEUE_SEGMENT *segment = aligned_alloc(QUEUE_CACHELINE_BYTES, bytes);
+
+    if (!segment) {
+        return NULL;
+    }
+
+    atomic_init(&segment->next, NULL);
+    segment->base = base;
+    atomic_init(&segment->consumed, 0);
+
+    for (size_t i = 0; i <= queue->cell_mask; i++) {
+        QUEUE_ATOMIC_STORE(&segment->cells[QUEUE_CELL_INDEX(queue, i)].sequence,
+                           base + i, QUEUE_ORDER_RELAXED);
+    }
+
+    return segment;
+}
+
+// Segment after this one, appended if needed (NULL if out of memory)
+static QUEUE_SEGMENT *QUEUE_FN(next_segment)(QUEUE_STRUCT *queue,
+                                             QUEUE_SEGMENT *segment)
+{
+    QUEUE_SEGMENT *next =
+        QUEUE_ATOMIC_LOAD(&segment->next, QUEUE_ORDER_ACQUIRE);
+
+    if (next) {
+        return next;
+    }
+
+    QUEUE_SEGMENT *fresh = QUEUE_FN(new_segment)(
+        queue, segment->base + queue->cell_mask + 1);
+
+    if (!fresh) {
+        return NULL;
+    }
+
+    if (atomic_compare_exchange_strong_explicit(&segment->next, &next, fresh,
+                                                QUEUE_ORDER_RELEASE,
+                                                QUEUE_ORDER_ACQUIRE)) {
+        return fresh;
+    }
+
+    // Another thread appended first, ours was never visible
+    free(fresh);
+
+    return next;
+}
+
+// Free the consumed segments no thread holds a hazard pointer to, oldest
+// first so that threads may walk from their protected segment onwards.
+// Only one thread reclaims at a time, others leave it to the next call.
+static void QUEUE_FN(reclaim)(QUEUE_STRUCT *queue)
+{
+    if (atomic_flag_test_and_set_explicit(&queue->reclaiming,
+                                          QUEUE_ORDER_ACQUIRE)) {
+        return;
+    }
+
+    QUEUE_SEGMENT *segment = queue->retired;
+
+    // Threads protect the head or the tail, check them before the hazards
+    while (
+        segment != atomic_load_explicit(&queue->head, memory_order_seq_cst) &&
+        segment != atomic_load_explicit(&queue->tail, memory_order_seq_cst) &&
+        !queue_hazard_protected(segment)) {
+        QUEUE_SEGMENT *next =
+            QUEUE_ATOMIC_LOAD(&segment->next, QUEUE_ORDER_ACQUIRE);
+
+        free(segment);
+
+        segment = next;
+    }
+
+    queue->retired = segment;
+
+    atomic_flag_clear_explicit(&queue->reclaiming, QUEUE_ORDER_RELEASE);
+}
+
+// Every cell of the segment has been consumed. Move the head past it, and
+// past the following segments already consumed, unless an older segment
+// is still in use: its last consumer will move the head.
+static void QUEUE_FN(retire)(QUEUE_STRUCT *queue, QUEUE_SEGMENT *segment)
+{
+    for (;;) {
+        void *expected = segment;
+        QUEUE_SEGMENT *next = QUEUE_FN(next_segment)(queue, segment);
+
+        if (!next) {
+            // Out of memory, leave the head where it is
+            return;
+        }
+
+        if (!atomic_compare_exchange_strong_explicit(
+                &queue->head, &expected, next, memory_order_seq_cst,
+                memory_order_seq_cst)) {
+            return;
+        }
+
+        // The tail is never behind the head
+        expected = segment;
+
+        atomic_compare_exchange_strong_explicit(&queue->tail, &expected, next,
+                                                memory_order_seq_cst,
+                                                memory_order_seq_cst);
+
+        segment = next;
+
+        if (atomic_load_explicit(&segment->consumed, memory_order_seq_cst) !=
+            queue->cell_mask + 1) {
+            return;
+        }
+    }
+}
+
+QueueResult_t QUEUE_FN(make_queue)(size_t cell_count,
+                                   QUEUE_STRUCT *queue,
+                                   size_t *bytes)
+{
+    if (!bytes) {
+        return QueueResult_Error_Null_Bytes;
+    }
+
+    if (cell_count < 2) {
+        return QueueResult_Error_Too_Small;
+    }
+
+    if (cell_count > QUEUE_TOO_BIG) {
+        return QueueResult_Error_Too_Big;
+    }
+
+    if (cell_count & (cell_count - 1)) {
+        return QueueResult_Error_Not_Pow2;
+    }
+
+    size_t bytes_local = sizeof(QUEUE_STRUCT);
+
+    if (!queue) {
+        *bytes = bytes_local;
+        return QueueResult_Ok;
+    }
+
+    if (*bytes < bytes_local) {
+        return QueueResult_Error_Bytes_Smaller_Than_Needed;
+    }
+
+    {
+        intptr_t queue_value = (intptr_t) queue;
+
+        if (queue_value & 0x0F) {
+            return QueueResult_Error_Not_Aligned_16_Bytes;
+        }
+
+        if (queue_value & QUEUE_ALIGN_MASK) {
+            return QueueResult_Error_Not_Aligned_Cacheline;
+        }
+    }
+
+    memset(queue, 0, bytes_local);
+
+    queue->cell_mask = cell_count - 1;
+
+    QUEUE_CELL_SETUP(queue, cell_count);
+
+    QUEUE_SEGMENT *segment = QUEUE_FN(new_segment)(queue, 0);
+
+    if (!segment) {
+        return QueueResult_Error_Out_Of_Memory;
+    }
+
+    atomic_init(&queue->head, segment);
+    atomic_init(&queue->tail, segment);
+    queue->retired = segment;
+    atomic_flag_clear(&queue->reclaiming);
+
+    QUEUE_P_SETUP(queue->enqueue_index, 0, QUEUE_ORDER_RELAXED);
+    QUEUE_C_SETUP(queue->dequeue_index, 0, QUEUE_ORDER_RELAXED);
+
+    return QueueResult_Ok;
+}
+
+void QUEUE_FN(destroy_queue)(QUEUE_STRUCT *queue)
+{
+    QUEUE_SEGMENT *segment = queue->retired;
+
+    while (segment) {
+        QUEUE_SEGMENT *next =
+            QUEUE_ATOMIC_LOAD(&segment->next, QUEUE_ORDER_RELAXED);
+
+        free(segment);
+
+        segment = next;
+    }
+
+    queue->retired = NULL;
+}
+
+QueueResult_t QUEUE_FN(try_enqueue)(QUEUE_STRUCT *queue, QUEUE_TYPE const *data)
+{
+    Queue_Hazard *mine = queue_hazard();
+
+    if (!mine) {
+        return QueueResult_Error_Too_Many_Threads;
+    }
+
+    size_t pos = QUEUE_P_LOAD(queue->enqueue_index, QUEUE_ORDER_RELAXED);
+
+    QUEUE_SEGMENT *tail = queue_hazard_protect(mine, &queue->tail);
+    QUEUE_SEGMENT *segment = tail;
+
+    QueueResult_t result = QueueResult_Contention;
+
+    while (segment && segment->base + queue->cell_mask < pos) {
+        segment = QUEUE_FN(next_segment)(queue, segment);
+    }
+
+    if (!segment) {
+        result = QueueResult_Error_Out_Of_Memory;
+    } else if (segment->base <= pos) {
+        if (segment != tail) {
+            void *expected = tail;
+
+            atomic_compare_exchange_strong_explicit(
+                &queue->tail, &expected, segment, QUEUE_ORDER_RELEASE,
+                QUEUE_ORDER_RELAXED);
+        }
+
+        QUEUE_CELL *cell = &segment->cells[QUEUE_CELL_INDEX(queue, pos)];
+
+        size_t sequence =
+            QUEUE_ATOMIC_LOAD(&cell->sequence, QUEUE_ORDER_ACQUIRE);
+
+        if (sequence == pos) {
+            QUEUE_P_IF_CAS(queue->enqueue_index, pos, pos + 1,
+                           QUEUE_ORDER_RELAXED, QUEUE_ORDER_RELAXED)
+            {
+                cell->data = *data;
+
+                QUEUE_ATOMIC_STORE(&cell->sequence, pos + 1,
+                                   QUEUE_ORDER_RELEASE);
+
+                result = QueueResult_Ok;
+            }
+        }
+    }
+    // Else our position is stale, the tail already moved past it
+
+    atomic_store_explicit(&mine->pointer, NULL, QUEUE_ORDER_RELEASE);
+
+    return result;
+}
+
+QueueResult_t QUEUE_FN(try_dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
+{
+    Queue_Hazard *mine = queue_hazard();
+
+    if (!mine) {
+        return QueueResult_Error_Too_Many_Threads;
+    }
+
+    size_t pos = QUEUE_C_LOAD(queue->dequeue_index, QUEUE_ORDER_RELAXED);
+
+    QUEUE_SEGMENT *segment = queue_hazard_protect(mine, &queue->head);
+
+    QueueResult_t result = QueueResult_Contention;
+
+    while (segment && segment->base + queue->cell_mask < pos) {
+        segment = QUEUE_ATOMIC_LOAD(&segment->next, QUEUE_ORDER_ACQUIRE);
+    }
+
+    QUEUE_SEGMENT *consumed = NULL;
+
+    if (!segment) {
+        // No segment appended for our position yet
+        result = QueueResult_Empty;
+    } else if (segment->base <= pos) {
+        QUEUE_CELL *cell = &segment->cells[QUEUE_CELL_INDEX(queue, pos)];
+
+        size_t sequence =
+            QUEUE_ATOMIC_LOAD(&cell->sequence, QUEUE_ORDER_ACQUIRE);
+
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (pos + 1);
+
+        if (!difference) {
+            QUEUE_C_IF_CAS(queue->dequeue_index, pos, pos + 1,
+                           QUEUE_ORDER_RELAXED, QUEUE_ORDER_RELAXED)
+            {
+                *data = cell->data;
+
+                QUEUE_ATOMIC_STORE(&cell->sequence,
+                                   pos + queue->cell_mask + 1,
+                                   QUEUE_ORDER_RELEASE);
+
+                if (atomic_fetch_add_explicit(&segment->consumed, 1,
+                                              memory_order_seq_cst) ==
+                    queue->cell_mask) {
+                    consumed = segment;
+                }
+
+                result = QueueResult_Ok;
+            }
+        }
+
+        if (difference < 0) {
+            result = QueueResult_Empty;
+        }
+    }
+    // Else our position is stale, the head already moved past it
+
+    if (consumed) {
+        QUEUE_FN(retire)(queue, consumed);
+    }
+
+    atomic_store_explicit(&mine->pointer, NULL, memory_order_seq_cst);
+
+    if (consumed) {
+        QUEUE_FN(reclaim)(queue);
+    }
+
+    return result;
+}
+#endif
+
 QueueResult_t QUEUE_FN(enqueue)(QUEUE_STRUCT *queue, QUEUE_TYPE const *data)
 {
     QueueResult_t result;
@@ -275,11 +991,240 @@ QueueResult_t QUEUE_FN(dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
 
     return result;
 }
+
+#if !defined(QUEUE_UNBOUNDED)
+QueueResult_t QUEUE_FN(try_enqueue_bulk)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE const *data,
+                                         size_t count)
+{
+    if (!count) {
+        return QueueResult_Ok;
+    }
+
+    if (count > queue->cell_mask + 1) {
+        return QueueResult_Error_Too_Big;
+    }
+
+    size_t pos = QUEUE_P_LOAD(queue->enqueue_index, QUEUE_ORDER_RELAXED);
+
+    // The last cell is free for this lap => every cell before it has been
+    // claimed by a consumer
+    size_t last = pos + count - 1;
+
+    QUEUE_CELL *cell = &queue->cells[QUEUE_CELL_INDEX(queue, last)];
+
+    size_t sequence = QUEUE_ATOMIC_LOAD(&cell->sequence, QUEUE_ORDER_ACQUIRE);
+
+    intptr_t difference = (intptr_t) sequence - (intptr_t) last;
+
+    if (!difference) {
+        QUEUE_P_IF_CAS(queue->enqueue_index, pos, pos + count,
+                       QUEUE_ORDER_RELAXED, QUEUE_ORDER_RELAXED)
+        {
+            for (size_t i = 0; i < count; i++) {
+                cell = &queue->cells[QUEUE_CELL_INDEX(queue, pos + i)];
+
+                while (QUEUE_ATOMIC_LOAD(&cell->sequence,
+                                         QUEUE_ORDER_ACQUIRE) != pos + i)
+                    ;
+
+                cell->data = data[i];
+
+                QUEUE_ATOMIC_STORE(&cell->sequence, pos + i + 1,
+                                   QUEUE_ORDER_RELEASE);
+            }
+
+            QUEUE_NOTIFY_CONSUMERS(queue, count);
+
+            return QueueResult_Ok;
+        }
+    }
+
+    if (difference < 0) {
+        return QueueResult_Full;
+    }
+
+    return QueueResult_Contention;
+}
+
+QueueResult_t QUEUE_FN(try_dequeue_bulk)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE *data,
+                                         size_t count)
+{
+    if (!count) {
+        return QueueResult_Ok;
+    }
+
+    if (count > queue->cell_mask + 1) {
+        return QueueResult_Error_Too_Big;
+    }
+
+    size_t pos = QUEUE_C_LOAD(queue->dequeue_index, QUEUE_ORDER_RELAXED);
+
+    // The last cell is full for this lap => every cell before it has been
+    // claimed by a producer
+    size_t last = pos + count - 1;
+
+    QUEUE_CELL *cell = &queue->cells[QUEUE_CELL_INDEX(queue, last)];
+
+    size_t sequence = QUEUE_ATOMIC_LOAD(&cell->sequence, QUEUE_ORDER_ACQUIRE);
+
+    intptr_t difference = (intptr_t) sequence - (intptr_t) (last + 1);
+
+    if (!difference) {
+        QUEUE_C_IF_CAS(queue->dequeue_index, pos, pos + count,
+                       QUEUE_ORDER_RELAXED, QUEUE_ORDER_RELAXED)
+        {
+            for (size_t i = 0; i < count; i++) {
+                cell = &queue->cells[QUEUE_CELL_INDEX(queue, pos + i)];
+
+                while (QUEUE_ATOMIC_LOAD(&cell->sequence,
+                                         QUEUE_ORDER_ACQUIRE) != pos + i + 1)
+                    ;
+
+                data[i] = cell->data;
+
+                QUEUE_ATOMIC_STORE(&cell->sequence,
+                                   pos + i + queue->cell_mask + 1,
+                                   QUEUE_ORDER_RELEASE);
+            }
+
+            QUEUE_NOTIFY_PRODUCERS(queue, count);
+
+            return QueueResult_Ok;
+        }
+    }
+
+    if (difference < 0) {
+        return QueueResult_Empty;
+    }
+
+    return QueueResult_Contention;
+}
+
+QueueResult_t QUEUE_FN(enqueue_bulk)(QUEUE_STRUCT *queue,
+                                     QUEUE_TYPE const *data,
+                                     size_t count)
+{
+    QueueResult_t result;
+
+    do {
+        result = QUEUE_FN(try_enqueue_bulk)(queue, data, count);
+    } while (result == QueueResult_Contention);
+
+    return result;
+}
+
+QueueResult_t QUEUE_FN(dequeue_bulk)(QUEUE_STRUCT *queue,
+                                     QUEUE_TYPE *data,
+                                     size_t count)
+{
+    QueueResult_t result;
+
+    do {
+        result = QUEUE_FN(try_dequeue_bulk)(queue, data, count);
+    } while (result == QueueResult_Contention);
+
+    return result;
+}
+#endif
+
+#if defined(QUEUE_BLOCKING)
+QueueResult_t QUEUE_FN(enqueue_wait_for)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE const *data,
+                                         int64_t timeout_ns)
+{
+    QueueResult_t result = QUEUE_FN(enqueue)(queue, data);
+
+    if (result != QueueResult_Full) {
+        return result;
+    }
+
+    struct timespec storage;
+    struct timespec *deadline = queue_deadline(timeout_ns, &storage);
+
+    for (;;) {
+        // Check again once registered, a consumer may not have seen us yet
+        unsigned seen =
+            queue_wait_prepare(&queue->producers_waiting, &queue->not_full);
+
+        result = QUEUE_FN(enqueue)(queue, data);
+
+        if (result != QueueResult_Full) {
+            atomic_fetch_sub_explicit(&queue->producers_waiting, 1,
+                                      QUEUE_ORDER_RELAXED);
+            return result;
+        }
+
+        queue_wait(&queue->producers_waiting, &queue->not_full, seen,
+                   deadline);
+
+        if (queue_deadline_passed(deadline)) {
+            result = QUEUE_FN(enqueue)(queue, data);
+
+            return result == QueueResult_Full ? QueueResult_Timeout : result;
+        }
+    }
+}
+
+QueueResult_t QUEUE_FN(dequeue_wait_for)(QUEUE_STRUCT *queue,
+                                         QUEUE_TYPE *data,
+                                         int64_t timeout_ns)
+{
+    QueueResult_t result = QUEUE_FN(dequeue)(queue, data);
+
+    if (result != QueueResult_Empty) {
+        return result;
+    }
+
+    struct timespec storage;
+    struct timespec *deadline = queue_deadline(timeout_ns, &storage);
+
+    for (;;) {
+        // Check again once registered, a producer may not have seen us yet
+        unsigned seen =
+            queue_wait_prepare(&queue->consumers_waiting, &queue->not_empty);
+
+        result = QUEUE_FN(dequeue)(queue, data);
+
+        if (result != QueueResult_Empty) {
+            atomic_fetch_sub_explicit(&queue->consumers_waiting, 1,
+                                      QUEUE_ORDER_RELAXED);
+            return result;
+        }
+
+        queue_wait(&queue->consumers_waiting, &queue->not_empty, seen,
+                   deadline);
+
+        if (queue_deadline_passed(deadline)) {
+            result = QUEUE_FN(dequeue)(queue, data);
+
+            return result == QueueResult_Empty ? QueueResult_Timeout : result;
+        }
+    }
+}
+
+QueueResult_t QUEUE_FN(enqueue_wait)(QUEUE_STRUCT *queue,
+                                     QUEUE_TYPE const *data)
+{
+    return QUEUE_FN(enqueue_wait_for)(queue, data, -1);
+}
+
+QueueResult_t QUEUE_FN(dequeue_wait)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
+{
+    return QUEUE_FN(dequeue_wait_for)(queue, data, -1);
+}
+#endif
 #endif
 
 #undef QUEUE_TYPE
 #undef QUEUE_MP
 #undef QUEUE_MC
+#undef QUEUE_BLOCKING
+#undef QUEUE_UNBOUNDED
+
+#undef QUEUE_NOTIFY_CONSUMERS
+#undef QUEUE_NOTIFY_PRODUCERS
 
 #undef QUEUE_P_NAME_FN
 #undef QUEUE_P_NAME_TYPE
@@ -302,3 +1247,10 @@ QueueResult_t QUEUE_FN(dequeue)(QUEUE_STRUCT *queue, QUEUE_TYPE *data)
 #undef QUEUE_STRUCT_C
 #undef QUEUE_STRUCT
 #undef QUEUE_CELL
+#undef QUEUE_CELL_ALIGN
+#undef QUEUE_ALIGN_MASK
+#undef QUEUE_CELL_INDEX
+#undef QUEUE_CELL_SETUP
+#undef QUEUE_CELL_PADDED
+#undef QUEUE_CELL_SHUFFLE
+#undef QUEUE_SEGMENT
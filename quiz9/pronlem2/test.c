@@ -1,13 +1,25 @@
 // -----------------------------------------------------------------------------
 
+#define _GNU_SOURCE // CPU_SET() and sched_setaffinity()
+
+#include <errno.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <threads.h> /* C11 */
+#include <time.h>
+#include <unistd.h>
 
 // -----------------------------------------------------------------------------
 
 #define QUEUE_TEST_THREADS_MAX 16
+#define QUEUE_TEST_BATCH 8 // Divides the 10000 elements of each thread
+
+// Items per layout benchmark thread: the expected sum of the items of
+// QUEUE_TEST_THREADS_MAX producers must fit in 64 bits
+#define QUEUE_TEST_LAYOUT_ITEMS_MAX 1000000000
 
 typedef struct Data {
     float a;
@@ -39,6 +51,97 @@ typedef struct Data {
 #define QUEUE_IMPLEMENTATION
 #include "queues.h"
 
+// Blocking versions of the same queues
+
+typedef Data Blocking_Data;
+
+#define QUEUE_MP 0
+#define QUEUE_MC 0
+#define QUEUE_TYPE Blocking_Data
+#define QUEUE_BLOCKING
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 1
+#define QUEUE_MC 0
+#define QUEUE_TYPE Blocking_Data
+#define QUEUE_BLOCKING
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 0
+#define QUEUE_MC 1
+#define QUEUE_TYPE Blocking_Data
+#define QUEUE_BLOCKING
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 1
+#define QUEUE_MC 1
+#define QUEUE_TYPE Blocking_Data
+#define QUEUE_BLOCKING
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+// Unbounded versions of the same queues
+
+typedef Data Unbounded_Data;
+
+#define QUEUE_MP 0
+#define QUEUE_MC 0
+#define QUEUE_TYPE Unbounded_Data
+#define QUEUE_UNBOUNDED
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 1
+#define QUEUE_MC 0
+#define QUEUE_TYPE Unbounded_Data
+#define QUEUE_UNBOUNDED
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 0
+#define QUEUE_MC 1
+#define QUEUE_TYPE Unbounded_Data
+#define QUEUE_UNBOUNDED
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 1
+#define QUEUE_MC 1
+#define QUEUE_TYPE Unbounded_Data
+#define QUEUE_UNBOUNDED
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+// Cell layouts of the same MPMC queue, with elements small enough that
+// several cells share a cache line
+
+typedef uint32_t Packed_Small;
+typedef uint32_t Padded_Small;
+typedef uint32_t Shuffled_Small;
+
+#define QUEUE_MP 1
+#define QUEUE_MC 1
+#define QUEUE_TYPE Packed_Small
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 1
+#define QUEUE_MC 1
+#define QUEUE_TYPE Padded_Small
+#define QUEUE_CELL_PADDED
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
+#define QUEUE_MP 1
+#define QUEUE_MC 1
+#define QUEUE_TYPE Shuffled_Small
+#define QUEUE_CELL_SHUFFLE
+#define QUEUE_IMPLEMENTATION
+#include "queues.h"
+
 #define CAST(x, y) ((x) y)
 
 // -----------------------------------------------------------------------------
@@ -140,6 +243,213 @@ QueueResult_t dequeue(Tag tag, void *q, Data *d)
     return QueueResult_Error;
 }
 
+QueueResult_t enqueue_bulk(Tag tag, void *q, Data const *d, size_t count)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_enqueue_bulk_Data(CAST(Queue_Spsc_Data *, q), d, count);
+    case Mpsc:
+        return mpsc_enqueue_bulk_Data(CAST(Queue_Mpsc_Data *, q), d, count);
+    case Spmc:
+        return spmc_enqueue_bulk_Data(CAST(Queue_Spmc_Data *, q), d, count);
+    case Mpmc:
+        return mpmc_enqueue_bulk_Data(CAST(Queue_Mpmc_Data *, q), d, count);
+    }
+
+    return QueueResult_Error;
+}
+QueueResult_t dequeue_bulk(Tag tag, void *q, Data *d, size_t count)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_dequeue_bulk_Data(CAST(Queue_Spsc_Data *, q), d, count);
+    case Mpsc:
+        return mpsc_dequeue_bulk_Data(CAST(Queue_Mpsc_Data *, q), d, count);
+    case Spmc:
+        return spmc_dequeue_bulk_Data(CAST(Queue_Spmc_Data *, q), d, count);
+    case Mpmc:
+        return mpmc_dequeue_bulk_Data(CAST(Queue_Mpmc_Data *, q), d, count);
+    }
+
+    return QueueResult_Error;
+}
+
+QueueResult_t make_blocking(Tag tag,
+                            size_t cell_count,
+                            void *queue,
+                            size_t *bytes)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_make_queue_Blocking_Data(
+            cell_count, CAST(Queue_Spsc_Blocking_Data *, queue), bytes);
+    case Mpsc:
+        return mpsc_make_queue_Blocking_Data(
+            cell_count, CAST(Queue_Mpsc_Blocking_Data *, queue), bytes);
+    case Spmc:
+        return spmc_make_queue_Blocking_Data(
+            cell_count, CAST(Queue_Spmc_Blocking_Data *, queue), bytes);
+    case Mpmc:
+        return mpmc_make_queue_Blocking_Data(
+            cell_count, CAST(Queue_Mpmc_Blocking_Data *, queue), bytes);
+    }
+
+    return QueueResult_Error;
+}
+QueueResult_t enqueue_wait_for(Tag tag, void *q, Data const *d, int64_t ns)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_enqueue_wait_for_Blocking_Data(
+            CAST(Queue_Spsc_Blocking_Data *, q), d, ns);
+    case Mpsc:
+        return mpsc_enqueue_wait_for_Blocking_Data(
+            CAST(Queue_Mpsc_Blocking_Data *, q), d, ns);
+    case Spmc:
+        return spmc_enqueue_wait_for_Blocking_Data(
+            CAST(Queue_Spmc_Blocking_Data *, q), d, ns);
+    case Mpmc:
+        return mpmc_enqueue_wait_for_Blocking_Data(
+            CAST(Queue_Mpmc_Blocking_Data *, q), d, ns);
+    }
+
+    return QueueResult_Error;
+}
+QueueResult_t dequeue_wait_for(Tag tag, void *q, Data *d, int64_t ns)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_dequeue_wait_for_Blocking_Data(
+            CAST(Queue_Spsc_Blocking_Data *, q), d, ns);
+    case Mpsc:
+        return mpsc_dequeue_wait_for_Blocking_Data(
+            CAST(Queue_Mpsc_Blocking_Data *, q), d, ns);
+    case Spmc:
+        return spmc_dequeue_wait_for_Blocking_Data(
+            CAST(Queue_Spmc_Blocking_Data *, q), d, ns);
+    case Mpmc:
+        return mpmc_dequeue_wait_for_Blocking_Data(
+            CAST(Queue_Mpmc_Blocking_Data *, q), d, ns);
+    }
+
+    return QueueResult_Error;
+}
+
+QueueResult_t make_unbounded(Tag tag,
+                             size_t cell_count,
+                             void *queue,
+                             size_t *bytes)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_make_queue_Unbounded_Data(
+            cell_count, CAST(Queue_Spsc_Unbounded_Data *, queue), bytes);
+    case Mpsc:
+        return mpsc_make_queue_Unbounded_Data(
+            cell_count, CAST(Queue_Mpsc_Unbounded_Data *, queue), bytes);
+    case Spmc:
+        return spmc_make_queue_Unbounded_Data(
+            cell_count, CAST(Queue_Spmc_Unbounded_Data *, queue), bytes);
+    case Mpmc:
+        return mpmc_make_queue_Unbounded_Data(
+            cell_count, CAST(Queue_Mpmc_Unbounded_Data *, queue), bytes);
+    }
+
+    return QueueResult_Error;
+}
+void destroy_unbounded(Tag tag, void *q)
+{
+    switch (tag) {
+    case Spsc:
+        spsc_destroy_queue_Unbounded_Data(CAST(Queue_Spsc_Unbounded_Data *, q));
+        break;
+    case Mpsc:
+        mpsc_destroy_queue_Unbounded_Data(CAST(Queue_Mpsc_Unbounded_Data *, q));
+        break;
+    case Spmc:
+        spmc_destroy_queue_Unbounded_Data(CAST(Queue_Spmc_Unbounded_Data *, q));
+        break;
+    case Mpmc:
+        mpmc_destroy_queue_Unbounded_Data(CAST(Queue_Mpmc_Unbounded_Data *, q));
+        break;
+    }
+}
+QueueResult_t enqueue_unbounded(Tag tag, void *q, Data const *d)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_enqueue_Unbounded_Data(
+            CAST(Queue_Spsc_Unbounded_Data *, q), d);
+    case Mpsc:
+        return mpsc_enqueue_Unbounded_Data(
+            CAST(Queue_Mpsc_Unbounded_Data *, q), d);
+    case Spmc:
+        return spmc_enqueue_Unbounded_Data(
+            CAST(Queue_Spmc_Unbounded_Data *, q), d);
+    case Mpmc:
+        return mpmc_enqueue_Unbounded_Data(
+            CAST(Queue_Mpmc_Unbounded_Data *, q), d);
+    }
+
+    return QueueResult_Error;
+}
+QueueResult_t dequeue_unbounded(Tag tag, void *q, Data *d)
+{
+    switch (tag) {
+    case Spsc:
+        return spsc_dequeue_Unbounded_Data(
+            CAST(Queue_Spsc_Unbounded_Data *, q), d);
+    case Mpsc:
+        return mpsc_dequeue_Unbounded_Data(
+            CAST(Queue_Mpsc_Unbounded_Data *, q), d);
+    case Spmc:
+        return spmc_dequeue_Unbounded_Data(
+            CAST(Queue_Spmc_Unbounded_Data *, q), d);
+    case Mpmc:
+        return mpmc_dequeue_Unbounded_Data(
+            CAST(Queue_Mpmc_Unbounded_Data *, q), d);
+    }
+
+    return QueueResult_Error;
+}
+
+// -----------------------------------------------------------------------------
+
+#define LAYOUT(type)                                                         \
+    QueueResult_t make_##type(size_t cell_count, void *queue, size_t *bytes) \
+    {                                                                        \
+        return mpmc_make_queue_##type(                                       \
+            cell_count, CAST(Queue_Mpmc_##type *, queue), bytes);            \
+    }                                                                        \
+    QueueResult_t enqueue_##type(void *q, uint32_t const *d)                 \
+    {                                                                        \
+        return mpmc_enqueue_##type(CAST(Queue_Mpmc_##type *, q), d);         \
+    }                                                                        \
+    QueueResult_t dequeue_##type(void *q, uint32_t *d)                       \
+    {                                                                        \
+        return mpmc_dequeue_##type(CAST(Queue_Mpmc_##type *, q), d);         \
+    }
+
+LAYOUT(Packed_Small)
+LAYOUT(Padded_Small)
+LAYOUT(Shuffled_Small)
+
+typedef struct Layout {
+    const char *name;
+    QueueResult_t (*make)(size_t, void *, size_t *);
+    QueueResult_t (*enqueue)(void *, uint32_t const *);
+    QueueResult_t (*dequeue)(void *, uint32_t *);
+} Layout;
+
+#define LAYOUT_ENTRY(name, type) \
+    {name, make_##type, enqueue_##type, dequeue_##type}
+
+static const Layout layouts[] = {LAYOUT_ENTRY("packed", Packed_Small),
+                                 LAYOUT_ENTRY("padded", Padded_Small),
+                                 LAYOUT_ENTRY("shuffled", Shuffled_Small)};
+
+#define LAYOUT_COUNT 3
+
 // -----------------------------------------------------------------------------
 
 #define EXPECT(x)      \
@@ -286,9 +596,161 @@ const char *full(Tag tag, unsigned count_in, unsigned count_out)
     return NULL;
 }
 
+const char *bulk(Tag tag, unsigned count_in, unsigned count_out)
+{
+    (void) count_in;
+    (void) count_out;
+
+    size_t bytes = 0;
+    void *q = NULL;
+
+    make(tag, 1 << 8, NULL, &bytes);
+
+    EXPECT(bytes > 0);
+
+    q = malloc(bytes);
+
+    make(tag, 1 << 8, q, &bytes);
+
+    Data in[(1 << 8) + 1] = {{0}};
+    Data out[(1 << 8) + 1] = {{0}};
+
+    for (unsigned i = 0; i < (1 << 8) + 1; i++) {
+        in[i].b = i;
+    }
+
+    EXPECT(enqueue_bulk(tag, q, in, (1 << 8) + 1) ==
+           QueueResult_Error_Too_Big);
+    EXPECT(enqueue_bulk(tag, q, in, 0) == QueueResult_Ok);
+    EXPECT(dequeue_bulk(tag, q, out, 1) == QueueResult_Empty);
+
+    // Several laps, the bulks wrapping around the end of the cells
+    for (unsigned lap = 0; lap < 4; lap++) {
+        EXPECT(enqueue_bulk(tag, q, in, 200) == QueueResult_Ok);
+        EXPECT(enqueue_bulk(tag, q, in + 200, 57) == QueueResult_Full);
+        EXPECT(enqueue_bulk(tag, q, in + 200, 56) == QueueResult_Ok);
+        EXPECT(enqueue(tag, q, in) == QueueResult_Full);
+
+        EXPECT(dequeue_bulk(tag, q, out, 100) == QueueResult_Ok);
+        EXPECT(dequeue_bulk(tag, q, out + 100, 157) == QueueResult_Empty);
+        EXPECT(dequeue_bulk(tag, q, out + 100, 156) == QueueResult_Ok);
+        EXPECT(dequeue(tag, q, out) == QueueResult_Empty);
+
+        for (unsigned i = 0; i < (1 << 8); i++) {
+            EXPECT(out[i].b == i);
+        }
+
+        // Shift the start of the next lap
+        EXPECT(enqueue(tag, q, in) == QueueResult_Ok);
+        EXPECT(dequeue(tag, q, out) == QueueResult_Ok);
+    }
+
+    free(q);
+
+    return NULL;
+}
+
+const char *timeout(Tag tag, unsigned count_in, unsigned count_out)
+{
+    (void) count_in;
+    (void) count_out;
+
+    size_t bytes = 0;
+    void *q = NULL;
+
+    make_blocking(tag, 1 << 8, NULL, &bytes);
+
+    EXPECT(bytes > 0);
+
+    q = malloc(bytes);
+
+    make_blocking(tag, 1 << 8, q, &bytes);
+
+    Data data = {0};
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    EXPECT(dequeue_wait_for(tag, q, &data, 1000000) == QueueResult_Timeout);
+
+    for (unsigned i = 0; i < (1 << 8); i++) {
+        EXPECT(enqueue_wait_for(tag, q, &data, 0) == QueueResult_Ok);
+    }
+
+    EXPECT(enqueue_wait_for(tag, q, &data, 1000000) == QueueResult_Timeout);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    EXPECT((end.tv_sec - start.tv_sec) * 1000000000 +
+               (end.tv_nsec - start.tv_nsec) >=
+           2000000);
+
+    EXPECT(dequeue_wait_for(tag, q, &data, 1000000) == QueueResult_Ok);
+
+    free(q);
+
+    return NULL;
+}
+
+const char *unbounded(Tag tag, unsigned count_in, unsigned count_out)
+{
+    (void) count_in;
+    (void) count_out;
+
+    size_t bytes = 0;
+    void *q = NULL;
+
+    EXPECT(make_unbounded(tag, 4, NULL, &bytes) == QueueResult_Ok);
+
+    EXPECT(bytes > 0);
+
+    q = aligned_alloc(QUEUE_CACHELINE_BYTES, bytes);
+
+    EXPECT(make_unbounded(tag, 4, q, &bytes) == QueueResult_Ok);
+
+    Data data = {0};
+
+    EXPECT(dequeue_unbounded(tag, q, &data) == QueueResult_Empty);
+
+    // Far more elements than cells in a segment, twice
+    for (unsigned round = 0; round < 2; round++) {
+        for (unsigned i = 0; i < 1000; i++) {
+            data.b = i;
+
+            EXPECT(enqueue_unbounded(tag, q, &data) == QueueResult_Ok);
+        }
+
+        for (unsigned i = 0; i < 1000; i++) {
+            EXPECT(dequeue_unbounded(tag, q, &data) == QueueResult_Ok);
+            EXPECT(data.b == i);
+        }
+
+        EXPECT(dequeue_unbounded(tag, q, &data) == QueueResult_Empty);
+    }
+
+    data.b = 1;
+
+    EXPECT(enqueue_unbounded(tag, q, &data) == QueueResult_Ok);
+
+    // Frees the segments still holding elements too
+    destroy_unbounded(tag, q);
+
+    free(q);
+
+    return NULL;
+}
+
+typedef enum Mode {
+    Mode_Single,
+    Mode_Bulk,
+    Mode_Wait,
+    Mode_Unbounded
+} Mode;
+
 typedef struct Thread_Data {
     void *q;
     int multiplier;
+    Mode mode;
     Tag tag;
     atomic_size_t *global_count;
     atomic_size_t *done;
@@ -302,9 +764,40 @@ int thread_in(void *data)
 
     unsigned max = 10000 * info->multiplier;
 
-    for (unsigned j = 0; j < max; j++) {
-        while (enqueue(info->tag, info->q, &item) != QueueResult_Ok)
-            ;
+    Data items[QUEUE_TEST_BATCH];
+
+    for (unsigned i = 0; i < QUEUE_TEST_BATCH; i++) {
+        items[i] = item;
+    }
+
+    for (unsigned j = 0; j < max;) {
+        switch (info->mode) {
+        case Mode_Single:
+            while (enqueue(info->tag, info->q, &item) != QueueResult_Ok)
+                ;
+            j++;
+            break;
+        case Mode_Bulk:
+            while (enqueue_bulk(info->tag, info->q, items, QUEUE_TEST_BATCH) !=
+                   QueueResult_Ok)
+                ;
+            j += QUEUE_TEST_BATCH;
+            break;
+        case Mode_Wait:
+            if (enqueue_wait_for(info->tag, info->q, &item, -1) !=
+                QueueResult_Ok) {
+                j = max;
+            }
+            j++;
+            break;
+        case Mode_Unbounded:
+            if (enqueue_unbounded(info->tag, info->q, &item) !=
+                QueueResult_Ok) {
+                j = max;
+            }
+            j++;
+            break;
+        }
     }
 
     atomic_fetch_sub_explicit(info->done, 1, memory_order_relaxed);
@@ -318,13 +811,38 @@ int thread_out(void *data)
 
     unsigned max = 10000 * info->multiplier;
 
-    for (unsigned j = 0; j < max; j++) {
-        Data item = {0};
-        while (dequeue(info->tag, info->q, &item) != QueueResult_Ok)
-            ;
+    Data items[QUEUE_TEST_BATCH] = {{0}};
+    unsigned count = 1;
+
+    for (unsigned j = 0; j < max; j += count) {
+        switch (info->mode) {
+        case Mode_Single:
+            while (dequeue(info->tag, info->q, items) != QueueResult_Ok)
+                ;
+            break;
+        case Mode_Bulk:
+            count = QUEUE_TEST_BATCH;
+            while (dequeue_bulk(info->tag, info->q, items, count) !=
+                   QueueResult_Ok)
+                ;
+            break;
+        case Mode_Wait:
+            if (dequeue_wait_for(info->tag, info->q, items, -1) !=
+                QueueResult_Ok) {
+                j = max;
+            }
+            break;
+        case Mode_Unbounded:
+            while (dequeue_unbounded(info->tag, info->q, items) !=
+                   QueueResult_Ok)
+                ;
+            break;
+        }
 
-        atomic_fetch_add_explicit(info->global_count, item.b,
-                                  memory_order_relaxed);
+        for (unsigned i = 0; i < count; i++) {
+            atomic_fetch_add_explicit(info->global_count, items[i].b,
+                                      memory_order_relaxed);
+        }
     }
 
     atomic_fetch_sub_explicit(info->done, 1, memory_order_relaxed);
@@ -332,19 +850,26 @@ int thread_out(void *data)
     return 0;
 }
 
-const char *sums10000(Tag tag, unsigned count_in, unsigned count_out)
+const char *sums(Tag tag, unsigned count_in, unsigned count_out, Mode mode)
 {
+    QueueResult_t (*make_mode)(Tag, size_t, void *, size_t *) =
+        mode == Mode_Wait ? make_blocking
+                          : mode == Mode_Unbounded ? make_unbounded : make;
+
+    // Small segments for the unbounded queue, appended and freed often
+    size_t cell_count = mode == Mode_Unbounded ? 16 : 1 << 8;
+
     void *q = NULL;
     {
         size_t bytes = 0;
 
-        make(tag, 1 << 8, NULL, &bytes);
+        make_mode(tag, cell_count, NULL, &bytes);
 
         EXPECT(bytes > 0);
 
-        q = malloc(bytes);
+        q = aligned_alloc(QUEUE_CACHELINE_BYTES, bytes);
 
-        QueueResult_t create = make(tag, 1 << 8, q, &bytes);
+        QueueResult_t create = make_mode(tag, cell_count, q, &bytes);
 
         EXPECT(create == QueueResult_Ok);
     }
@@ -359,9 +884,9 @@ const char *sums10000(Tag tag, unsigned count_in, unsigned count_out)
     int multiplier_in = QUEUE_TEST_THREADS_MAX / count_in;
     int multiplier_out = QUEUE_TEST_THREADS_MAX / count_out;
 
-    Thread_Data data_in = {q, multiplier_in, tag, &global_count,
+    Thread_Data data_in = {q,   multiplier_in, mode, tag, &global_count,
                            &done_in_count};
-    Thread_Data data_out = {q, multiplier_out, tag, &global_count,
+    Thread_Data data_out = {q,   multiplier_out, mode, tag, &global_count,
                             &done_out_count};
 
     for (unsigned i = 0; i < count_in; i++) {
@@ -396,6 +921,79 @@ const char *sums10000(Tag tag, unsigned count_in, unsigned count_out)
 
     EXPECT(atomic_load(&global_count) == expected_count);
 
+    if (mode == Mode_Unbounded) {
+        destroy_unbounded(tag, q);
+    }
+
+    free(q);
+
+    return NULL;
+}
+
+const char *sums10000(Tag tag, unsigned count_in, unsigned count_out)
+{
+    return sums(tag, count_in, count_out, Mode_Single);
+}
+
+const char *sums10000_bulk(Tag tag, unsigned count_in, unsigned count_out)
+{
+    return sums(tag, count_in, count_out, Mode_Bulk);
+}
+
+const char *sums10000_wait(Tag tag, unsigned count_in, unsigned count_out)
+{
+    return sums(tag, count_in, count_out, Mode_Wait);
+}
+
+const char *sums10000_unbounded(Tag tag, unsigned count_in, unsigned count_out)
+{
+    return sums(tag, count_in, count_out, Mode_Unbounded);
+}
+
+const char *layout(Tag tag, unsigned count_in, unsigned count_out)
+{
+    // The layouts only exist as MPMC queues, whatever the tag
+    (void) tag;
+    (void) count_in;
+    (void) count_out;
+
+    for (unsigned l = 0; l < LAYOUT_COUNT; l++) {
+        Layout const *layout = &layouts[l];
+
+        size_t bytes = 0;
+        void *q = NULL;
+
+        EXPECT(layout->make(64, NULL, &bytes) == QueueResult_Ok);
+
+        EXPECT(bytes > 0);
+
+        q = aligned_alloc(QUEUE_CACHELINE_BYTES, bytes);
+
+        EXPECT(layout->make(64, q, &bytes) == QueueResult_Ok);
+
+        uint32_t data = 0;
+
+        // Wrap around a few times, the cells must still come out in order
+        for (uint32_t round = 0; round < 3; round++) {
+            for (uint32_t i = 0; i < 64; i++) {
+                data = round * 64 + i;
+
+                EXPECT(layout->enqueue(q, &data) == QueueResult_Ok);
+            }
+
+            EXPECT(layout->enqueue(q, &data) == QueueResult_Full);
+
+            for (uint32_t i = 0; i < 64; i++) {
+                EXPECT(layout->dequeue(q, &data) == QueueResult_Ok);
+                EXPECT(data == round * 64 + i);
+            }
+
+            EXPECT(layout->dequeue(q, &data) == QueueResult_Empty);
+        }
+
+        free(q);
+    }
+
     return NULL;
 }
 
@@ -409,14 +1007,411 @@ struct {
     const char *name;
     Test test;
 } static tests[] = {TEST(null_pointers), TEST(create), TEST(empty), TEST(full),
-                    TEST(sums10000)};
+                    TEST(bulk),          TEST(timeout),   TEST(unbounded),
+                    TEST(layout),        TEST(sums10000), TEST(sums10000_bulk),
+                    TEST(sums10000_wait), TEST(sums10000_unbounded)};
+
+#define TEST_COUNT 12
+
+// -----------------------------------------------------------------------------
+
+typedef struct Layout_Data {
+    Layout const *layout;
+    void *q;
+    uint32_t items;
+    atomic_uint_fast64_t *sum;
+} Layout_Data;
+
+int layout_in(void *data)
+{
+    Layout_Data *info = CAST(Layout_Data *, data);
+
+    for (uint64_t i = 1; i <= info->items; i++) {
+        uint32_t item = (uint32_t) i;
+
+        while (info->layout->enqueue(info->q, &item) != QueueResult_Ok)
+            ;
+    }
+
+    return 0;
+}
+
+int layout_out(void *data)
+{
+    Layout_Data *info = CAST(Layout_Data *, data);
+
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i < info->items; i++) {
+        uint32_t item = 0;
+
+        while (info->layout->dequeue(info->q, &item) != QueueResult_Ok)
+            ;
+
+        sum += item;
+    }
+
+    atomic_fetch_add_explicit(info->sum, sum, memory_order_relaxed);
+
+    return 0;
+}
+
+// Moves items through every cell layout with threads producers and as many
+// consumers. The queue is small enough to stay in cache, so the time left is
+// mostly cache lines moving between the cores.
+int layout_benchmark(unsigned threads, uint32_t items)
+{
+    printf("%u producers, %u consumers, %u items each\n", threads, threads,
+           items);
+
+    for (unsigned l = 0; l < LAYOUT_COUNT; l++) {
+        Layout const *layout = &layouts[l];
+
+        size_t bytes = 0;
+
+        layout->make(1 << 10, NULL, &bytes);
+
+        void *q = aligned_alloc(QUEUE_CACHELINE_BYTES, bytes);
+
+        if (!q || layout->make(1 << 10, q, &bytes) != QueueResult_Ok) {
+            return 1;
+        }
+
+        thrd_t in_threads[QUEUE_TEST_THREADS_MAX];
+        thrd_t out_threads[QUEUE_TEST_THREADS_MAX];
+
+        atomic_uint_fast64_t sum = ATOMIC_VAR_INIT(0);
+
+        Layout_Data data = {layout, q, items, &sum};
+
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (unsigned i = 0; i < threads; i++) {
+            thrd_create(&in_threads[i], layout_in, &data);
+            thrd_create(&out_threads[i], layout_out, &data);
+        }
+
+        for (unsigned i = 0; i < threads; i++) {
+            thrd_join(in_threads[i], NULL);
+            thrd_join(out_threads[i], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
 
-#define TEST_COUNT 5
+        free(q);
+
+        double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+                    (end.tv_nsec - start.tv_nsec);
+        double total = (double) threads * items;
+
+        printf("%-10s %8.1f ns/item %8.2f Mitems/s\n", layout->name,
+               ns / total, total * 1e3 / ns);
+
+        if (atomic_load(&sum) != threads * (items * (items + 1ULL) / 2)) {
+            printf("%s: wrong sum\n", layout->name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct Bench_Stats {
+    uint64_t ok;
+    uint64_t contention;
+    uint64_t full_or_empty;
+    uint8_t pad[QUEUE_CACHELINE_BYTES - 3 * sizeof(uint64_t)];
+} Bench_Stats;
+
+typedef struct Bench_Data {
+    Tag tag;
+    void *q;
+    uint32_t items;
+    atomic_uint producers_left;
+    atomic_int go;
+    Bench_Stats in[QUEUE_TEST_THREADS_MAX];
+    Bench_Stats out[QUEUE_TEST_THREADS_MAX];
+} Bench_Data;
+
+typedef struct Bench_Thread {
+    Bench_Data *bench;
+    unsigned index;
+    unsigned cpu;
+} Bench_Thread;
+
+// Pin the calling thread, round robin over the online cores
+void pin_to_cpu(unsigned cpu)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return;
+    }
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % cpus, &set);
+
+    // Best effort, an unpinned run is still a run
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+int bench_in(void *data)
+{
+    Bench_Thread *thread = CAST(Bench_Thread *, data);
+    Bench_Data *bench = thread->bench;
+    Bench_Stats stats = {0};
+
+    Data item = {11.0f, 22, {0}};
+
+    pin_to_cpu(thread->cpu);
+
+    while (!atomic_load_explicit(&bench->go, memory_order_acquire))
+        ;
+
+    while (stats.ok < bench->items) {
+        switch (try_enqueue(bench->tag, bench->q, &item)) {
+        case QueueResult_Ok:
+            stats.ok++;
+            break;
+        case QueueResult_Contention:
+            stats.contention++;
+            break;
+        default:
+            stats.full_or_empty++;
+            break;
+        }
+    }
+
+    bench->in[thread->index] = stats;
+
+    atomic_fetch_sub_explicit(&bench->producers_left, 1, memory_order_release);
+
+    return 0;
+}
+
+int bench_out(void *data)
+{
+    Bench_Thread *thread = CAST(Bench_Thread *, data);
+    Bench_Data *bench = thread->bench;
+    Bench_Stats stats = {0};
+
+    Data item;
+
+    pin_to_cpu(thread->cpu);
+
+    while (!atomic_load_explicit(&bench->go, memory_order_acquire))
+        ;
+
+    for (;;) {
+        // Empty after the last producer finished: nothing more will come
+        int last = !atomic_load_explicit(&bench->producers_left,
+                                         memory_order_acquire);
+
+        QueueResult_t result = try_dequeue(bench->tag, bench->q, &item);
+
+        if (result == QueueResult_Ok) {
+            stats.ok++;
+        } else if (result == QueueResult_Contention) {
+            stats.contention++;
+        } else if (last) {
+            break;
+        } else {
+            stats.full_or_empty++;
+        }
+    }
+
+    bench->out[thread->index] = stats;
+
+    return 0;
+}
+
+// One CSV row for the queue kind of tag. Single producer/consumer kinds run
+// with one producer/consumer whatever is asked.
+int bench_run(Tag tag, unsigned producers, unsigned consumers, uint32_t items)
+{
+    if (tag == Spsc || tag == Spmc) {
+        producers = 1;
+    }
+    if (tag == Spsc || tag == Mpsc) {
+        consumers = 1;
+    }
+
+    size_t bytes = 0;
+
+    make(tag, 1 << 10, NULL, &bytes);
+
+    void *q = aligned_alloc(QUEUE_CACHELINE_BYTES, bytes);
+
+    if (!q || make(tag, 1 << 10, q, &bytes) != QueueResult_Ok) {
+        return 1;
+    }
+
+    Bench_Data *bench = aligned_alloc(QUEUE_CACHELINE_BYTES, sizeof(*bench));
+
+    if (!bench) {
+        return 1;
+    }
+
+    memset(bench, 0, sizeof(*bench));
+
+    bench->tag = tag;
+    bench->q = q;
+    bench->items = items;
+    atomic_init(&bench->producers_left, producers);
+    atomic_init(&bench->go, 0);
+
+    thrd_t threads[2 * QUEUE_TEST_THREADS_MAX];
+    Bench_Thread infos[2 * QUEUE_TEST_THREADS_MAX];
+
+    // Producers on the first cores, consumers on the next ones
+    for (unsigned i = 0; i < producers + consumers; i++) {
+        int in = i < producers;
+
+        infos[i].bench = bench;
+        infos[i].index = in ? i : i - producers;
+        infos[i].cpu = i;
+
+        if (thrd_create(&threads[i], in ? bench_in : bench_out, &infos[i]) !=
+            thrd_success) {
+            return 1;
+        }
+    }
+
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    atomic_store_explicit(&bench->go, 1, memory_order_release);
+
+    for (unsigned i = 0; i < producers + consumers; i++) {
+        thrd_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    Bench_Stats in = {0};
+    Bench_Stats out = {0};
+
+    for (unsigned i = 0; i < producers; i++) {
+        in.ok += bench->in[i].ok;
+        in.contention += bench->in[i].contention;
+        in.full_or_empty += bench->in[i].full_or_empty;
+    }
+
+    for (unsigned i = 0; i < consumers; i++) {
+        out.ok += bench->out[i].ok;
+        out.contention += bench->out[i].contention;
+        out.full_or_empty += bench->out[i].full_or_empty;
+    }
+
+    free(bench);
+    free(q);
+
+    if (out.ok != in.ok) {
+        fprintf(stderr, "%s: %llu enqueued, %llu dequeued\n",
+                tag_to_name[tag], (unsigned long long) in.ok,
+                (unsigned long long) out.ok);
+        return 1;
+    }
+
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    uint64_t in_calls = in.ok + in.contention + in.full_or_empty;
+    uint64_t out_calls = out.ok + out.contention + out.full_or_empty;
+
+    // One op is one element through the queue, enqueued and dequeued
+    printf("%s,%u,%u,%llu,%.6f,%.0f,%.6f,%.6f,%.6f,%.6f\n", tag_to_name[tag],
+           producers, consumers, (unsigned long long) in.ok, seconds,
+           in.ok / seconds, (double) in.contention / in_calls,
+           (double) in.full_or_empty / in_calls,
+           (double) out.contention / out_calls,
+           (double) out.full_or_empty / out_calls);
+
+    fflush(stdout);
+
+    return 0;
+}
+
+int benchmark(unsigned producers, unsigned consumers, uint32_t items)
+{
+    printf("queue,producers,consumers,ops,seconds,ops_per_sec,"
+           "enqueue_contention_rate,enqueue_full_rate,"
+           "dequeue_contention_rate,dequeue_empty_rate\n");
+
+    for (unsigned tag = 0; tag < (Max + 1); tag++) {
+        if (bench_run(tag, producers, consumers, items)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// A count given on the command line, 0 if it is not a number from 1 to max
+static unsigned long parse_count(const char *arg, unsigned long max)
+{
+    char *end;
+
+    // strtoul would happily negate a negative number
+    if (arg[0] < '0' || arg[0] > '9') {
+        return 0;
+    }
+
+    errno = 0;
+    unsigned long count = strtoul(arg, &end, 10);
+
+    if (errno != 0 || *end != '\0' || count > max) {
+        return 0;
+    }
+
+    return count;
+}
 
 int main(int arg_count, char **args)
 {
-    (void) arg_count;
-    (void) args;
+    // test bench [producers [consumers [items]]]: throughput of every queue
+    // kind as CSV instead of tests, items per producer
+    if (arg_count > 1 && strcmp(args[1], "bench") == 0) {
+        unsigned producers =
+            arg_count > 2 ? parse_count(args[2], QUEUE_TEST_THREADS_MAX) : 4;
+        unsigned consumers = arg_count > 3
+                                 ? parse_count(args[3], QUEUE_TEST_THREADS_MAX)
+                                 : producers;
+        uint32_t items =
+            arg_count > 4 ? parse_count(args[4], UINT32_MAX) : 1000000;
+
+        if (producers == 0 || consumers == 0 || items == 0) {
+            fprintf(stderr,
+                    "usage: %s bench [producers [consumers [items]]]\n",
+                    args[0]);
+            return 1;
+        }
+
+        return benchmark(producers, consumers, items);
+    }
+
+    // test layout [threads [items]]: cell layout benchmark instead of tests
+    if (arg_count > 1 && strcmp(args[1], "layout") == 0) {
+        unsigned threads =
+            arg_count > 2 ? parse_count(args[2], QUEUE_TEST_THREADS_MAX) : 2;
+        uint32_t items =
+            arg_count > 3 ? parse_count(args[3], QUEUE_TEST_LAYOUT_ITEMS_MAX)
+                          : 1000000;
+
+        if (threads == 0 || items == 0) {
+            fprintf(stderr, "usage: %s layout [threads [items]]\n", args[0]);
+            return 1;
+        }
+
+        return layout_benchmark(threads, items);
+    }
 
     struct {
         unsigned count_in;